@@ -0,0 +1,137 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Bounded, lock-free multi-producer/single-consumer queue
+//    Any number of contexts (the main loop, interrupt handlers, host threads) may push at the same
+//    time, but only one context may pop at a time. Every cell carries a sequence number telling
+//    producers and the consumer whose turn it is, so neither side ever disables interrupts or
+//    waits on the other: a producer that gets interrupted after claiming a cell simply leaves the
+//    cell invisible to the consumer until it has published the element.
+//
+//    _T: The element type, should be cheap to copy (ie. a pointer)
+//    _Capacity: The maximum number of elements in the queue, must be a power of two
+template<typename _T, size_t _Capacity>
+class MPSC_Queue
+{
+	static_assert(_Capacity >= 2 && (_Capacity & (_Capacity - 1)) == 0, "MPSC_Queue: capacity must be a power of two");
+
+	static const uint32_t mask = _Capacity - 1;
+
+	struct cell {
+		std::atomic<uint32_t> sequence;		// == position: free for the producer claiming 'position', == position + 1: holds data
+		_T data;
+	};
+
+	cell cells[_Capacity];
+	std::atomic<uint32_t> tail;				// Next position a producer will claim
+	std::atomic<uint32_t> head;				// Next position the consumer will read
+
+public:
+	MPSC_Queue();
+
+	// Appends an element to the end of the queue, safe to call from any context
+	//    elem: The element to append
+	//    returns false if the queue is full, the element is not appended in that case
+	bool push(const _T& elem);
+
+	// Removes the first element of the queue, only one context may pop at a time
+	//    elem: Where to store the removed element
+	//    returns false if the queue is empty (or the first element hasn't been published yet)
+	bool pop(_T& elem);
+
+	// Copies the first element of the queue without removing it, consumer only
+	//    elem: Where to store the copied element
+	//    returns false if the queue is empty (or the first element hasn't been published yet)
+	bool peek(_T& elem) const;
+
+	// Returns whether the queue is empty, elements that are still being pushed count as present
+	bool empty() const;
+
+	// Returns the number of elements in the queue, including ones that are still being pushed
+	//    NOTE: only a snapshot when other contexts are pushing
+	size_t size() const;
+
+	// Returns the maximum number of elements in the queue
+	static constexpr size_t capacity() { return _Capacity; }
+};
+
+
+template<typename _T, size_t _Capacity>
+MPSC_Queue<_T, _Capacity>::MPSC_Queue() :
+	tail(0),
+	head(0)
+{
+	for (uint32_t i = 0; i < _Capacity; ++i)
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+
+template<typename _T, size_t _Capacity>
+bool MPSC_Queue<_T, _Capacity>::push(const _T& elem)
+{
+	uint32_t position = tail.load(std::memory_order_relaxed);
+	cell* target;
+	for (;;)
+	{
+		target = &cells[position & mask];
+		int32_t turn = (int32_t)(target->sequence.load(std::memory_order_acquire) - position);
+
+		if (turn == 0)		// The cell is free, try to claim it
+		{
+			if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (turn < 0)	// The cell still holds the element from one lap ago, the queue is full
+			return false;
+		else				// Another producer claimed the cell first
+			position = tail.load(std::memory_order_relaxed);
+	}
+
+	target->data = elem;
+	target->sequence.store(position + 1, std::memory_order_release);
+	return true;
+}
+
+
+template<typename _T, size_t _Capacity>
+bool MPSC_Queue<_T, _Capacity>::pop(_T& elem)
+{
+	uint32_t position = head.load(std::memory_order_relaxed);
+	cell& target = cells[position & mask];
+	if (target.sequence.load(std::memory_order_acquire) != position + 1)
+		return false;
+
+	elem = target.data;
+	target.sequence.store(position + _Capacity, std::memory_order_release);
+	head.store(position + 1, std::memory_order_release);
+	return true;
+}
+
+
+template<typename _T, size_t _Capacity>
+bool MPSC_Queue<_T, _Capacity>::peek(_T& elem) const
+{
+	uint32_t position = head.load(std::memory_order_relaxed);
+	const cell& target = cells[position & mask];
+	if (target.sequence.load(std::memory_order_acquire) != position + 1)
+		return false;
+
+	elem = target.data;
+	return true;
+}
+
+
+template<typename _T, size_t _Capacity>
+inline bool MPSC_Queue<_T, _Capacity>::empty() const
+{
+	return head.load() == tail.load();
+}
+
+
+template<typename _T, size_t _Capacity>
+inline size_t MPSC_Queue<_T, _Capacity>::size() const
+{
+	return tail.load() - head.load();
+}
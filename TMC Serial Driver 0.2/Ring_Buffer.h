@@ -1,32 +1,61 @@
 #ifndef WRAP_h
 #define WRAP_h
 #include <algorithm>
+#include <iterator>
+#include <string.h>
 
-#define WRAP_DEFAULT_CAPACITY 64u					// Default container capacity
+#define WRAP_DEFAULT_CAPACITY 64u					// Default container capacity (must be a power of two)
 #define WRAP_RESIZE_WEIGHT 0.2f						// Default multiplier used for reallocation, reallocate(capacity * WRAP_RESIZE_WEIGHT);
 #define WRAP_NORMALIZE_REALLOCATE_BIAS 0.8f			// Default multiplier used in normalization, if size > WRAP_NORMALIZ_REALLOCATE_BIAS * capacity, then reallocate
 
 
+// A circular buffer with a power of two capacity
+//    Elements are addressed by free running indices that are masked into the memory block, so
+//    pushing and popping never moves data around. The live elements occupy at most two contiguous
+//    segments of the memory block (before and after the wrap-around), which 'peek()' and 'prepare()'
+//    expose directly so elements can be consumed or produced in place.
 template<typename _T>
 class Ring_Buffer
 {
 	_T* _front;										// Pointer to the first element of the allocated memory space
-	_T* _back;										// Pointer to just past the last element of the allocated memory space
-	_T* _first;										// Pointer to the first element in memory
-	_T* _last;										// Pointer to just past the last element in memory
+	size_t _mask;									// capacity - 1, used to wrap the indices into the memory space
+	size_t _first;									// Index of the first element in the container
+	size_t _last;									// Index just past the last element in the container
 
 	// reallocates the memory to a new larger block
 	void reallocate();
 
 	// reallocates the memory to a new larger block
 	//		_numElem:
-	//			Number of elements to increase the size by
+	//			Number of elements to increase the size by (the capacity is rounded up to a power of two)
 	void reallocate(const size_t _numElem);
 
+	// Returns the smallest power of two that is not less than 'n'
+	static size_t round_capacity(size_t n);
+
+	// Copies '_numElem' elements starting at index 'from' into 'buffer', following the wrap-around
+	void copy_out(_T* buffer, size_t from, const size_t _numElem) const;
+
+	// Returns the index of the first element equal to 'elem', or _last if there is none
+	size_t index_of(const _T& elem) const;
+
 public:
 	// Ring_Buffer<_T>'s iterator
 	class iterator;
 
+	// A contiguous run of elements inside the memory block
+	struct span {
+		_T* data;		// Pointer to the first element of the run
+		size_t size;	// Number of elements in the run
+	};
+
+	// The (at most) two runs the elements are split into by the wrap-around
+	struct span_pair {
+		span first;		// Run starting at the front of the container
+		span second;	// Run that continues at the beginning of the memory block, empty if there is no wrap-around
+		size_t size() const { return first.size + second.size; }
+	};
+
 	// returns the iterator of the first element in the container
 	iterator begin() const;
 
@@ -38,7 +67,7 @@ public:
 
 	// Non-Default constructor
 	//		reserve:
-	//			Size (in _T elements) to initialize the container as.
+	//			Size (in _T elements) to initialize the container as, rounded up to a power of two.
 	Ring_Buffer(const size_t reserve);
 
 	// Default destructor
@@ -53,14 +82,18 @@ public:
 	// Returns whether the container is empty
 	bool empty() const volatile;
 
+	// Returns whether the container is full, the next push will reallocate
+	bool full() const;
+
 	// Normalizes the container
-	//		- Shifts all elements to the front of the memory block
 	//		- Reallocates the memory block to a larger block if the container is near capacity
+	//		NOTE: Elements are never shifted anymore, the wrap-around takes care of that
 	bool normalize();
-	
+
 	// Appends the element to the end of the container
 	//		_elem:
 	//			Element to be appended
+	//		Returns true if the container had to be reallocated
 	bool push(const _T& _elem);
 
 	// Appends an array of elements to the end of the container
@@ -70,6 +103,7 @@ public:
 	//			Number of elements in 'buffer' to be appended
 	//		NOTE:	_numElem must not be more than the size of buffer!
 	//				i.e. 'buffer' to 'buffer + _numElem' must be initiallized memory!
+	//		Returns true if the container had to be reallocated
 	bool push(const _T* const buffer, const size_t _numElem);
 
 	// Removes the first element in the container
@@ -95,6 +129,16 @@ public:
 	//		NOTE: returns the default element '_T()' if container is empty, consider testing if empty before use.
 	_T pull(bool popOff = true);
 
+	// Copies the first elements of the container into a caller supplied buffer
+	//		buffer:
+	//			Where to copy the elements to, must have room for '_numElem' elements
+	//		_numElem:
+	//			The maximum number of elements to copy from the front of the container
+	//		popOff:
+	//			Determines whether to leave the copied elements or whether to remove them.
+	//		Returns the number of elements copied, which is less than '_numElem' if the container holds fewer
+	size_t pull(_T* buffer, const size_t _numElem, bool popOff = true);
+
 	// Copies the first '_numElem' elements of the container
 	//		_numElem:
 	//			The number of elements to copy from the front of the container
@@ -102,6 +146,7 @@ public:
 	//			Determines whether to leave the copied elements or whether to remove them.
 	//		NOTE: if the number of elements requested is larger than the number of elements in the container
 	//					then the function returns nullptr, consider checking the return value.
+	//		WARNING: allocates, prefer 'pull(buffer, _numElem)' or 'peek()'
 	_T* pull(const size_t _numElem, bool popOff = true);
 
 	// Copies the elements in the container up to and including the terminator
@@ -111,8 +156,23 @@ public:
 	//			Determines whether to leave the copied elements or whether to remove them.
 	//		NOTE: if there is no element equal to 'term' in the container, then nullptr is returned;
 	//					consider checking the return value.
+	//		WARNING: allocates, prefer 'find()' with 'pull(buffer, _numElem)' or 'peek()'
 	_T* pull(const _T& term, bool popOff = true);
 
+	// Returns views of the elements in the container without copying them
+	//		NOTE: the views are invalidated by anything that pushes to the container
+	span_pair peek() const;
+
+	// Removes '_numElem' elements previously inspected through 'peek()'
+	void consume(const size_t _numElem);
+
+	// Returns views of the free space just past the last element, fill them and then call 'commit()'
+	//		NOTE: does not reallocate, the views are empty when the container is full
+	span_pair prepare();
+
+	// Appends '_numElem' elements previously written through 'prepare()'
+	void commit(const size_t _numElem);
+
 
 	// Returns an iterator to the first instance of 'elem' in the container.
 	//		elem:
@@ -124,25 +184,39 @@ public:
 
 
 // Ring_Buffer<_T>'s iterator
+//    A random access iterator that follows the wrap-around, so it works with the standard algorithms.
 template<typename _T>
 class Ring_Buffer<_T>::iterator {
-	const _T* _ptr;
+	const _T* _buffer;		// The memory block of the container
+	size_t _mask;			// The containers capacity - 1
+	size_t _index;			// Free running index of the element this iterator points to
 
 public:
+	typedef std::random_access_iterator_tag iterator_category;
+	typedef _T value_type;
+	typedef ptrdiff_t difference_type;
+	typedef const _T* pointer;
+	typedef const _T& reference;
+
 	iterator();
-	iterator(const _T* ptr);
+	iterator(const _T* buffer, size_t mask, size_t index);
 	iterator(const iterator& itr);
 
 	~iterator();
 
+	// Returns a pointer to the element, not meant for pointer arithmetic (elements may wrap around)
 	operator const _T*() const;
 
 	iterator& operator=(const iterator& itr);
 
 	const _T& operator*() const;
+	const _T* operator->() const;
+	const _T& operator[](const int& rhs) const;
 	iterator operator+(const int& rhs) const;
 	iterator operator-(const int& rhs) const;
 	int operator-(const iterator& rhs) const;
+	iterator& operator+=(const int& rhs);
+	iterator& operator-=(const int& rhs);
 
 	iterator&  operator++();
 	iterator operator++(int);
@@ -152,6 +226,7 @@ public:
 	bool operator<(const iterator& rhs) const;
 	bool operator>(const iterator& rhs) const;
 	bool operator==(const iterator& rhs) const;
+	bool operator!=(const iterator& rhs) const;
 	bool operator<=(const iterator& rhs) const;
 	bool operator>=(const iterator& rhs) const;
 };
@@ -161,36 +236,69 @@ public:
 template<typename _T>
 inline void Ring_Buffer<_T>::reallocate()
 {
-	reallocate(WRAP_RESIZE_WEIGHT * capacity());
+	reallocate(WRAP_RESIZE_WEIGHT * capacity() + 1);
 }
 
 
 // reallocates the memory to a new larger block
 //		_numElem:
-//			Number of elements to increase the size by
+//			Number of elements to increase the size by (the capacity is rounded up to a power of two)
 template<typename _T>
 void Ring_Buffer<_T>::reallocate(const size_t _numElem)
 {
-	_T* newFront = new _T[capacity() + _numElem];
-	memmove(newFront, _first, sizeof(_T) * size());
+	const size_t newCapacity = round_capacity(capacity() + _numElem);
+	const size_t count = size();
+
+	_T* newFront = new _T[newCapacity];
+	copy_out(newFront, _first, count);
 	delete[] _front;
 
-	_back = newFront + capacity() + _numElem;
 	_front = newFront;
-	_last = _front + size();
-	_first = _front;
+	_mask = newCapacity - 1;
+	_first = 0;
+	_last = count;
 
 #ifdef _DEBUG	// if in debug, set memory to 0
-	memset(_last, 0, sizeof(_T) * (capacity() - size()));
+	memset(_front + count, 0, sizeof(_T) * (newCapacity - count));
 #endif
 }
 
 
+// Returns the smallest power of two that is not less than 'n'
+template<typename _T>
+inline size_t Ring_Buffer<_T>::round_capacity(size_t n)
+{
+	size_t capacity = 1;
+	while (capacity < n)
+		capacity <<= 1;
+	return capacity;
+}
+
+
+// Copies '_numElem' elements starting at index 'from' into 'buffer', following the wrap-around
+template<typename _T>
+inline void Ring_Buffer<_T>::copy_out(_T* buffer, size_t from, const size_t _numElem) const
+{
+	const size_t start = from & _mask;
+	const size_t firstRun = std::min(_numElem, capacity() - start);
+	memmove(buffer, _front + start, sizeof(_T) * firstRun);
+	memmove(buffer + firstRun, _front, sizeof(_T) * (_numElem - firstRun));
+}
+
+
+// Returns the index of the first element equal to 'elem', or _last if there is none
+template<typename _T>
+inline size_t Ring_Buffer<_T>::index_of(const _T& elem) const
+{
+	return _first + (std::find(begin(), end(), elem) - begin());
+}
+
+
 // returns the iterator of the first element in the container
 template<typename _T>
 inline typename Ring_Buffer<_T>::iterator Ring_Buffer<_T>::begin() const
 {
-	return iterator(_first);
+	return iterator(_front, _mask, _first);
 }
 
 
@@ -198,29 +306,29 @@ inline typename Ring_Buffer<_T>::iterator Ring_Buffer<_T>::begin() const
 template<typename _T>
 inline typename Ring_Buffer<_T>::iterator Ring_Buffer<_T>::end() const
 {
-	return iterator(_last);
+	return iterator(_front, _mask, _last);
 }
 
 
 // default constructor
 template<typename _T>
 Ring_Buffer<_T>::Ring_Buffer() :
-	_front(new _T[WRAP_DEFAULT_CAPACITY]),
-	_back(_front + WRAP_DEFAULT_CAPACITY),
-	_first(_front),
-	_last(_front)
+	_front(new _T[round_capacity(WRAP_DEFAULT_CAPACITY)]),
+	_mask(round_capacity(WRAP_DEFAULT_CAPACITY) - 1),
+	_first(0),
+	_last(0)
 {}
 
 
 // Non-Default constructor
 //		reserve:
-//			Size (in elements) to initialize the container as.
+//			Size (in elements) to initialize the container as, rounded up to a power of two.
 template<typename _T>
 Ring_Buffer<_T>::Ring_Buffer(const size_t reserve) :
-	_front(new _T[reserve]),
-	_back(_front + reserve),
-	_first(_front),
-	_last(_front)
+	_front(new _T[round_capacity(reserve)]),
+	_mask(round_capacity(reserve) - 1),
+	_first(0),
+	_last(0)
 {}
 
 
@@ -244,20 +352,28 @@ inline size_t Ring_Buffer<_T>::size() const
 template<typename _T>
 inline size_t Ring_Buffer<_T>::capacity() const
 {
-	return _back - _front;
+	return _mask + 1;
 }
 
 // Returns whether the container is empty
 template<typename _T>
 inline bool Ring_Buffer<_T>::empty() const volatile
 {
-	return !(_first < _last);
+	return _first == _last;
+}
+
+
+// Returns whether the container is full, the next push will reallocate
+template<typename _T>
+inline bool Ring_Buffer<_T>::full() const
+{
+	return size() == capacity();
 }
 
 
 // Normalizes the container
-//		- Shifts all elements to the front of the memory block
 //		- Reallocates the memory block to a larger block if the container is near capacity
+//		NOTE: Elements are never shifted anymore, the wrap-around takes care of that
 template<typename _T>
 inline bool Ring_Buffer<_T>::normalize()
 {
@@ -266,18 +382,7 @@ inline bool Ring_Buffer<_T>::normalize()
 		reallocate();
 		return true;
 	}
-	if (_first == _front)
-	{
-		return false;
-	}
-	memmove(_front, _first, sizeof(_T) * size());
-	_last = _front + size();
-	_first = _front;
-
-	#ifdef _DEBUG	// if in debug, set memory to 0
-	memset(_last, 0, sizeof(_T) * (_back - _last));
-	#endif
-	return true;
+	return false;
 }
 
 
@@ -287,28 +392,17 @@ inline bool Ring_Buffer<_T>::normalize()
 template<typename _T>
 bool Ring_Buffer<_T>::push(const _T& _elem)
 {
-	if (_last == _back) {
-		if (_first == _front)
-		{
-			reallocate();
-		}
-		else {
-			memmove(_front, _first, sizeof(_T) * (_last - _first));
-			_last = _front + size();
-			_first = _front;
-
-#ifdef _DEBUG
-			memset(_last, 0, sizeof(_T) * (_back - _last));
-#endif
-		}
-		*_last = _elem;
-		++_last;
-		return true;
+	bool reallocated = false;
+	if (full())
+	{
+		reallocate();
+		reallocated = true;
 	}
-	*_last = _elem;
+
+	_front[_last & _mask] = _elem;
 	++_last;
 
-	return false;
+	return reallocated;
 }
 
 
@@ -322,30 +416,20 @@ bool Ring_Buffer<_T>::push(const _T& _elem)
 template<typename _T>
 bool Ring_Buffer<_T>::push(const _T * const buffer, const size_t _numElem)
 {
-	if (!(_back - _last > _numElem))
+	bool reallocated = false;
+	if (capacity() - size() < _numElem)
 	{
-		if (capacity() - size() < _numElem)
-		{
-			reallocate((WRAP_RESIZE_WEIGHT + 1.0f) * _numElem);
-			memmove(_last, buffer, sizeof(_T) * _numElem);
-			_last += _numElem;
-		}
-		else {
-			memmove(_front, _first, sizeof(_T) * size());
-			memmove(_front + size(), buffer, sizeof(_T) * _numElem);
-			_last = _front + size() + _numElem;
-			_first = _front;
-
-			#ifdef _DEBUG 	// if in debug, set memory to 0
-			memset(_last, 0, sizeof(_T) * (_back - _last));
-			#endif
-		}
-		return true;
+		reallocate((WRAP_RESIZE_WEIGHT + 1.0f) * _numElem);
+		reallocated = true;
 	}
-	memmove(_last, buffer, sizeof(_T) * _numElem);
+
+	const size_t start = _last & _mask;
+	const size_t firstRun = std::min(_numElem, capacity() - start);
+	memmove(_front + start, buffer, sizeof(_T) * firstRun);
+	memmove(_front, buffer + firstRun, sizeof(_T) * (_numElem - firstRun));
 	_last += _numElem;
 
-	return false;
+	return reallocated;
 }
 
 
@@ -357,7 +441,7 @@ inline void Ring_Buffer<_T>::pop()
 		return;
 
 	#ifdef _DEBUG 	// if in debug, set memory to 0
-	memset(_first, 0, sizeof(_T));
+	memset(_front + (_first & _mask), 0, sizeof(_T));
 	#endif
 	++_first;
 }
@@ -369,10 +453,13 @@ inline void Ring_Buffer<_T>::pop()
 template<typename _T>
 inline void Ring_Buffer<_T>::pop(const size_t _numElem)
 {
+	const size_t count = std::min(_numElem, size());
+
 #ifdef _DEBUG 	// if in debug, set memory to 0
-	memset(_first, 0, sizeof(_T) * _numElem);
+	for (size_t i = 0; i < count; ++i)
+		memset(_front + ((_first + i) & _mask), 0, sizeof(_T));
 #endif
-	_first += _numElem;
+	_first += count;
 }
 
 
@@ -383,14 +470,9 @@ inline void Ring_Buffer<_T>::pop(const size_t _numElem)
 template<typename _T>
 void Ring_Buffer<_T>::pop(const _T& term)
 {
-	_T* termPtr = std::find(_first, _last, term);
-	if (termPtr != _last)
-	{
-#ifdef _DEBUG	// if in debug, set memory to 0
-		memset(_first, 0, sizeof(_T) * (termPtr - _first + 1));
-#endif
-		_first += termPtr - _first + 1;
-	}
+	const size_t termIndex = index_of(term);
+	if (termIndex != _last)
+		pop(termIndex - _first + 1);
 }
 
 
@@ -399,11 +481,11 @@ template<typename _T>
 inline void Ring_Buffer<_T>::clear()
 {
 #ifdef _DEBUG	// if in debug, set memory to 0
-	memset(_first, 0, sizeof(_T)*size());
+	memset(_front, 0, sizeof(_T) * capacity());
 #endif
 
-	_first = _front;
-	_last = _front;
+	_first = 0;
+	_last = 0;
 }
 
 
@@ -416,8 +498,8 @@ inline _T Ring_Buffer<_T>::pull(bool popOff)
 {
 	if (_first == _last)
 		return _T();
-	
-	_T output = *_first;
+
+	_T output = _front[_first & _mask];
 	if (popOff)
 		pop();
 
@@ -425,6 +507,27 @@ inline _T Ring_Buffer<_T>::pull(bool popOff)
 }
 
 
+// Copies the first elements of the container into a caller supplied buffer
+//		buffer:
+//			Where to copy the elements to, must have room for '_numElem' elements
+//		_numElem:
+//			The maximum number of elements to copy from the front of the container
+//		popOff:
+//			Determines whether to leave the copied elements or whether to remove them.
+//		Returns the number of elements copied, which is less than '_numElem' if the container holds fewer
+template<typename _T>
+size_t Ring_Buffer<_T>::pull(_T* buffer, const size_t _numElem, bool popOff)
+{
+	const size_t count = std::min(_numElem, size());
+	copy_out(buffer, _first, count);
+
+	if (popOff)
+		pop(count);
+
+	return count;
+}
+
+
 // Copies the first '_numElem' elements of the container
 //		_numElem:
 //			The number of elements to copy from the front of the container
@@ -438,14 +541,9 @@ _T* Ring_Buffer<_T>::pull(const size_t _numElem, bool popOff)
 {
 	if (_numElem > size())
 		return nullptr;
-	
-	_T* const buffer = new _T[_numElem];
-	memmove(buffer, _first, sizeof(_T) * _numElem);
 
-	if (popOff)
-	{
-		pop(_numElem);
-	}
+	_T* const buffer = new _T[_numElem];
+	pull(buffer, _numElem, popOff);
 
 	return buffer;
 }
@@ -462,22 +560,54 @@ _T* Ring_Buffer<_T>::pull(const size_t _numElem, bool popOff)
 template<typename _T>
 _T* Ring_Buffer<_T>::pull(const _T& term, bool popOff)
 {
-	_T* termPtr = std::find(_first, _last, term);
-	if (termPtr == _last)
+	const size_t termIndex = index_of(term);
+	if (termIndex == _last)
 		return nullptr;
 
-	_T* const buffer = new _T[termPtr - _first + 1];
-	memmove(buffer, _first, sizeof(_T) * (termPtr - _first + 1));
+	return pull(termIndex - _first + 1, popOff);
+}
 
-	if (popOff)
-	{
-		#ifdef _DEBUG	// if in debug, set memory to 0
-		memset(_first, 0, sizeof(_T) * (termPtr - _first + 1));
-		#endif
-		_first += termPtr - _first + 1;
-	}
 
-	return buffer;
+// Returns views of the elements in the container without copying them
+//		NOTE: the views are invalidated by anything that pushes to the container
+template<typename _T>
+typename Ring_Buffer<_T>::span_pair Ring_Buffer<_T>::peek() const
+{
+	const size_t start = _first & _mask;
+	const size_t firstRun = std::min(size(), capacity() - start);
+
+	span_pair spans = { { _front + start, firstRun }, { _front, size() - firstRun } };
+	return spans;
+}
+
+
+// Removes '_numElem' elements previously inspected through 'peek()'
+template<typename _T>
+inline void Ring_Buffer<_T>::consume(const size_t _numElem)
+{
+	pop(_numElem);
+}
+
+
+// Returns views of the free space just past the last element, fill them and then call 'commit()'
+//		NOTE: does not reallocate, the views are empty when the container is full
+template<typename _T>
+typename Ring_Buffer<_T>::span_pair Ring_Buffer<_T>::prepare()
+{
+	const size_t free = capacity() - size();
+	const size_t start = _last & _mask;
+	const size_t firstRun = std::min(free, capacity() - start);
+
+	span_pair spans = { { _front + start, firstRun }, { _front, free - firstRun } };
+	return spans;
+}
+
+
+// Appends '_numElem' elements previously written through 'prepare()'
+template<typename _T>
+inline void Ring_Buffer<_T>::commit(const size_t _numElem)
+{
+	_last += std::min(_numElem, capacity() - size());
 }
 
 
@@ -489,24 +619,30 @@ _T* Ring_Buffer<_T>::pull(const _T& term, bool popOff)
 template<typename _T>
 inline typename Ring_Buffer<_T>::iterator Ring_Buffer<_T>::find(const _T& elem)
 {
-	return iterator(std::find(_first, _last, elem));
+	return std::find(begin(), end(), elem);
 }
 
 
 template<typename _T>
 inline Ring_Buffer<_T>::iterator::iterator() :
-	_ptr(nullptr)
+	_buffer(nullptr),
+	_mask(0),
+	_index(0)
 {}
 
 
 template<typename _T>
-inline Ring_Buffer<_T>::iterator::iterator(const _T* ptr) :
-	_ptr(ptr)
+inline Ring_Buffer<_T>::iterator::iterator(const _T* buffer, size_t mask, size_t index) :
+	_buffer(buffer),
+	_mask(mask),
+	_index(index)
 {}
 
 template<typename _T>
 inline Ring_Buffer<_T>::iterator::iterator(const Ring_Buffer<_T>::iterator& itr) :
-	_ptr(itr._ptr)
+	_buffer(itr._buffer),
+	_mask(itr._mask),
+	_index(itr._index)
 {}
 
 
@@ -517,94 +653,129 @@ inline Ring_Buffer<_T>::iterator::~iterator()
 template<typename _T>
 inline Ring_Buffer<_T>::iterator::operator const _T*() const
 {
-	return _ptr;
+	return _buffer == nullptr ? nullptr : _buffer + (_index & _mask);
 }
 
 template<typename _T>
 inline typename Ring_Buffer<_T>::iterator & Ring_Buffer<_T>::iterator::operator=(const iterator& itr)
 {
-	_ptr = itr._ptr;
+	_buffer = itr._buffer;
+	_mask = itr._mask;
+	_index = itr._index;
 	return *this;
 }
 
 template<typename _T>
 inline const _T& Ring_Buffer<_T>::iterator::operator*() const
 {
-	return *_ptr;
+	return _buffer[_index & _mask];
+}
+
+template<typename _T>
+inline const _T* Ring_Buffer<_T>::iterator::operator->() const
+{
+	return _buffer + (_index & _mask);
+}
+
+template<typename _T>
+inline const _T& Ring_Buffer<_T>::iterator::operator[](const int& rhs) const
+{
+	return _buffer[(_index + rhs) & _mask];
 }
 
 template<typename _T>
 inline typename Ring_Buffer<_T>::iterator Ring_Buffer<_T>::iterator::operator+(const int& rhs) const
 {
-	return iterator(_ptr + rhs);
+	return iterator(_buffer, _mask, _index + rhs);
 }
 
 template<typename _T>
 inline typename Ring_Buffer<_T>::iterator Ring_Buffer<_T>::iterator::operator-(const int& rhs) const
 {
-	return iterator(_ptr - rhs);
+	return iterator(_buffer, _mask, _index - rhs);
 }
 
 template<typename _T>
 inline int Ring_Buffer<_T>::iterator::operator-(const iterator& rhs) const
 {
-	return _ptr - rhs._ptr;
+	return (int)(_index - rhs._index);
+}
+
+template<typename _T>
+inline typename Ring_Buffer<_T>::iterator& Ring_Buffer<_T>::iterator::operator+=(const int& rhs)
+{
+	_index += rhs;
+	return *this;
+}
+
+template<typename _T>
+inline typename Ring_Buffer<_T>::iterator& Ring_Buffer<_T>::iterator::operator-=(const int& rhs)
+{
+	_index -= rhs;
+	return *this;
 }
 
 template<typename _T>
 inline typename Ring_Buffer<_T>::iterator& Ring_Buffer<_T>::iterator::operator++()
 {
-	++_ptr;
+	++_index;
 	return *this;
 }
 
 template<typename _T>
 inline typename Ring_Buffer<_T>::iterator Ring_Buffer<_T>::iterator::operator++(int)
 {
-	return iterator(_ptr++);
+	return iterator(_buffer, _mask, _index++);
 }
 
 template<typename _T>
 inline typename Ring_Buffer<_T>::iterator& Ring_Buffer<_T>::iterator::operator--()
 {
-	--_ptr;
+	--_index;
 	return *this;
 }
 
 template<typename _T>
 typename Ring_Buffer<_T>::iterator Ring_Buffer<_T>::iterator::operator--(int)
 {
-	return iterator(_ptr--);
+	return iterator(_buffer, _mask, _index--);
 }
 
+// Free running indices may wrap past SIZE_MAX, so the ordering is based on their difference
 template<typename _T>
 inline bool Ring_Buffer<_T>::iterator::operator<(const iterator & rhs) const
 {
-	return _ptr < rhs._ptr;
+	return (ptrdiff_t)(_index - rhs._index) < 0;
 }
 
 template<typename _T>
 inline bool Ring_Buffer<_T>::iterator::operator>(const iterator & rhs) const
 {
-	return _ptr > rhs._ptr;
+	return (ptrdiff_t)(_index - rhs._index) > 0;
 }
 
 template<typename _T>
 inline bool Ring_Buffer<_T>::iterator::operator==(const iterator & rhs) const
 {
-	return _ptr == rhs._ptr;
+	return _index == rhs._index && _buffer == rhs._buffer;
+}
+
+template<typename _T>
+inline bool Ring_Buffer<_T>::iterator::operator!=(const iterator & rhs) const
+{
+	return !(*this == rhs);
 }
 
 template<typename _T>
 inline bool Ring_Buffer<_T>::iterator::operator<=(const iterator & rhs) const
 {
-	return _ptr <= rhs._ptr;
+	return !(*this > rhs);
 }
 
 template<typename _T>
 inline bool Ring_Buffer<_T>::iterator::operator>=(const iterator & rhs) const
 {
-	return _ptr >= rhs._ptr;
+	return !(*this < rhs);
 }
 
-#endif
\ No newline at end of file
+#endif
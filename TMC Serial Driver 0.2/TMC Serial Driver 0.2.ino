@@ -5,48 +5,83 @@
 */
 
 #include "TMC_Serial.h"
+#include "TMC_Benchmark.h"
+
+// Define to print the benchmark report (JSON) once after reset instead of running the demo,
+//    define TMC_SERIAL_STATS in TMC_Serial.h as well to include the interrupt costs
+//#define TMC_RUN_BENCHMARK
 
 TMC_Serial TMC2209(USART0, 460800);
+int8_t ioinSubscription;	// IOIN is read every 100 ms in the background
+
+// The configuration, encoded by the compiler
+constexpr TMC_Datagram gconf = TMC_Datagram::write<TMC_GCONF>(0, TMC_GCONF::internal_Rsense(1) | TMC_GCONF::mstep_reg_select(1));
+constexpr TMC_Datagram chopconf = TMC_Datagram::write<TMC_CHOPCONF>(0,
+	TMC_CHOPCONF::toff(3) | TMC_CHOPCONF::hstrt(5) | TMC_CHOPCONF::mres(6) | TMC_CHOPCONF::intpol(1));
+constexpr TMC_Datagram ihold_irun = TMC_Datagram::write<TMC_IHOLD_IRUN>(0,
+	TMC_IHOLD_IRUN::IHOLD(2) | TMC_IHOLD_IRUN::IRUN(31) | TMC_IHOLD_IRUN::IHOLDDELAY(1));
+constexpr TMC_Datagram tpwmthrs = TMC_Datagram::write<TMC_TPWMTHRS>(0, TMC_TPWMTHRS::TPWMTHRS(200));
+
+// Everything the driver needs after power-up, sent in one go and confirmed by IFCNT
+const TMC_Serial::profile_row configuration[] = {
+	{ TMC_Serial::GSTAT, 0x01, { 0x7 } },	// Clears the reset flag, GSTAT is read back at the end
+	{ TMC_Serial::GCONF, 0x01, { gconf.data() } },
+	{ TMC_Serial::CHOPCONF, 0x01, { chopconf.data() } },
+	{ TMC_Serial::IHOLD_IRUN, 0x01, { ihold_irun.data() } },
+	{ TMC_Serial::TPWMTHRS, 0x01, { tpwmthrs.data() } } };
+TMC_Serial::bring_up bringUp;
 // the setup function runs once when you press reset or power the board
 void setup() {
 	//Serial1.begin(115200);
 	Serial.begin(115200);
 	Serial.print("\n Master initiallized...");
+
+	TMC2209.stage_profile(bringUp, configuration, sizeof(configuration) / sizeof(configuration[0]));
+	TMC_Serial::start_bring_up(bringUp);
+	while (bringUp.status == TMC_Serial::bring_up::state::running)
+	{ /* wait */ }
+	Serial.print(bringUp.status == TMC_Serial::bring_up::state::verified ? "\n Driver configured in " : "\n Driver configuration failed after ");
+	Serial.print(bringUp.elapsed_us);
+	Serial.print(" us, GSTAT: ");
+	Serial.print(bringUp.gstat[0][0], BIN);
+
+	// The driver ramps VACTUAL itself: 2000 per second, with the acceleration built up over 100 ms
+	TMC2209.set_ramp(0, 2000, 20000, 10);
+
+	ioinSubscription = TMC2209.subscribe(0, TMC_Serial::IOIN, 100);
+
+#ifdef TMC_RUN_BENCHMARK
+	TMC_Serial* buses[] = { &TMC2209 };
+	TMC_Benchmark benchmark(buses, 1, 1, [](const char* text) { Serial.print(text); });
+	benchmark.run();
+	while (true)
+	{ /* report only */ }
+#endif
 }
 
 // the loop function runs over and over again until power down or reset
 void loop() {
-	TMC2209.write(0, TMC_Serial::GCONF, (1 << 1) | (1 << 7));
-	TMC2209.write(0, TMC_Serial::CHOPCONF, 0b00010110000000000000000001010011);
-	TMC2209.write(0, TMC_Serial::IHOLD_IRUN, (2 << 0) | (31 << 8) | (1 << 16));
-	TMC2209.write(0, TMC_Serial::TPWMTHRS, 200);
-
-	uint32_t read_data;
-	volatile TMC_Serial::read_ticket* r_ticket = TMC2209.read(0, TMC_Serial::IOIN, TMC_Serial::storeRegisterAt, &read_data);
-	while (!(r_ticket->transfer_complete()))
-	{ /* wait for transfer */ }
-
-	Serial.print("\n\n ENA: ");
-	Serial.print(read_data & (1 << 0) ? "Disabled" : "Enabled");
-	Serial.print("\n Status: ");
-	Serial.print(r_ticket->status);
-	Serial.print("\n Data: ");
-	Serial.print(read_data, BIN);
-	delete r_ticket;
-
-	for (int32_t i = 0000; i < 20000; )
+	TMC_Serial::snapshot ioin;
+	if (TMC2209.read_snapshot(ioinSubscription, ioin))
 	{
-		TMC2209.write(0, TMC_Serial::VACTUAL, i);
-		i += 20;
-		delay(10);
+		Serial.print("\n\n ENA: ");
+		Serial.print(TMC_IOIN::ENN::get(ioin.value) ? "Disabled" : "Enabled");
+		Serial.print("\n Status: ");
+		Serial.print(ioin.status);
+		Serial.print("\n Data: ");
+		Serial.print(ioin.value, BIN);
 	}
-	delay(2000);
-	for (int32_t i = 20000; i > 0; )
+
+	TMC_Serial::ramp_state ramp;
+	TMC2209.ramp_to(0, 20000);
+	delay(12000);
+	TMC2209.ramp_to(0, 0);
+	delay(12000);
+	if (TMC2209.read_ramp(0, ramp))
 	{
-		i -= 200;
-		TMC2209.write(0, TMC_Serial::VACTUAL, i);
+		Serial.print("\n Ramp updates/s: ");
+		Serial.print(ramp.update_rate);
+		Serial.print(", put off: ");
+		Serial.print(ramp.skipped);
 	}
-
-	TMC2209.write(0, TMC_Serial::VACTUAL, 0);
-	delay(2000);
 }
\ No newline at end of file
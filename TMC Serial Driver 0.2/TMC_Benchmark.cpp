@@ -0,0 +1,330 @@
+#include "TMC_Benchmark.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <algorithm>
+
+TMC_Benchmark::sample TMC_Benchmark::samples[TMC_Benchmark::max_transactions];
+volatile uint32_t TMC_Benchmark::completions;
+uint32_t TMC_Benchmark::callback_cycles;
+uint32_t TMC_Benchmark::sorted[TMC_Benchmark::max_transactions];
+
+TMC_Benchmark::TMC_Benchmark(TMC_Serial* const* Buses, uint8_t Bus_count, uint8_t Slaves, output Out) :
+	bus_count(Bus_count > 4 ? 4 : Bus_count),
+	slaves(Slaves),
+	out(Out),
+	first_scenario(true)
+{
+	for (uint8_t i = 0; i < bus_count; ++i)
+		buses[i] = Buses[i];
+}
+
+uint32_t TMC_Benchmark::wire_clock()
+{
+#ifdef SAM3X_SIM
+	return (uint32_t)SAM3X_Sim::instance().now();
+#else
+	return DWT->CYCCNT;
+#endif
+}
+
+uint32_t TMC_Benchmark::bit_cycles(TMC_Serial* bus)
+{
+	// Baudrate = MCK / (16 * (CD + FP / 8))
+	uint32_t brgr = bus->get_usart()->US_BRGR;
+	return 16 * (brgr & US_BRGR_CD_Msk) + 2 * ((brgr & US_BRGR_FP_Msk) >> US_BRGR_FP_Pos);
+}
+
+void TMC_Benchmark::print(const char* format, ...)
+{
+	char buffer[160];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	out(buffer);
+}
+
+const char* TMC_Benchmark::fixed(char* buffer, uint64_t numerator, uint64_t denominator)
+{
+	// Integer math only, printf on the Due may not support floating point
+	uint64_t thousandths = denominator == 0 ? 0 : (numerator * 1000 + denominator / 2) / denominator;
+	snprintf(buffer, 24, "%lu.%03lu", (unsigned long)(thousandths / 1000), (unsigned long)(thousandths % 1000));
+	return buffer;
+}
+
+void TMC_Benchmark::completion_callback(volatile TMC_Serial::access_ticket* ticket, void* sample_pointer)
+{
+	sample* s = (sample*)sample_pointer;
+	s->completed = wire_clock();
+	uint32_t start = DWT->CYCCNT;
+	while (DWT->CYCCNT - start < callback_cycles)
+		;
+	s->status = ticket->status;
+	completions = completions + 1;
+	delete ticket;
+}
+
+void TMC_Benchmark::restore_callback(volatile TMC_Serial::access_ticket* ticket, void*)
+{
+	completions = completions + 1;
+	delete ticket;
+}
+
+void TMC_Benchmark::restore(uint8_t used_buses, uint8_t used_slaves, uint32_t write_register, const uint32_t (*values)[4])
+{
+	completions = 0;
+	uint32_t queued = 0;
+	for (uint8_t b = 0; b < used_buses; ++b)
+		for (uint8_t s = 0; s < used_slaves && s < 4; ++s)
+			queued += buses[b]->write_exact(s, write_register, values[b][s], restore_callback) != nullptr;
+
+	uint32_t start = wire_clock();
+	while (completions < queued && wire_clock() - start < SystemCoreClock)
+		__WFI();
+}
+
+bool TMC_Benchmark::run(uint32_t transactions)
+{
+	CoreDebug->DEMCR = CoreDebug->DEMCR | CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL = DWT->CTRL | DWT_CTRL_CYCCNTENA_Msk;
+
+	if (transactions > max_transactions)
+		transactions = max_transactions;
+
+	bool passed = true;
+	print("{\n");
+#ifdef SAM3X_SIM
+	print("  \"platform\": \"host_sim\",\n");
+	print("  \"cpu_unit\": \"ns\",\n");
+#else
+	print("  \"platform\": \"sam3x8e\",\n");
+	print("  \"cpu_unit\": \"cycles\",\n");
+#endif
+	print("  \"baudrate\": %lu,\n", (unsigned long)(SystemCoreClock / bit_cycles(buses[0])));
+	print("  \"transactions\": %lu,\n", (unsigned long)transactions);
+	print("  \"scenarios\": [\n");
+
+	passed &= scenario("write_flood", 1, 1, 0, 1, TMC_Serial::TPWMTHRS, transactions);
+	passed &= scenario("reads", 1, 1, 1, 0, TMC_Serial::TPWMTHRS, transactions);
+	passed &= scenario("read_write_mix", 1, 1, 1, 3, TMC_Serial::TPWMTHRS, transactions);
+	passed &= scenario("multi_slave", 1, slaves, 1, 3, TMC_Serial::TPWMTHRS, transactions);
+	passed &= scenario("setpoints_under_telemetry", 1, slaves, 7, 1, TMC_Serial::VACTUAL, transactions);
+	// The same slow callbacks run in USART_Handler, then deferred to PendSV, the ISR time shows the difference
+	passed &= scenario("slow_callbacks_in_isr", 1, slaves, 1, 3, TMC_Serial::TPWMTHRS, transactions, TMC_Serial::immediate, 2000);
+	passed &= scenario("slow_callbacks_deferred", 1, slaves, 1, 3, TMC_Serial::TPWMTHRS, transactions, TMC_Serial::pendsv, 2000);
+	if (bus_count == 4)
+		passed &= scenario("four_buses", 4, slaves, 1, 3, TMC_Serial::TPWMTHRS, transactions);
+	else
+		print(",\n    { \"name\": \"four_buses\", \"skipped\": \"needs a driver instance on every USART\" }");
+
+	print("\n  ],\n");
+	cpu_costs();
+	print("  \"passed\": %s\n}\n", passed ? "true" : "false");
+	return passed;
+}
+
+bool TMC_Benchmark::scenario(const char* name, uint8_t used_buses, uint8_t used_slaves, uint8_t read_share, uint8_t write_share, uint32_t write_register, uint32_t transactions,
+	uint8_t completion_mode, uint32_t callback_work)
+{
+	if (used_buses > bus_count)
+		used_buses = bus_count;
+	if (used_slaves == 0)
+		used_slaves = 1;
+
+	// What the writes overwrite, it's put back once the scenario is over
+	uint32_t saved[4][4];
+	for (uint8_t b = 0; b < used_buses; ++b)
+		for (uint8_t s = 0; s < 4; ++s)
+			if (!buses[b]->shadow_value(s, write_register, saved[b][s]))
+				saved[b][s] = 0;
+
+	completions = 0;
+	callback_cycles = callback_work;
+	for (uint8_t b = 0; b < used_buses; ++b)
+		buses[b]->set_completion_mode(completion_mode);
+#ifdef TMC_SERIAL_STATS
+	for (uint8_t b = 0; b < used_buses; ++b)
+		buses[b]->reset_statistics();
+#endif
+
+	uint32_t reads = 0, backpressure = 0;
+	uint32_t enqueue_total = 0, enqueue_max = 0;
+	uint64_t wire_total = 0;	// Cycles the datagrams themselves need on the wire
+	uint32_t start = wire_clock();
+
+	for (uint32_t i = 0; i < transactions; ++i)
+	{
+		TMC_Serial* bus = buses[i % used_buses];
+		uint32_t s_address = (i / used_buses) % used_slaves;
+		bool read = (i / used_buses) % (read_share + write_share) < read_share;	// Every bus gets its share of reads
+		sample& s = samples[i];
+		s.status = TMC_Serial::access_ticket::state::pending;
+
+		// A read is the request, its echo and the reply after the default SENDDELAY of 8 bit times
+		wire_total += (uint64_t)bit_cycles(bus) * (read ? (4 + 8) * 10 + 8 : 8 * 10);
+		reads += read;
+
+		for (;;)
+		{
+			s.enqueued = wire_clock();
+			uint32_t cpu_start = DWT->CYCCNT;
+			volatile TMC_Serial::access_ticket* ticket = read ?
+				(volatile TMC_Serial::access_ticket*)bus->read(s_address, TMC_Serial::IFCNT, completion_callback, &s) :
+				(volatile TMC_Serial::access_ticket*)bus->write(s_address, write_register, i, completion_callback, &s);
+			uint32_t cpu = DWT->CYCCNT - cpu_start;
+
+			if (ticket != nullptr)
+			{
+				enqueue_total += cpu;
+				enqueue_max = std::max(enqueue_max, cpu);
+				break;
+			}
+
+			++backpressure;		// The pool or queue is full, wait for a ticket to complete
+			__WFI();
+		}
+	}
+
+	// Twice the time the datagrams need plus a second is plenty, even with 2 ms idle gaps
+	uint64_t timeout = 2 * wire_total / used_buses + transactions * (SystemCoreClock / 500) + SystemCoreClock;
+	if (timeout > 0x7FFFFFFF)
+		timeout = 0x7FFFFFFF;
+	while (completions < transactions && wire_clock() - start < timeout)
+		__WFI();
+	for (uint8_t b = 0; b < used_buses; ++b)
+		buses[b]->set_completion_mode(TMC_Serial::immediate);
+	callback_cycles = 0;
+
+	uint32_t completed = 0, failed = 0, last = start;
+	uint64_t latency_total = 0;
+	for (uint32_t i = 0; i < transactions; ++i)
+	{
+		const sample& s = samples[i];
+		if (s.status == TMC_Serial::access_ticket::state::pending)
+			continue;
+		if (s.status != TMC_Serial::access_ticket::state::completed_successfully)
+			++failed;
+
+		sorted[completed++] = s.completed - s.enqueued;
+		latency_total += s.completed - s.enqueued;
+		if (s.completed - start > last - start)
+			last = s.completed;
+	}
+	std::sort(sorted, sorted + completed);
+
+	uint64_t elapsed = last - start;
+	uint64_t bus_time = elapsed * used_buses;
+	uint64_t idle = bus_time > wire_total ? bus_time - wire_total : 0;
+	char a[24], b[24], c[24], d[24], e[24];
+
+	print("%s    {\n", first_scenario ? "" : ",\n");
+	first_scenario = false;
+	print("      \"name\": \"%s\",\n", name);
+	print("      \"buses\": %u,\n      \"slaves\": %u,\n", used_buses, used_slaves);
+	print("      \"completion_mode\": \"%s\",\n      \"callback_work\": %lu,\n",
+		completion_mode == TMC_Serial::pendsv ? "pendsv" : completion_mode == TMC_Serial::polled ? "polled" : "immediate", (unsigned long)callback_work);
+	print("      \"reads\": %lu,\n      \"writes\": %lu,\n", (unsigned long)reads, (unsigned long)(transactions - reads));
+	print("      \"completed\": %lu,\n      \"failed\": %lu,\n", (unsigned long)completed, (unsigned long)failed);
+	print("      \"backpressure\": %lu,\n", (unsigned long)backpressure);
+	print("      \"elapsed_us\": %s,\n", fixed(a, elapsed * 1000000, SystemCoreClock));
+	print("      \"transactions_per_second\": %s,\n", fixed(a, (uint64_t)completed * SystemCoreClock, elapsed));
+	print("      \"wire_utilization\": %s,\n", fixed(a, wire_total, bus_time));
+	print("      \"idle_gap_us\": %s,\n", fixed(a, idle * 1000000, (uint64_t)transactions * SystemCoreClock));
+
+	if (completed > 0)
+		print("      \"latency_us\": { \"min\": %s, \"mean\": %s, \"p50\": %s, \"p99\": %s, \"max\": %s },\n",
+			fixed(a, (uint64_t)sorted[0] * 1000000, SystemCoreClock),
+			fixed(b, latency_total * 1000000, (uint64_t)completed * SystemCoreClock),
+			fixed(c, (uint64_t)sorted[completed / 2] * 1000000, SystemCoreClock),
+			fixed(d, (uint64_t)sorted[(completed * 99) / 100] * 1000000, SystemCoreClock),
+			fixed(e, (uint64_t)sorted[completed - 1] * 1000000, SystemCoreClock));
+	else
+		print("      \"latency_us\": null,\n");
+
+	print("      \"enqueue\": { \"mean\": %s, \"max\": %lu },\n", fixed(a, enqueue_total, transactions), (unsigned long)enqueue_max);
+
+#ifdef TMC_SERIAL_STATS
+	uint32_t transfers = 0, tickets = 0, isr_count = 0, isr_max = 0;
+	uint64_t isr_total = 0;
+	for (uint8_t i = 0; i < used_buses; ++i)
+	{
+		TMC_Serial::bus_statistics stats = buses[i]->statistics();
+		transfers += stats.transfers;
+		tickets += stats.tickets;
+		isr_count += stats.isr_count;
+		isr_total += stats.isr_cycles;
+		isr_max = std::max(isr_max, stats.isr_max_cycles);
+	}
+	print("      \"isr\": { \"count\": %lu, \"mean\": %s, \"max\": %lu, \"tickets_per_transfer\": %s },\n",
+		(unsigned long)isr_count, fixed(a, isr_total, isr_count), (unsigned long)isr_max, fixed(b, tickets, transfers));
+
+	// Time from queueing to the start of the transfer, per priority class
+	static const char* const class_names[TMC_Serial::priority_classes] = { "realtime", "configuration", "telemetry" };
+	print("      \"queue_latency_us\": {");
+	for (uint8_t cls = 0; cls < TMC_Serial::priority_classes; ++cls)
+	{
+		uint32_t count = 0, max = 0;
+		uint64_t total = 0;
+		for (uint8_t i = 0; i < used_buses; ++i)
+		{
+			TMC_Serial::bus_statistics stats = buses[i]->statistics();
+			count += stats.queue_latency[cls].tickets;
+			total += stats.queue_latency[cls].us;
+			max = std::max(max, stats.queue_latency[cls].max_us);
+		}
+		print("%s \"%s\": { \"tickets\": %lu, \"mean\": %s, \"max\": %lu }", cls == 0 ? "" : ",", class_names[cls],
+			(unsigned long)count, fixed(a, total, count), (unsigned long)max);
+	}
+	print(" }\n");
+#else
+	print("      \"isr\": null,\n");
+	print("      \"queue_latency_us\": null\n");
+#endif
+	print("    }");
+
+	if (write_share > 0)
+		restore(used_buses, used_slaves, write_register, saved);
+	return completed == transactions && failed == 0;
+}
+
+void TMC_Benchmark::cpu_costs()
+{
+	const uint32_t rounds = 1000;
+	uint8_t datagram[8] = { 0x05, 0x00, 0x90, 0x00, 0x00, 0x00, 0xC8, 0x00 };
+	uint8_t copy[8];
+	volatile uint32_t sink = 0;
+	char a[24], b[24], c[24];
+
+	uint32_t start = DWT->CYCCNT;
+	for (uint32_t r = 0; r < rounds; ++r)
+	{
+		datagram[6] = r;
+		sink = sink + TMC_Serial::calc_CRC(datagram, 8);
+	}
+	uint32_t crc = DWT->CYCCNT - start;
+
+	Ring_Buffer<uint8_t> ring(64);
+	start = DWT->CYCCNT;
+	for (uint32_t r = 0; r < rounds; ++r)
+	{
+		ring.push(datagram, 8);
+		ring.pull(copy, 8);
+		sink = sink + copy[7];
+	}
+	uint32_t ring_buffer = DWT->CYCCNT - start;
+
+	start = DWT->CYCCNT;
+	for (uint32_t r = 0; r < rounds; ++r)
+	{
+		volatile TMC_Serial::write_ticket* ticket = new volatile TMC_Serial::write_ticket(0, TMC_Serial::TPWMTHRS, r, nullptr, nullptr);
+		sink = sink + ticket->datagram.data_transfer.CRC;
+		delete ticket;
+	}
+	uint32_t ticket = DWT->CYCCNT - start;
+
+	print("  \"cpu\": {\n");
+	print("    \"calc_crc_per_datagram\": %s,\n", fixed(a, crc, rounds));
+	print("    \"ring_buffer_per_datagram\": %s,\n", fixed(b, ring_buffer, rounds));
+	print("    \"ticket_new_delete\": %s\n", fixed(c, ticket, rounds));
+	print("  },\n");
+}
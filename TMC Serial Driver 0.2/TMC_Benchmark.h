@@ -0,0 +1,79 @@
+#pragma once
+#include "TMC_Serial.h"
+
+// Measures bus throughput, ticket latency, the idle gap between transactions and the CPU cost of the
+//    driver, and prints the results as one JSON object.
+//    On the Due everything is timed with the DWT cycle counter. Against the host simulator wire time
+//    is the simulated clock and CPU costs are host nanoseconds (see host/Arduino.h), so host numbers
+//    are only comparable with other host runs. Interrupt costs need TMC_SERIAL_STATS.
+class TMC_Benchmark
+{
+public:
+	// Receives the report piece by piece
+	typedef void(*output)(const char* text);
+
+	static const uint32_t max_transactions = 1024;		// Tickets per scenario at most
+
+	// buses: The driver instances to use, at most one per USART
+	// bus_count: Number of entries in 'buses' (1 - 4)
+	// slaves: Number of drivers on each bus, they must answer at slave addresses 0 to slaves - 1
+	// out: Where to print the report
+	TMC_Benchmark(TMC_Serial* const* buses, uint8_t bus_count, uint8_t slaves, output out);
+
+	// Runs every scenario and prints the report
+	//	transactions: Tickets per scenario, at most 'max_transactions'
+	//	returns false if a ticket failed or didn't complete
+	bool run(uint32_t transactions = 512);
+
+private:
+	struct sample {
+		volatile uint32_t enqueued;		// Wire clock when the ticket was queued
+		volatile uint32_t completed;	// Wire clock when its callback ran
+		volatile uint8_t status;
+	};
+
+	TMC_Serial* buses[4];
+	uint8_t bus_count;
+	uint8_t slaves;
+	output out;
+	bool first_scenario;
+
+	static sample samples[max_transactions];
+	static volatile uint32_t completions;
+	static uint32_t callback_cycles;		// Busy-work each callback does, to stand in for a slow user callback
+	static uint32_t sorted[max_transactions];
+
+	static void completion_callback(volatile TMC_Serial::access_ticket* ticket, void* sample_pointer);
+	static void restore_callback(volatile TMC_Serial::access_ticket* ticket, void*);
+
+	// Runs one scenario and prints its JSON object
+	//	name: Name of the scenario in the report
+	//	used_buses, used_slaves: How many buses/slave addresses the tickets are spread over (round-robin)
+	//	read_share, write_share: Of every read_share + write_share tickets on a bus, the first read_share are reads of IFCNT
+	//	write_register: The register the writes go to
+	//	completion_mode: Where the callbacks run, a TMC_Serial::completion_mode
+	//	callback_work: Cycles each callback spends before returning
+	//	returns false if a ticket failed or didn't complete
+	bool scenario(const char* name, uint8_t used_buses, uint8_t used_slaves, uint8_t read_share, uint8_t write_share, uint32_t write_register, uint32_t transactions,
+		uint8_t completion_mode = TMC_Serial::immediate, uint32_t callback_work = 0);
+
+	// Writes the register a scenario wrote back to what the shadows knew before it, the power-on value 0 if they
+	//    didn't know, and waits for the writes. On real drivers a VACTUAL left behind keeps the motors turning.
+	//	used_buses, used_slaves, write_register: Same as for scenario()
+	//	values: The values to write back, by bus and slave address
+	void restore(uint8_t used_buses, uint8_t used_slaves, uint32_t write_register, const uint32_t (*values)[4]);
+
+	// Times calc_CRC, Ring_Buffer and the ticket pool
+	void cpu_costs();
+
+	void print(const char* format, ...);
+
+	// Formats numerator / denominator with three decimals into 'buffer' (at least 24 bytes), returns 'buffer'
+	static const char* fixed(char* buffer, uint64_t numerator, uint64_t denominator);
+
+	// Returns the time on the wire clock in 84 MHz cycles
+	static uint32_t wire_clock();
+
+	// Returns the length of a bit on a bus in 84 MHz cycles
+	static uint32_t bit_cycles(TMC_Serial* bus);
+};
@@ -0,0 +1,72 @@
+#include "TMC_Bus_Group.h"
+
+TMC_Bus_Group::TMC_Bus_Group(TMC_Serial* const* Buses, uint8_t Bus_count, uint8_t Axis_count) :
+	bus_count(Bus_count > 4 ? 4 : Bus_count),
+	axis_count(0)
+{
+	uint32_t bit_cycles[4];		// Length of a bit on each bus, Baudrate = MCK / (16 * (CD + FP / 8))
+	uint8_t used[4];			// Slave addresses handed out on each bus
+	for (uint8_t b = 0; b < bus_count; ++b)
+	{
+		buses[b] = Buses[b];
+		uint32_t brgr = buses[b]->get_usart()->US_BRGR;
+		bit_cycles[b] = 16 * (brgr & US_BRGR_CD_Msk) + 2 * ((brgr & US_BRGR_FP_Msk) >> US_BRGR_FP_Pos);
+		used[b] = 0;
+	}
+
+	if (Axis_count > max_axes)
+		Axis_count = max_axes;
+
+	for (uint8_t axis = 0; axis < Axis_count; ++axis)
+	{
+		// Pick the bus whose traffic per axis would grow the least, the first one wins a tie
+		uint8_t best = 0xFF;
+		for (uint8_t b = 0; b < bus_count; ++b)
+			if (used[b] < 4 && (best == 0xFF || (uint64_t)(used[b] + 1) * bit_cycles[b] < (uint64_t)(used[best] + 1) * bit_cycles[best]))
+				best = b;
+		if (best == 0xFF)
+			break;	// Every address of every bus is taken
+
+		placement[axis] = (best << 2) | used[best]++;
+		++axis_count;
+	}
+}
+
+volatile TMC_Serial::read_ticket* TMC_Bus_Group::read(uint8_t axis, uint32_t r_address, void(*Callback)(volatile TMC_Serial::access_ticket*, void* additional_parameters), void* Callback_parameters)
+{
+	if (axis >= axis_count)
+		return nullptr;
+	return bus_of(axis)->read(address_of(axis), r_address, Callback, Callback_parameters);
+}
+
+volatile TMC_Serial::write_ticket* TMC_Bus_Group::write(uint8_t axis, uint32_t r_address, uint32_t data, void(*Callback)(volatile TMC_Serial::access_ticket*, void* additional_parameters), void* Callback_parameters)
+{
+	if (axis >= axis_count)
+		return nullptr;
+	return bus_of(axis)->write(address_of(axis), r_address, data, Callback, Callback_parameters);
+}
+
+uint8_t TMC_Bus_Group::write_all(uint32_t r_address, uint32_t data)
+{
+	uint8_t masks[4] = { 0, 0, 0, 0 };		// Slave addresses in use on each bus
+	for (uint8_t axis = 0; axis < axis_count; ++axis)
+		masks[placement[axis] >> 2] |= 1 << address_of(axis);
+
+	uint8_t queued = 0;
+	for (uint8_t b = 0; b < bus_count; ++b)
+		if (masks[b] != 0 && buses[b]->write_fanout(masks[b], r_address, data) != nullptr)
+			queued += __builtin_popcount(masks[b]);
+	return queued;
+}
+
+bool TMC_Bus_Group::stage(uint8_t axis, uint32_t data)
+{
+	if (axis >= axis_count)
+		return false;
+	return bus_of(axis)->stage_setpoint(setpoints, address_of(axis), data);
+}
+
+bool TMC_Bus_Group::commit(uint32_t r_address)
+{
+	return TMC_Serial::commit_group(setpoints, r_address);
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "TMC_Serial.h"
+
+// Spreads a number of axes over up to four TMC_Serial buses and routes register accesses by axis
+//    Each bus carries up to four drivers (slave addresses 0 - 3) and all buses transfer in parallel,
+//    so the aggregate bandwidth is highest when the axes are spread evenly by bus speed. Every axis
+//    goes to the bus that'd have the least bit times of traffic per axis with it added, which with
+//    equal baudrates deals them out round-robin (axis 0 -> bus 0, axis 1 -> bus 1, ...). Wire the
+//    drivers the way 'bus_of()' and 'address_of()' say.
+class TMC_Bus_Group
+{
+public:
+	static const uint8_t max_axes = 16;		// Four drivers on each of the four USARTs
+
+	// buses: The driver instances, at most one per USART
+	// bus_count: Number of entries in 'buses' (1 - 4)
+	// axis_count: Number of axes to spread, at most four per bus
+	TMC_Bus_Group(TMC_Serial* const* buses, uint8_t bus_count, uint8_t axis_count);
+
+	// Returns the number of axes that got a place, less than requested if the buses ran out of addresses
+	uint8_t axes() const { return axis_count; }
+
+	// Returns the bus an axis is wired to
+	TMC_Serial* bus_of(uint8_t axis) const { return buses[placement[axis] >> 2]; }
+
+	// Returns the slave address of an axis on its bus
+	uint8_t address_of(uint8_t axis) const { return placement[axis] & 0x03; }
+
+	// Same as TMC_Serial::read(), addressed by axis
+	volatile TMC_Serial::read_ticket* read(uint8_t axis, uint32_t r_address, void(*Callback)(volatile TMC_Serial::access_ticket*, void* additional_parameters) = nullptr, void* Callback_parameters = nullptr);
+
+	// Same as TMC_Serial::write(), addressed by axis
+	volatile TMC_Serial::write_ticket* write(uint8_t axis, uint32_t r_address, uint32_t data, void(*Callback)(volatile TMC_Serial::access_ticket*, void* additional_parameters) = TMC_Serial::deleteTicketCallback, void* Callback_parameters = nullptr);
+
+	// Writes the same value to a register of every axis (fire-and-forget)
+	//    Each bus gets one fan-out write for all of its axes, so every bus starts transferring right away.
+	//	returns the number of writes queued
+	uint8_t write_all(uint32_t r_address, uint32_t data);
+
+	// Stages the value of an axis for the next commit()
+	//	returns false for an axis that has no place
+	bool stage(uint8_t axis, uint32_t data);
+
+	// Writes the staged values of every axis at nearly the same moment (see TMC_Serial::commit_group())
+	//	r_address: The register the staged axes get their values in
+	//	returns false if nothing is staged, the last commit is still running or the ticket pool is exhausted
+	bool commit(uint32_t r_address = TMC_Serial::VACTUAL);
+
+	// The progress and the measured skew of the last commit
+	const TMC_Serial::group_commit& last_commit() const { return setpoints; }
+
+private:
+	TMC_Serial* buses[4];
+	uint8_t bus_count;
+	uint8_t axis_count;
+	uint8_t placement[max_axes];	// Bus index << 2 | slave address of each axis, in axis order
+	TMC_Serial::group_commit setpoints;
+};
@@ -0,0 +1,137 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-8 engine for TMC22xx UART datagrams (polynomial x^8 + x^2 + x + 1, datasheet 4.2)
+//    The TMC2209 feeds the data bits LSB first into a left shifting CRC register. The same
+//    result is obtained by running a right shifting (reflected) CRC with the mirrored polynomial
+//    (0xE0) over the unmodified bytes and mirroring the register once at the end. That lets us
+//    use a single table lookup per byte and keep partial CRCs of datagram headers around.
+//
+//    Partial CRCs ("states") are always kept in the reflected domain, use 'finish()' to turn a
+//    state into the CRC byte that goes on the wire.
+class TMC_CRC
+{
+public:
+	static const uint8_t sync_byte = 0x05;		// First byte of every datagram: sync nibble (1010, LSB first) + reserved bits
+	static const uint8_t write_bit = 0x80;		// The rw_access bit in the register address byte
+
+#ifndef TMC_CRC_NIBBLE_TABLE
+	static const uint8_t table[256];			// Reflected CRC-8 (0xE0) table, one lookup per byte
+#else
+	static const uint8_t table[16];				// Reflected CRC-8 (0xE0) nibble table, two lookups per byte
+#endif
+
+	// Folds a single byte into a partial CRC state
+	//    state: The partial CRC state (reflected domain)
+	//    byte: The byte to fold in
+	static inline uint8_t update(uint8_t state, uint8_t byte)
+	{
+#ifndef TMC_CRC_NIBBLE_TABLE
+		return table[state ^ byte];
+#else
+		state = (state >> 4) ^ table[(state ^ byte) & 0x0F];
+		return (state >> 4) ^ table[(state ^ (byte >> 4)) & 0x0F];
+#endif
+	}
+
+	// Converts a partial CRC state into the CRC byte as it's sent on the wire
+	static inline uint8_t finish(uint8_t state)
+	{
+		return reflect(state);
+	}
+
+	// Mirrors the bit order of a byte
+	static inline uint8_t reflect(uint8_t byte)
+	{
+		return (reflected_nibble[byte & 0x0F] << 4) | reflected_nibble[byte >> 4];
+	}
+
+	// Calculates the CRC of a datagram, the last byte of the datagram is the CRC itself and is excluded
+	//    datagram: pointer to the first byte of the datagram
+	//    datagram_length: length in bytes of the datagram (including the CRC byte)
+	static uint8_t calc(const uint8_t* datagram, uint8_t datagram_length);
+
+	// Returns the partial CRC state of a datagram header (sync byte, slave address, register address + rw bit)
+	//    Write headers of the four hardware slave addresses are cached after their first use.
+	//    s_address: The slave address of the driver
+	//    reg_rw: The register address, or'd with 'write_bit' for write accesses
+	static uint8_t header(uint8_t s_address, uint8_t reg_rw);
+
+	// Calculates the CRC of a write datagram by folding the 4 data bytes into the cached header state
+	//    s_address: The slave address of the driver
+	//    r_address: The register address being written
+	//    data: The register value, as it'll be sent (most significant byte first)
+	static uint8_t write_crc(uint8_t s_address, uint8_t r_address, uint32_t data);
+
+	// Folds the 4 data bytes of a register value into a header state and returns the finished CRC
+	//    state: The header state returned from 'header()'
+	//    data: The register value, as it'll be sent (most significant byte first)
+	static inline uint8_t fold_data(uint8_t state, uint32_t data)
+	{
+		state = update(state, data >> 24);
+		state = update(state, data >> 16);
+		state = update(state, data >> 8);
+		return finish(update(state, data));
+	}
+
+	// Validates a batch of datagrams stored back to back in one buffer (ie. a PDC receive buffer)
+	//    datagrams: pointer to the first byte of the first datagram
+	//    count: the number of datagrams in the buffer
+	//    datagram_length: length in bytes of each datagram (including the CRC byte)
+	//    failed_mask: optional, bit 'i' is set if datagram 'i' failed (only the first 32 datagrams are reported)
+	//    returns the number of datagrams with a valid CRC
+	static size_t validate(const uint8_t* datagrams, size_t count, uint8_t datagram_length, uint32_t* failed_mask = nullptr);
+
+	// Validates a batch of datagrams scattered through memory
+	//    datagrams: array of pointers to the first byte of each datagram
+	//    count: the number of pointers in 'datagrams'
+	//    datagram_length: length in bytes of each datagram (including the CRC byte)
+	//    failed_mask: optional, bit 'i' is set if datagram 'i' failed (only the first 32 datagrams are reported)
+	//    returns the number of datagrams with a valid CRC
+	static size_t validate(const uint8_t* const* datagrams, size_t count, uint8_t datagram_length, uint32_t* failed_mask = nullptr);
+
+
+	// ===== Compile time variants ===============================================================================
+	//    Bit-serial and recursive so they stay valid C++11 constexpr functions, they're meant for
+	//    constant datagrams and static_asserts, use the table driven functions at runtime.
+
+	// Folds a single byte into a CRC (wire domain, not reflected), exactly as described in the datasheet
+	static constexpr uint8_t constexpr_update(uint8_t crc, uint8_t byte, uint8_t bit = 0)
+	{
+		return bit == 8 ? crc :
+			constexpr_update(((crc >> 7) ^ (byte & 0x01)) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1), byte >> 1, bit + 1);
+	}
+
+	// Calculates the CRC of a datagram at compile time, the last byte is the CRC and is excluded
+	static constexpr uint8_t constexpr_calc(const uint8_t* datagram, uint8_t datagram_length, uint8_t crc = 0, uint8_t i = 0)
+	{
+		return (i + 1 >= datagram_length) ? crc :
+			constexpr_calc(datagram, datagram_length, constexpr_update(crc, datagram[i]), i + 1);
+	}
+
+	// Calculates the CRC of a read access datagram at compile time
+	static constexpr uint8_t constexpr_read_crc(uint8_t s_address, uint8_t r_address)
+	{
+		return constexpr_update(constexpr_update(constexpr_update(0, sync_byte), s_address), r_address & 0x7F);
+	}
+
+	// Calculates the CRC of a write datagram at compile time
+	static constexpr uint8_t constexpr_write_crc(uint8_t s_address, uint8_t r_address, uint32_t data)
+	{
+		return constexpr_update(constexpr_update(constexpr_update(constexpr_update(
+			constexpr_update(constexpr_update(constexpr_update(0, sync_byte), s_address), r_address | write_bit),
+			data >> 24), data >> 16), data >> 8), data);
+	}
+
+private:
+	static const uint8_t reflected_nibble[16];		// Bit mirrored values of 0x0 - 0xF
+	static volatile uint8_t write_headers[4][128];	// Cached write header states of slave addresses 0 - 3
+	static volatile uint8_t write_headers_cached;	// Bit 'n' is set once slave 'n's write headers are cached
+};
+
+
+// Reference datagrams (read access of GCONF, IFCNT and IOIN from slave 0)
+static_assert(TMC_CRC::constexpr_read_crc(0, 0x00) == 0x48, "TMC_CRC: GCONF read reference CRC mismatch");
+static_assert(TMC_CRC::constexpr_read_crc(0, 0x02) == 0x8F, "TMC_CRC: IFCNT read reference CRC mismatch");
+static_assert(TMC_CRC::constexpr_read_crc(0, 0x06) == 0x6F, "TMC_CRC: IOIN read reference CRC mismatch");
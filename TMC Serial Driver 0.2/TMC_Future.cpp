@@ -0,0 +1,220 @@
+#include "TMC_Future.h"
+
+TMC_Future* TMC_Future::unsent = nullptr;
+char TMC_Future::detached;
+char TMC_Future::done;
+
+TMC_Future::TMC_Future(TMC_Serial& Bus, bool Is_write, uint8_t S_address, uint32_t R_address, uint32_t Data) :
+	bus(&Bus),
+	invalid(S_address >= 4),
+	is_write(Is_write),
+	s_address(S_address),
+	r_address(R_address),
+	data(Data),
+	ticket(nullptr),
+	waiter(nullptr),
+	next_unsent(nullptr)
+{
+	if (!invalid)
+		send();
+}
+
+TMC_Future TMC_Future::read(TMC_Serial& bus, uint8_t s_address, uint32_t r_address)
+{
+	return TMC_Future(bus, false, s_address, r_address, 0);
+}
+
+TMC_Future TMC_Future::write(TMC_Serial& bus, uint8_t s_address, uint32_t r_address, uint32_t data)
+{
+	return TMC_Future(bus, true, s_address, r_address, data);
+}
+
+TMC_Future::TMC_Future(TMC_Future&& other) :
+	bus(other.bus),
+	invalid(other.invalid),
+	is_write(other.is_write),
+	s_address(other.s_address),
+	r_address(other.r_address),
+	data(other.data),
+	ticket(other.ticket),
+	waiter(nullptr),
+	next_unsent(nullptr)
+{
+	// Only suspended coroutines wait in 'unsent' and their futures don't move, so there's no link to take over
+	other.bus = nullptr;
+	other.ticket = nullptr;
+}
+
+TMC_Future& TMC_Future::operator=(TMC_Future&& other)
+{
+	if (this != &other)
+	{
+		release();
+		bus = other.bus;
+		invalid = other.invalid;
+		is_write = other.is_write;
+		s_address = other.s_address;
+		r_address = other.r_address;
+		data = other.data;
+		ticket = other.ticket;
+		other.bus = nullptr;
+		other.ticket = nullptr;
+	}
+	return *this;
+}
+
+TMC_Future::~TMC_Future()
+{
+	release();
+}
+
+void TMC_Future::release()
+{
+	if (waiter != nullptr)
+	{
+		TMC_Future** link = &unsent;
+		while (*link != this)
+			link = &(*link)->next_unsent;
+		*link = next_unsent;
+		next_unsent = nullptr;
+		waiter = nullptr;
+	}
+
+	if (ticket != nullptr)
+	{
+		// Still on the wire, or waiting for its deferred callback, the callback deletes it then
+		noInterrupts();
+		bool finished = ticket->callback_parameters == &done;
+		if (!finished)
+			ticket->callback_parameters = &detached;
+		interrupts();
+		if (finished)
+			delete ticket;
+		ticket = nullptr;
+	}
+	bus = nullptr;
+}
+
+bool TMC_Future::send()
+{
+	// An exact write is never coalesced or dropped, so the result is always this write's own
+	ticket = is_write ?
+		(volatile TMC_Serial::access_ticket*)bus->write_exact(s_address, r_address, data, completed) :
+		(volatile TMC_Serial::access_ticket*)bus->read(s_address, r_address, completed);
+	return ticket != nullptr;
+}
+
+bool TMC_Future::ready()
+{
+	if (bus == nullptr || invalid)
+		return true;
+
+	// In polled mode the pool may be full of completed tickets that only wait for their callbacks
+	bool polled = bus->get_completion_mode() == TMC_Serial::polled;
+	if (ticket == nullptr)
+	{
+		if (polled)
+			TMC_Serial::dispatch();
+		if (!send())
+			return false;
+	}
+	if (ticket->callback_parameters == &done)
+		return true;
+
+	if (polled)
+		TMC_Serial::dispatch();
+	return ticket->callback_parameters == &done;
+}
+
+TMC_Future::result TMC_Future::get()
+{
+	result r = { TMC_Serial::access_ticket::state::pending, 0 };
+	if (bus == nullptr)
+		return r;
+
+	while (!ready())
+		__WFI();
+
+	if (invalid)
+	{
+		r.status = invalid_address;
+		bus = nullptr;
+		return r;
+	}
+
+	r.status = ticket->status;
+	r.value = ticket->get_data();
+	delete ticket;
+	ticket = nullptr;
+	bus = nullptr;
+	return r;
+}
+
+bool TMC_Future::attach(void* coroutine)
+{
+	noInterrupts();
+	bool finished = ticket->callback_parameters == &done;
+	if (!finished)
+		ticket->callback_parameters = coroutine;
+	interrupts();
+	return !finished;
+}
+
+void TMC_Future::completed(volatile TMC_Serial::access_ticket* ticket, void* state)
+{
+	if (state == &detached)
+	{
+		delete ticket;
+		return;
+	}
+
+	ticket->callback_parameters = &done;
+#ifdef TMC_FUTURE_COROUTINES
+	if (state != nullptr)
+		std::coroutine_handle<>::from_address(state).resume();
+#endif
+}
+
+void TMC_Future::poll()
+{
+	TMC_Serial::dispatch();
+
+#ifdef TMC_FUTURE_COROUTINES
+	for (TMC_Future** link = &unsent; *link != nullptr; )
+	{
+		TMC_Future* future = *link;
+		if (!future->send())
+		{
+			link = &future->next_unsent;
+			continue;
+		}
+
+		*link = future->next_unsent;
+		future->next_unsent = nullptr;
+		void* coroutine = future->waiter;
+		future->waiter = nullptr;
+		if (!future->attach(coroutine))
+			std::coroutine_handle<>::from_address(coroutine).resume();
+	}
+#endif
+}
+
+#ifdef TMC_FUTURE_COROUTINES
+bool TMC_Future::await_suspend(std::coroutine_handle<> coroutine)
+{
+	if (invalid)
+		return false;	// Resumes right away, get() reports the status
+	if (ticket == nullptr && bus != nullptr && !send())
+	{
+		// No ticket to wait on yet, poll() queues the access and attaches the coroutine later. Appended, so
+		//    the coroutines get their tickets in the order they asked.
+		waiter = coroutine.address();
+		TMC_Future** link = &unsent;
+		while (*link != nullptr)
+			link = &(*link)->next_unsent;
+		*link = this;
+		return true;
+	}
+	return ticket != nullptr && attach(coroutine.address());
+}
+#endif
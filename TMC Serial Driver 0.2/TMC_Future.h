@@ -0,0 +1,102 @@
+#pragma once
+#include "TMC_Serial.h"
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define TMC_FUTURE_COROUTINES
+#endif
+
+// The result of one register access, owned by the caller instead of a ticket to delete by hand
+//    A future queues its access right away and frees the ticket itself: in get(), or when it's
+//    destroyed, even while the access is still on the wire. There are three ways to wait:
+//    - ready() from loop(), the cooperative way, the sketch keeps running in the meantime
+//    - get(), which sleeps in __WFI() until the access completed
+//    - co_await in a C++20 coroutine (host builds), the coroutine resumes from the ticket's callback
+//    With a bus in 'polled' completion mode (see TMC_Serial::set_completion_mode()) ready() and get()
+//    call TMC_Serial::dispatch() themselves, and coroutines resume from poll() in the caller's thread.
+class TMC_Future
+{
+public:
+	// The status of an access that can never be sent, to a slave address other than 0 - 3
+	static const uint8_t invalid_address = 0xFF;
+
+	struct result {
+		uint8_t status;		// An access_ticket::state, 'pending' if the future holds nothing, or 'invalid_address'
+		uint32_t value;		// The register's value for a read, the value written for a write
+
+		bool ok() const { return status == TMC_Serial::access_ticket::state::completed_successfully; }
+	};
+
+	// Reads a register
+	//	bus: The driver instance the slave is connected to
+	//	s_address, r_address: The slave and the register
+	//	NOTE: If the ticket pool or the queue is full, the access is queued later from ready(), get() or poll().
+	//	      A slave address other than 0 - 3 is ready right away with the status 'invalid_address'.
+	static TMC_Future read(TMC_Serial& bus, uint8_t s_address, uint32_t r_address);
+
+	// Writes a register, the write is never coalesced or dropped as redundant
+	//	bus, s_address, r_address: Same as above
+	//	data: The value to write
+	static TMC_Future write(TMC_Serial& bus, uint8_t s_address, uint32_t r_address, uint32_t data);
+
+	TMC_Future() : bus(nullptr), invalid(false), ticket(nullptr), waiter(nullptr), next_unsent(nullptr) {}
+	TMC_Future(TMC_Future&& other);
+	TMC_Future& operator=(TMC_Future&& other);
+	TMC_Future(const TMC_Future&) = delete;
+	TMC_Future& operator=(const TMC_Future&) = delete;
+
+	// Lets go of the access, a ticket still on the wire is deleted once it completes
+	~TMC_Future();
+
+	// Returns true if the future holds an access whose result wasn't taken yet
+	bool valid() const { return bus != nullptr; }
+
+	// Returns true once the access completed, never blocks
+	//    Queues the access if that failed so far.
+	bool ready();
+
+	// Waits for the access to complete and returns its result, the future is empty afterwards
+	result get();
+
+	// Runs the deferred callbacks and queues the accesses of suspended coroutines that didn't get a ticket yet
+	//    Call it from the loop that drives the coroutines, with every bus in 'polled' or 'immediate' completion mode.
+	static void poll();
+
+#ifdef TMC_FUTURE_COROUTINES
+	// co_await support, the coroutine is resumed wherever the ticket's callback runs
+	bool await_ready() const { return false; }
+	bool await_suspend(std::coroutine_handle<> coroutine);
+	result await_resume() { return get(); }
+#endif
+
+private:
+	TMC_Serial* bus;				// nullptr once the result was taken
+	bool invalid;					// Set if the slave address can't be sent to, no ticket is ever queued then
+	bool is_write;
+	uint8_t s_address;
+	uint32_t r_address;
+	uint32_t data;
+	volatile TMC_Serial::access_ticket* ticket;	// nullptr until the access is queued
+	void* waiter;					// The suspended coroutine of an access that isn't queued yet
+	TMC_Future* next_unsent;		// Next entry of 'unsent'
+
+	static TMC_Future* unsent;		// Awaited futures still waiting for a ticket
+
+	// The ticket's 'callback_parameters' tell the callback what to do with it: nullptr while the future
+	//    waits without a coroutine, 'detached' after the future was destroyed, 'done' once the callback
+	//    ran, otherwise the address of the coroutine to resume
+	static char detached, done;
+
+	TMC_Future(TMC_Serial& bus, bool is_write, uint8_t s_address, uint32_t r_address, uint32_t data);
+
+	// Tries to queue the access, returns false if there was no room
+	bool send();
+
+	// Lets go of the ticket and leaves the list of unsent futures
+	void release();
+
+	// Makes the ticket resume 'coroutine' once it completes, returns false if it already did
+	bool attach(void* coroutine);
+
+	static void completed(volatile TMC_Serial::access_ticket* ticket, void* state);
+};
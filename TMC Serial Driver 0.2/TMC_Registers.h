@@ -0,0 +1,305 @@
+#pragma once
+#include <stdint.h>
+#include "TMC_CRC.h"
+
+// Compile-time description of the TMC2209 registers (datasheet 5): address, access type and fields
+//    Register values are built from their fields instead of magic numbers, and a field can only be
+//    combined with fields of the same register:
+//
+//        TMC_CHOPCONF::toff(3) | TMC_CHOPCONF::hstrt(5) | TMC_CHOPCONF::mres(6) | TMC_CHOPCONF::intpol(1)
+//
+//    Constant writes can be turned into complete datagrams, CRC included, by the compiler, so sending
+//    them costs no encoding at all (see TMC_Datagram and 'TMC_Serial::write(const TMC_Datagram&)').
+
+
+// Access types of the registers
+struct TMC_Access {
+	enum type : uint8_t {
+		read = 1,
+		write = 2,
+		read_write = 3,
+		read_clear = 7		// Read, write 1 to clear flags (GSTAT)
+	};
+};
+
+
+// A value of register 'Address', holding the bits of the fields that are set and which bits those are
+template<uint8_t Address>
+struct TMC_Value {
+	uint32_t bits;		// The field values, shifted into place
+	uint32_t mask;		// The bits the fields cover
+
+	constexpr TMC_Value(uint32_t Bits, uint32_t Mask) : bits(Bits), mask(Mask) {}
+
+	// A value for the whole register, ie. one read from the driver
+	static constexpr TMC_Value raw(uint32_t value) { return TMC_Value(value, 0xFFFFFFFF); }
+
+	// Returns 'reg' with the fields of this value replaced
+	constexpr uint32_t apply(uint32_t reg) const { return (reg & ~mask) | bits; }
+
+	friend constexpr TMC_Value operator|(TMC_Value a, TMC_Value b) { return TMC_Value(a.bits | b.bits, a.mask | b.mask); }
+};
+
+
+// A field of register 'Address', 'Width' bits starting at bit 'Shift'
+//    Constructing one encodes a field value, 'get()' decodes it from a register value.
+template<uint8_t Address, uint8_t Shift, uint8_t Width>
+struct TMC_Field : TMC_Value<Address> {
+	static const uint8_t shift = Shift;
+	static const uint8_t width = Width;
+
+	constexpr TMC_Field(uint32_t value) : TMC_Value<Address>((value << Shift) & mask(), mask()) {}
+
+	static constexpr uint32_t mask() { return (uint32_t)((((uint64_t)1 << Width) - 1) << Shift); }
+	static constexpr uint32_t get(uint32_t reg) { return (reg & mask()) >> Shift; }
+};
+
+
+// The base of every register description
+template<uint8_t Address, uint8_t Access>
+struct TMC_Register {
+	static const uint8_t address = Address;
+	static const uint8_t access = Access;
+	typedef TMC_Value<Address> value;
+};
+
+
+// ===== General configuration registers ===============================================================================
+struct TMC_GCONF : TMC_Register<0x00, TMC_Access::read_write> {
+	static constexpr const char* name() { return "GCONF"; }
+	typedef TMC_Field<address, 0, 1> I_scale_analog;		// VREF is the current reference
+	typedef TMC_Field<address, 1, 1> internal_Rsense;		// Use the internal sense resistors
+	typedef TMC_Field<address, 2, 1> en_SpreadCycle;		// SpreadCycle instead of StealthChop
+	typedef TMC_Field<address, 3, 1> shaft;					// Inverse motor direction
+	typedef TMC_Field<address, 4, 1> index_otpw;			// INDEX shows overtemperature prewarning
+	typedef TMC_Field<address, 5, 1> index_step;			// INDEX shows the step pulses of the internal generator
+	typedef TMC_Field<address, 6, 1> pdn_disable;			// PDN_UART is UART only, standstill current reduction by IHOLD
+	typedef TMC_Field<address, 7, 1> mstep_reg_select;		// Microstep resolution from MRES instead of MS1/MS2
+	typedef TMC_Field<address, 8, 1> multistep_filt;		// Filter the STEP pulses
+	typedef TMC_Field<address, 9, 1> test_mode;				// Keep 0
+};
+
+struct TMC_GSTAT : TMC_Register<0x01, TMC_Access::read_clear> {
+	static constexpr const char* name() { return "GSTAT"; }
+	typedef TMC_Field<address, 0, 1> reset;					// The IC was reset since the flag was cleared
+	typedef TMC_Field<address, 1, 1> drv_err;				// Shut down by overtemperature or short circuit
+	typedef TMC_Field<address, 2, 1> uv_cp;					// Charge pump undervoltage
+};
+
+struct TMC_IFCNT : TMC_Register<0x02, TMC_Access::read> {
+	static constexpr const char* name() { return "IFCNT"; }
+	typedef TMC_Field<address, 0, 8> IFCNT;					// Successful UART writes, wraps at 255
+};
+
+struct TMC_SLAVECONF : TMC_Register<0x03, TMC_Access::write> {
+	static constexpr const char* name() { return "SLAVECONF"; }
+	typedef TMC_Field<address, 8, 4> SENDDELAY;				// Reply delay, 0/1: 8 bit times, 2/3: 3*8, ... 14/15: 15*8
+};
+
+struct TMC_OTP_PROG : TMC_Register<0x04, TMC_Access::write> {
+	static constexpr const char* name() { return "OTP_PROG"; }
+	typedef TMC_Field<address, 0, 3> OTPBIT;				// The bit to program
+	typedef TMC_Field<address, 4, 2> OTPBYTE;				// The byte to program
+	typedef TMC_Field<address, 8, 8> OTPMAGIC;				// Must be 0xBD to program
+};
+
+struct TMC_OTP_READ : TMC_Register<0x05, TMC_Access::read> {
+	static constexpr const char* name() { return "OTP_READ"; }
+	typedef TMC_Field<address, 0, 8> OTP0;
+	typedef TMC_Field<address, 8, 8> OTP1;
+	typedef TMC_Field<address, 16, 8> OTP2;
+};
+
+struct TMC_IOIN : TMC_Register<0x06, TMC_Access::read> {
+	static constexpr const char* name() { return "IOIN"; }
+	typedef TMC_Field<address, 0, 1> ENN;
+	typedef TMC_Field<address, 2, 1> MS1;
+	typedef TMC_Field<address, 3, 1> MS2;
+	typedef TMC_Field<address, 4, 1> DIAG;
+	typedef TMC_Field<address, 6, 1> PDN_UART;
+	typedef TMC_Field<address, 7, 1> STEP;
+	typedef TMC_Field<address, 8, 1> SPREAD_EN;
+	typedef TMC_Field<address, 9, 1> DIR;
+	typedef TMC_Field<address, 24, 8> VERSION;				// 0x21 for the TMC2209
+};
+
+// ===== Velocity dependent control ===============================================================================
+struct TMC_IHOLD_IRUN : TMC_Register<0x10, TMC_Access::write> {
+	static constexpr const char* name() { return "IHOLD_IRUN"; }
+	typedef TMC_Field<address, 0, 5> IHOLD;					// Standstill current, (IHOLD + 1) / 32
+	typedef TMC_Field<address, 8, 5> IRUN;					// Motor run current, (IRUN + 1) / 32
+	typedef TMC_Field<address, 16, 4> IHOLDDELAY;			// Clock cycles * 2^18 per step of power down
+};
+
+struct TMC_TPOWERDOWN : TMC_Register<0x11, TMC_Access::write> {
+	static constexpr const char* name() { return "TPOWERDOWN"; }
+	typedef TMC_Field<address, 0, 8> TPOWERDOWN;			// Delay from standstill to current reduction, * 2^18 clocks
+};
+
+struct TMC_TSTEP : TMC_Register<0x12, TMC_Access::read> {
+	static constexpr const char* name() { return "TSTEP"; }
+	typedef TMC_Field<address, 0, 20> TSTEP;				// Time between two microsteps in clocks
+};
+
+struct TMC_TPWMTHRS : TMC_Register<0x13, TMC_Access::write> {
+	static constexpr const char* name() { return "TPWMTHRS"; }
+	typedef TMC_Field<address, 0, 20> TPWMTHRS;				// StealthChop above this TSTEP
+};
+
+struct TMC_TCOOLTHRS : TMC_Register<0x14, TMC_Access::write> {
+	static constexpr const char* name() { return "TCOOLTHRS"; }
+	typedef TMC_Field<address, 0, 20> TCOOLTHRS;			// CoolStep and StallGuard output below this TSTEP
+};
+
+struct TMC_VACTUAL : TMC_Register<0x22, TMC_Access::write> {
+	static constexpr const char* name() { return "VACTUAL"; }
+	typedef TMC_Field<address, 0, 24> VACTUAL;				// Velocity of the internal step generator, signed, 0: STEP input
+};
+
+// ===== StallGuard and CoolStep ===============================================================================
+struct TMC_SGTHRS : TMC_Register<0x40, TMC_Access::write> {
+	static constexpr const char* name() { return "SGTHRS"; }
+	typedef TMC_Field<address, 0, 8> SGTHRS;				// Stall when SG_RESULT <= 2 * SGTHRS
+};
+
+struct TMC_SG_RESULT : TMC_Register<0x41, TMC_Access::read> {
+	static constexpr const char* name() { return "SG_RESULT"; }
+	typedef TMC_Field<address, 0, 10> SG_RESULT;			// StallGuard result, lower means more load
+};
+
+struct TMC_COOLCONF : TMC_Register<0x42, TMC_Access::write> {
+	static constexpr const char* name() { return "COOLCONF"; }
+	typedef TMC_Field<address, 0, 4> semin;					// Lower StallGuard threshold / 32, 0 disables CoolStep
+	typedef TMC_Field<address, 5, 2> seup;					// Current increment steps
+	typedef TMC_Field<address, 8, 4> semax;					// Upper StallGuard threshold
+	typedef TMC_Field<address, 13, 2> sedn;					// Current decrement speed
+	typedef TMC_Field<address, 15, 1> seimin;				// Minimum current 1/4 instead of 1/2 of IRUN
+};
+
+// ===== Sequencer and chopper ===============================================================================
+struct TMC_MSCNT : TMC_Register<0x6A, TMC_Access::read> {
+	static constexpr const char* name() { return "MSCNT"; }
+	typedef TMC_Field<address, 0, 10> MSCNT;				// Position in the microstep table
+};
+
+struct TMC_MSCURACT : TMC_Register<0x6B, TMC_Access::read> {
+	static constexpr const char* name() { return "MSCURACT"; }
+	typedef TMC_Field<address, 0, 9> CUR_A;					// Current of phase A, signed
+	typedef TMC_Field<address, 16, 9> CUR_B;				// Current of phase B, signed
+};
+
+struct TMC_CHOPCONF : TMC_Register<0x6C, TMC_Access::read_write> {
+	static constexpr const char* name() { return "CHOPCONF"; }
+	typedef TMC_Field<address, 0, 4> toff;					// Off time, 0 disables the driver
+	typedef TMC_Field<address, 4, 3> hstrt;					// Hysteresis start, 1 - 8
+	typedef TMC_Field<address, 7, 4> hend;					// Hysteresis end (-3 - 12) + 3
+	typedef TMC_Field<address, 15, 2> tbl;					// Comparator blank time 16, 24, 32, 40 clocks
+	typedef TMC_Field<address, 17, 1> vsense;				// High sensitivity, low sense resistor voltage
+	typedef TMC_Field<address, 24, 4> mres;					// Microsteps 256 >> mres
+	typedef TMC_Field<address, 28, 1> intpol;				// Interpolate to 256 microsteps
+	typedef TMC_Field<address, 29, 1> dedge;				// Step on both edges of STEP
+	typedef TMC_Field<address, 30, 1> diss2g;				// Disable short to ground protection
+	typedef TMC_Field<address, 31, 1> diss2vs;				// Disable low side short protection
+};
+
+struct TMC_DRV_STATUS : TMC_Register<0x6F, TMC_Access::read> {
+	static constexpr const char* name() { return "DRV_STATUS"; }
+	typedef TMC_Field<address, 0, 1> otpw;					// Overtemperature prewarning
+	typedef TMC_Field<address, 1, 1> ot;					// Overtemperature
+	typedef TMC_Field<address, 2, 1> s2ga;					// Short to ground, phase A
+	typedef TMC_Field<address, 3, 1> s2gb;					// Short to ground, phase B
+	typedef TMC_Field<address, 4, 1> s2vsa;					// Low side short, phase A
+	typedef TMC_Field<address, 5, 1> s2vsb;					// Low side short, phase B
+	typedef TMC_Field<address, 6, 1> ola;					// Open load, phase A
+	typedef TMC_Field<address, 7, 1> olb;					// Open load, phase B
+	typedef TMC_Field<address, 8, 1> t120;					// Temperature thresholds exceeded
+	typedef TMC_Field<address, 9, 1> t143;
+	typedef TMC_Field<address, 10, 1> t150;
+	typedef TMC_Field<address, 11, 1> t157;
+	typedef TMC_Field<address, 16, 5> CS_ACTUAL;			// Actual motor current scale
+	typedef TMC_Field<address, 30, 1> stealth;				// Running in StealthChop
+	typedef TMC_Field<address, 31, 1> stst;					// Standstill
+};
+
+struct TMC_PWMCONF : TMC_Register<0x70, TMC_Access::read_write> {
+	static constexpr const char* name() { return "PWMCONF"; }
+	typedef TMC_Field<address, 0, 8> PWM_OFS;				// User defined amplitude offset
+	typedef TMC_Field<address, 8, 8> PWM_GRAD;				// User defined amplitude gradient
+	typedef TMC_Field<address, 16, 2> pwm_freq;				// PWM frequency 2/1024, 2/683, 2/512, 2/410 of the clock
+	typedef TMC_Field<address, 18, 1> pwm_autoscale;		// Automatic amplitude scaling
+	typedef TMC_Field<address, 19, 1> pwm_autograd;			// Automatic gradient adaptation
+	typedef TMC_Field<address, 20, 2> freewheel;			// Standstill mode when IHOLD = 0
+	typedef TMC_Field<address, 24, 4> PWM_REG;				// Regulation loop gradient
+	typedef TMC_Field<address, 28, 4> PWM_LIM;				// Amplitude limit for switching from SpreadCycle
+};
+
+struct TMC_PWM_SCALE : TMC_Register<0x71, TMC_Access::read> {
+	static constexpr const char* name() { return "PWM_SCALE"; }
+	typedef TMC_Field<address, 0, 8> PWM_SCALE_SUM;			// Actual PWM duty cycle
+	typedef TMC_Field<address, 16, 9> PWM_SCALE_AUTO;		// Result of the automatic amplitude regulation, signed
+};
+
+struct TMC_PWM_AUTO : TMC_Register<0x72, TMC_Access::read> {
+	static constexpr const char* name() { return "PWM_AUTO"; }
+	typedef TMC_Field<address, 0, 8> PWM_OFS_AUTO;			// Automatically determined offset
+	typedef TMC_Field<address, 16, 8> PWM_GRAD_AUTO;		// Automatically determined gradient
+};
+
+
+// A complete write datagram, as it goes on the wire (datasheet 4.1.1)
+//    Built by the compiler when the slave address and value are constants:
+//
+//        static constexpr TMC_Datagram chopconf = TMC_Datagram::write<TMC_CHOPCONF>(0, TMC_CHOPCONF::toff(3) | ...);
+struct TMC_Datagram {
+	static const uint8_t length = 8;
+	uint8_t bytes[length];
+
+	// Builds the write of a register value
+	//	s_address: The slave address of the driver
+	//	value: The register value, built from fields of 'Register' (or 'Register::value::raw()')
+	template<class Register>
+	static constexpr TMC_Datagram write(uint8_t s_address, TMC_Value<Register::address> value)
+	{
+		static_assert(Register::access & TMC_Access::write, "TMC_Datagram: the register is read only");
+		return encode(s_address, Register::address | TMC_CRC::write_bit, value.bits);
+	}
+
+	// Builds the write of a register value, without checking the register's access type
+	static constexpr TMC_Datagram encode(uint8_t s_address, uint8_t reg_rw, uint32_t data)
+	{
+		return TMC_Datagram{ {
+			TMC_CRC::sync_byte, s_address, reg_rw,
+			(uint8_t)(data >> 24), (uint8_t)(data >> 16), (uint8_t)(data >> 8), (uint8_t)data,
+			crc(s_address, reg_rw, data)
+		} };
+	}
+
+	constexpr uint8_t s_address() const { return bytes[1]; }
+	constexpr uint8_t r_address() const { return bytes[2] & ~TMC_CRC::write_bit; }
+	constexpr uint32_t data() const { return ((uint32_t)bytes[3] << 24) | ((uint32_t)bytes[4] << 16) | ((uint32_t)bytes[5] << 8) | bytes[6]; }
+
+	// Returns whether this is the datagram of a write with the given header, data and CRC
+	constexpr bool matches(uint8_t s_address, uint8_t reg_rw, uint32_t data, uint8_t crc) const
+	{
+		return bytes[0] == TMC_CRC::sync_byte && bytes[1] == s_address && bytes[2] == reg_rw && this->data() == data && bytes[7] == crc;
+	}
+
+private:
+	static constexpr uint8_t crc(uint8_t s_address, uint8_t reg_rw, uint32_t data)
+	{
+		return TMC_CRC::constexpr_write_crc(s_address, reg_rw & 0x7F, data);
+	}
+};
+
+
+// The encoding is checked against CRCs from the runtime (table driven) engine
+static_assert(TMC_Datagram::write<TMC_CHOPCONF>(0, TMC_CHOPCONF::toff(3) | TMC_CHOPCONF::hstrt(5) | TMC_CHOPCONF::mres(6) | TMC_CHOPCONF::intpol(1))
+	.matches(0, 0xEC, 0x16000053, 0xC9), "TMC_Datagram: CHOPCONF encoding");
+static_assert(TMC_Datagram::write<TMC_IHOLD_IRUN>(0, TMC_IHOLD_IRUN::IHOLD(2) | TMC_IHOLD_IRUN::IRUN(31) | TMC_IHOLD_IRUN::IHOLDDELAY(1))
+	.matches(0, 0x90, 0x00011F02, 0x20), "TMC_Datagram: IHOLD_IRUN encoding");
+static_assert(TMC_Datagram::write<TMC_GCONF>(3, TMC_GCONF::internal_Rsense(1) | TMC_GCONF::mstep_reg_select(1))
+	.matches(3, 0x80, 0x00000082, 0x13), "TMC_Datagram: GCONF encoding");
+static_assert(TMC_Datagram::write<TMC_VACTUAL>(1, TMC_VACTUAL::VACTUAL(-1000))
+	.matches(1, 0xA2, 0x00FFFC18, 0xBB), "TMC_Datagram: VACTUAL encoding");
+static_assert(TMC_CHOPCONF::mres::get(0x16000053) == 6 && TMC_DRV_STATUS::CS_ACTUAL::mask() == 0x001F0000 &&
+	TMC_PWMCONF::PWM_LIM::mask() == 0xF0000000, "TMC_Field: decoding");
@@ -1,11 +1,62 @@
 #include "TMC_Serial.h"
-
-Ring_Buffer<volatile TMC_Serial::access_ticket*> TMC_Serial::messageQueues[4];
-uint8_t TMC_Serial::idleTimes[4] = { -1, -1, -1, -1 };
+#include <new>
+
+TMC_Serial::ticket_queue TMC_Serial::messageQueues[4][TMC_Serial::priority_classes];
+uint8_t TMC_Serial::priorityOverrides[4][128];
+uint8_t TMC_Serial::passedOver[4][TMC_Serial::priority_classes];
+volatile TMC_Serial::access_ticket* volatile TMC_Serial::activeTickets[4][TMC_BURST_LENGTH];
+volatile uint8_t TMC_Serial::activeCounts[4];
+uint8_t TMC_Serial::txBursts[4][(max_burst - 1) * 8];
+uint8_t TMC_Serial::rxBursts[4][max_burst * 8];
+TMC_Serial::coalesce_entry TMC_Serial::coalesceTable[4][TMC_COALESCE_REGISTERS];
+TMC_Serial::subscription TMC_Serial::subscriptions[4][TMC_SUBSCRIPTIONS];
+TMC_Serial::ramp TMC_Serial::ramps[4][4];
+TMC_Serial::register_shadow TMC_Serial::shadows[4][4];
+
+// The state of a write_field() that has to read its register first. It takes the pool slot of the write
+//    ticket it turns into, so an update waiting on its read holds no more of the pool than the write would.
+struct field_update {
+	TMC_Serial* driver;
+	uint32_t field_mask;
+	uint32_t field_value;
+	void(*callback)(volatile TMC_Serial::access_ticket*, void*);
+	void* callback_parameters;
+};
+static_assert(sizeof(field_update) <= sizeof(TMC_Serial::write_ticket) && alignof(field_update) <= alignof(TMC_Serial::write_ticket),
+	"field_update must fit in the pool slot of a write ticket");
+
+// The ticket 'redundant_write' points to, completed so whoever looks at it sees the write as done
+static TMC_Serial::write_ticket completed_write_ticket()
+{
+	TMC_Serial::write_ticket ticket(0, 0, 0, TMC_Serial::deleteTicketCallback, nullptr);
+	ticket.status = TMC_Serial::access_ticket::state::completed_successfully;
+	return ticket;
+}
+static TMC_Serial::write_ticket redundantWriteTicket = completed_write_ticket();
+volatile TMC_Serial::write_ticket* const TMC_Serial::redundant_write = &redundantWriteTicket;
+std::atomic<bool> TMC_Serial::busyFlags[4];
+volatile uint8_t TMC_Serial::frameGaps[4] = { follow_send_delay, follow_send_delay, follow_send_delay, follow_send_delay };
+volatile uint8_t TMC_Serial::sendDelays[4][4] = { { 8, 8, 8, 8 }, { 8, 8, 8, 8 }, { 8, 8, 8, 8 }, { 8, 8, 8, 8 } };
+volatile bool TMC_Serial::turnarounds[4];
+volatile bool TMC_Serial::holds[4];
+volatile bool TMC_Serial::parked[4];
+TMC_Serial::retry_policy TMC_Serial::retryPolicies[4][TMC_Serial::priority_classes];
+volatile TMC_Serial::access_ticket* TMC_Serial::retryTickets[4][TMC_BURST_LENGTH];
+uint8_t TMC_Serial::retryCounts[4];
+volatile uint8_t TMC_Serial::completionModes[4];
+MPSC_Queue<volatile TMC_Serial::access_ticket*, TMC_COMPLETION_DEPTH> TMC_Serial::completions;
+MPSC_Queue<volatile TMC_Serial::access_ticket*, TMC_TIMED_TICKETS> TMC_Serial::timedInbox[4];
+volatile TMC_Serial::access_ticket* TMC_Serial::timedTickets[4][TMC_TIMED_TICKETS];
+volatile uint8_t TMC_Serial::timedCounts[4];
+volatile uint32_t TMC_Serial::nextDeadlines[4];
+#ifdef TMC_SERIAL_STATS
+TMC_Serial::bus_statistics TMC_Serial::busStatistics[4];
+#endif
+TMC_Serial::ticket_pool TMC_Serial::ticketPool;
 
 TMC_Serial::TMC_Serial(Usart* _Serial, uint32_t Baudrate) :
 	serial(_Serial),
-	message_queue(messageQueues[serial - USART0])
+	bus(bus_index(_Serial))
 {
 	// ===== Configure GPIO pins ===============================================================================
 	Pio* _pio;					// Pio Bank
@@ -13,46 +64,42 @@ TMC_Serial::TMC_Serial(Usart* _Serial, uint32_t Baudrate) :
 	uint8_t ab_select;			// multiplexing channel
 
 	// Determine the values based on which USART were working with
-	switch ((uint32_t)serial)
+	if (serial == USART0)		// USART0 uses RXD0 at PA10, and TXD0 at PA11, both multiplexed on channel A
 	{
-	case (uint32_t)USART0:	// USART0 uses RXD0 at PA10, and TXD0 at PA11, both multiplexed on channel A
 		_pio = PIOA;
 		rx_bit = 10;
 		tx_bit = 11;
 		ab_select = 0;
-		break;
-
-	case (uint32_t)USART1:	// USART1 uses RXD1 at PA12, and TXD1 at PA13, both multiplexed on channel A
+	}
+	else if (serial == USART1)	// USART1 uses RXD1 at PA12, and TXD1 at PA13, both multiplexed on channel A
+	{
 		_pio = PIOA;
 		rx_bit = 12;
 		tx_bit = 13;
 		ab_select = 0;
-		break;
-
-	case (uint32_t)USART2:	// USART2 uses RXD2 at PB21, and TXD2 at PB20, both multiplexed on channel A
+	}
+	else if (serial == USART2)	// USART2 uses RXD2 at PB21, and TXD2 at PB20, both multiplexed on channel A
+	{
 		_pio = PIOB;
 		rx_bit = 21;
 		tx_bit = 20;
 		ab_select = 0;
-		break;
-
-	case (uint32_t)USART3:	// USART3 uses RXD3 at PD5, and TXD3 at PD4, both multiplexed on channel B
+	}
+	else						// USART3 uses RXD3 at PD5, and TXD3 at PD4, both multiplexed on channel B
+	{
 		_pio = PIOD;
 		rx_bit = 5;
 		tx_bit = 4;
 		ab_select = 1;
-		break;
-	default:
-		break;
 	}
 
 	_pio->PIO_PDR = (1 << rx_bit) | (1 << tx_bit);						// Grant access to the pins to the peripherals
-	_pio->PIO_ABSR &= ~((1 << 10) | (1 << 11));							// Clear the current multiplexing selection
-	_pio->PIO_ABSR |= (ab_select << rx_bit) | (ab_select << tx_bit);	// Set the multiplexing selection
+	_pio->PIO_ABSR = (_pio->PIO_ABSR & ~((1 << rx_bit) | (1 << tx_bit)))	// Clear the current multiplexing selection
+		| (ab_select << rx_bit) | (ab_select << tx_bit);				// and set ours
 
 
 	// Enable Peripheral Clock for USART, necessary for configuration
-	REG_PMC_PCER0 = 1 << (serial - USART0 + ID_USART0);
+	REG_PMC_PCER0 = 1 << (ID_USART0 + bus);
 
 	// ===== Configure USART peripheral ===============================================================================
 	serial->US_MR =					// USART Mode Register (Configures the behavior/protocol used)
@@ -63,75 +110,62 @@ TMC_Serial::TMC_Serial(Usart* _Serial, uint32_t Baudrate) :
 		US_MR_NBSTOP_1_BIT |		// Set the number of stop bits
 		US_MR_CHMODE_NORMAL;		// Normal communication operation (can configure to loopback)
 
-	serial->US_BRGR = SystemCoreClock / Baudrate / 16;	// Configure the baudrate
+	serial->US_BRGR = brgr_for(Baudrate);	// Configure the baudrate
 
-	serial->US_TNPR = 0;	// These registers are never needed
+	serial->US_TNPR = 0;	// These registers are only used by write bursts
 	serial->US_TNCR = 0;	//    so we'll make sure they're 0.
 
-	NVIC_EnableIRQ((IRQn_Type)(serial - USART0 + USART0_IRQn));		// Enable interrupts for 'serial'
+	NVIC_EnableIRQ((IRQn_Type)(USART0_IRQn + bus));		// Enable interrupts for 'serial'
+
+	CoreDebug->DEMCR = CoreDebug->DEMCR | CoreDebug_DEMCR_TRCENA_Msk;	// Start the DWT cycle counter, commit_group() and the
+	DWT->CTRL = DWT->CTRL | DWT_CTRL_CYCCNTENA_Msk;						//    statistics of USART_Handler are timed with it
 }
 
 // Function to calculate the CRC bytes
 uint8_t TMC_Serial::calc_CRC(uint8_t* datagram, uint8_t datagram_size)
 {
-	uint8_t crc = 0;
-	uint8_t byte;
-	for (uint8_t i = 0; i < (datagram_size - 1); ++i)
-	{
-		byte = (*(uint64_t*)datagram >> (i * 8)) & 0xFF;
-		for (uint8_t j = 0; j < 8; ++j)
-		{
-			if ((crc >> 7) ^ (byte & 0x01))
-			{
-				crc = (crc << 1) ^ 0x07;
-			}
-			else
-			{
-				crc = crc << 1;
-			}
-			byte = byte >> 1;
-		}
-	}
-	return crc;
+	return TMC_CRC::calc(datagram, datagram_size);
 }
 
 
-TMC_Serial::read_access_datagram::read_access_datagram(uint8_t s_address, uint32_t r_address) :
-	sync(0b0101),
-	reserved(0x0),
-	device_address(s_address),
-	register_address(r_address),
-	rw_access(0),
-	CRC(calc_CRC((uint8_t*)this, datagram_length))
-{}
+// The fields are read back from the bytes, which holds with GCC's bitfield allocation on little endian targets
+//    (first field in the least significant bits), the Due's and the host simulator's
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "TMC_Serial: the datagram bitfields assume a little endian target");
+static_assert(sizeof(TMC_Serial::read_access_datagram) == TMC_Serial::read_access_datagram::datagram_length &&
+	sizeof(TMC_Serial::data_transfer_datagram) == TMC_Datagram::length, "TMC_Serial: the datagram bitfields are not packed into the datagram bytes");
 
 
-TMC_Serial::data_transfer_datagram::data_transfer_datagram() :	// initiallize this to 0, will be written to by serial
-	sync(0b0101),
-	reserved(0x0),
-	device_address(0),
-	register_address(0),
-	rw_access(0),
-	data3(0),
-	data2(0),
-	data1(0),
-	data0(0),
-	CRC(0)
-{}
+TMC_Serial::read_access_datagram::read_access_datagram(uint8_t s_address, uint32_t r_address)
+{
+	uint8_t* bytes = (uint8_t*)this;
+	bytes[0] = TMC_CRC::sync_byte;
+	bytes[1] = s_address;
+	bytes[2] = r_address & ~TMC_CRC::write_bit;
+	bytes[3] = TMC_CRC::calc(bytes, datagram_length);
+}
 
 
-TMC_Serial::data_transfer_datagram::data_transfer_datagram(uint32_t s_address, uint32_t r_address, const uint32_t& data) :
-	sync(0b0101),
-	reserved(0x0),
-	device_address(s_address),
-	register_address(r_address),
-	rw_access(1),
-	data3(((uint8_t*)&data)[3]),
-	data2(((uint8_t*)&data)[2]),
-	data1(((uint8_t*)&data)[1]),
-	data0(((uint8_t*)&data)[0]),
-	CRC(calc_CRC((uint8_t*)this, datagram_length))
-{}
+TMC_Serial::data_transfer_datagram::data_transfer_datagram()	// initiallize this to 0, will be written to by serial
+{
+	uint8_t* bytes = (uint8_t*)this;
+	memset(bytes, 0, datagram_length);
+	bytes[0] = TMC_CRC::sync_byte;
+}
+
+
+TMC_Serial::data_transfer_datagram::data_transfer_datagram(uint32_t s_address, uint32_t r_address, const uint32_t& data)
+{
+	// Same bytes as 'TMC_Datagram::encode()', the data goes most significant byte first
+	uint8_t* bytes = (uint8_t*)this;
+	bytes[0] = TMC_CRC::sync_byte;
+	bytes[1] = s_address;
+	bytes[2] = r_address | TMC_CRC::write_bit;
+	bytes[3] = data >> 24;
+	bytes[4] = data >> 16;
+	bytes[5] = data >> 8;
+	bytes[6] = data;
+	bytes[7] = TMC_CRC::write_crc(s_address, r_address, data);	// Only the data bytes are folded in, the header is cached
+}
 
 
 TMC_Serial::access_ticket::_request::_request(uint32_t s_address, uint32_t r_address) :
@@ -143,19 +177,56 @@ TMC_Serial::access_ticket::_request::_request(uint32_t s_address, uint32_t r_add
 	data_transfer(s_address, r_address, data)
 {}
 
+TMC_Serial::access_ticket::_request::_request(const TMC_Datagram& prebuilt) :
+	data_transfer()
+{
+	memcpy((void*)this, prebuilt.bytes, TMC_Datagram::length);
+}
+
 
 TMC_Serial::access_ticket::access_ticket(uint32_t s_address, uint32_t r_address, void(*Callback)(volatile access_ticket*, void*), void* Callback_parameters) :
 	datagram(s_address, r_address),
 	status(state::pending),
+	priority(configuration),
+	fanout(0),
+	fanout_failed(0),
+	fanout_data(nullptr),
+	attempts(0),
 	callback(Callback),
-	callback_parameters(Callback_parameters)
+	callback_parameters(Callback_parameters),
+	coalesce(nullptr),
+	deadline(0),
+	sent_at(0)
 {}
 
 TMC_Serial::access_ticket::access_ticket(uint32_t s_address, uint32_t r_address, uint32_t data, void(*Callback)(volatile access_ticket*, void*), void* Callback_parameters) :
 	datagram(s_address, r_address, data),
 	status(state::pending),
+	priority(configuration),
+	fanout(0),
+	fanout_failed(0),
+	fanout_data(nullptr),
+	attempts(0),
+	callback(Callback),
+	callback_parameters(Callback_parameters),
+	coalesce(nullptr),
+	deadline(0),
+	sent_at(0)
+{}
+
+TMC_Serial::access_ticket::access_ticket(const TMC_Datagram& prebuilt, void(*Callback)(volatile access_ticket*, void*), void* Callback_parameters) :
+	datagram(prebuilt),
+	status(state::pending),
+	priority(configuration),
+	fanout(0),
+	fanout_failed(0),
+	fanout_data(nullptr),
+	attempts(0),
 	callback(Callback),
-	callback_parameters(Callback_parameters)
+	callback_parameters(Callback_parameters),
+	coalesce(nullptr),
+	deadline(0),
+	sent_at(0)
 {}
 
 bool TMC_Serial::access_ticket::transfer_complete() const volatile
@@ -163,6 +234,26 @@ bool TMC_Serial::access_ticket::transfer_complete() const volatile
 	return status != state::pending;
 }
 
+void TMC_Serial::access_ticket::reset() volatile
+{
+	status = state::pending;
+	fanout_failed = 0;
+	attempts = 0;
+}
+
+void* TMC_Serial::access_ticket::operator new(size_t size) noexcept
+{
+	// A type derived later that outgrew the pool's slots gets nullptr, like an exhausted pool
+	if (size > sizeof(access_ticket))
+		return nullptr;
+	return ticketPool.acquire();
+}
+
+void TMC_Serial::access_ticket::operator delete(void* ticket)
+{
+	ticketPool.release(ticket);
+}
+
 
 TMC_Serial::read_ticket::read_ticket(uint32_t s_address, uint32_t r_address, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters) :
 	access_ticket(s_address, r_address, Callback, Callback_parameters)
@@ -170,16 +261,18 @@ TMC_Serial::read_ticket::read_ticket(uint32_t s_address, uint32_t r_address, voi
 
 uint32_t TMC_Serial::access_ticket::get_data() volatile const
 {
+	const volatile data_transfer_datagram& source = datagram.data_transfer.rw_access ? datagram.data_transfer : reply();
 	noInterrupts();
-	uint8_t data[] = { datagram.data_transfer.data0, datagram.data_transfer.data1, datagram.data_transfer.data2, datagram.data_transfer.data3 };
+	uint8_t data[] = { source.data0, source.data1, source.data2, source.data3 };
 	interrupts();
 	return *(uint32_t*)data;
 }
 
 bool TMC_Serial::access_ticket::validate_crc() const volatile
 {
+	const volatile data_transfer_datagram& source = datagram.data_transfer.rw_access ? datagram.data_transfer : reply();
 	noInterrupts();
-	bool ret_val = datagram.data_transfer.CRC == calc_CRC((uint8_t*)&datagram.data_transfer, datagram.data_transfer.datagram_length);
+	bool ret_val = source.CRC == TMC_CRC::calc((const uint8_t*)&source, source.datagram_length);
 	interrupts();
 	return ret_val;
 }
@@ -189,157 +282,2105 @@ TMC_Serial::write_ticket::write_ticket(uint32_t s_address, uint32_t r_address, u
 	access_ticket(s_address, r_address, data, Callback, Callback_parameters)
 {}
 
+TMC_Serial::write_ticket::write_ticket(const TMC_Datagram& prebuilt, void(*Callback)(volatile access_ticket*, void*), void* Callback_parameters) :
+	access_ticket(prebuilt, Callback, Callback_parameters)
+{}
+
 volatile  TMC_Serial::read_ticket* TMC_Serial::read(uint32_t s_address, uint32_t r_address, void(*Callback)(volatile access_ticket*, void*), void* Callback_parameters)
 {
-	noInterrupts();
-
+	// The pool is lock-free, so the ticket is built before interrupts are disabled
 	volatile read_ticket* ticket = new volatile read_ticket(s_address, r_address, Callback, Callback_parameters);
-	message_queue.push(ticket);
-	if (message_queue.size() == 1)
-		begin_transfers(serial, ticket);
+	if (ticket == nullptr)
+		return nullptr;
 
-	interrupts();
+	if (!enqueue(bus, ticket))
+	{
+		delete ticket;
+		return nullptr;
+	}
 
 	return ticket;
 }
 
 volatile TMC_Serial::write_ticket* TMC_Serial::write(uint32_t s_address, uint32_t r_address, uint32_t data, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters)
 {
-	noInterrupts();
+	return queue_write(s_address, r_address, data, nullptr, false, Callback, Callback_parameters);
+}
 
-	volatile write_ticket* ticket = new volatile write_ticket(s_address, r_address, data, Callback, Callback_parameters);
-	message_queue.push(ticket);
-	if (message_queue.size() == 1)
-		begin_transfers(serial, ticket);
+volatile TMC_Serial::write_ticket* TMC_Serial::write_exact(uint32_t s_address, uint32_t r_address, uint32_t data, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters)
+{
+	return queue_write(s_address, r_address, data, nullptr, true, Callback, Callback_parameters);
+}
 
-	interrupts();
+volatile TMC_Serial::write_ticket* TMC_Serial::write(const TMC_Datagram& prebuilt, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters)
+{
+	return queue_write(prebuilt.s_address(), prebuilt.r_address(), prebuilt.data(), &prebuilt, false, Callback, Callback_parameters);
+}
+
+volatile TMC_Serial::write_ticket* TMC_Serial::queue_write(uint32_t s_address, uint32_t r_address, uint32_t data, const TMC_Datagram* prebuilt, bool exact, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters)
+{
+	register_shadow* shadow = nullptr;
+	int8_t index = shadow_index(r_address);
+	if (s_address < 4 && index >= 0)
+	{
+		shadow = &shadows[bus][s_address];
+
+		// Nobody waits on a fire-and-forget write, so there's no point sending a value the register already holds
+		if (!exact && Callback == deleteTicketCallback && (shadow->known & (1 << index)) &&
+			shadow->in_flight[index].load() == 0 && shadow->requested[index] == data)
+			return redundant_write;
+
+		shadow->requested[index] = data;
+	}
+
+	coalesce_slot* slot = find_coalesce_slot(bus, s_address, r_address);
+	if (slot != nullptr && (exact || Callback != deleteTicketCallback))
+	{
+		// Someone waits on this write, it keeps its own ticket and value. A queued fire-and-forget write goes
+		//    out before it with the value it has, later ones must queue behind us instead of folding into it.
+		slot->pending.store(false);
+		slot = nullptr;
+	}
+	if (slot != nullptr)
+	{
+		// If a write to this register is still waiting in the queue, hand it the new value. The ticket
+		//    clears 'pending' before it reads the value, so if 'pending' is still set after our store,
+		//    the queued write is guaranteed to go out with 'data'.
+		if (slot->pending.load())
+		{
+			volatile access_ticket* queued = slot->ticket;
+			slot->value.store(data);
+			if (slot->pending.load())
+				return (volatile write_ticket*)queued;
+		}
+		slot->value.store(data);
+	}
+
+	// The pool is lock-free, so the ticket is built before interrupts are disabled
+	volatile write_ticket* ticket = prebuilt != nullptr ?
+		new volatile write_ticket(*prebuilt, Callback, Callback_parameters) :
+		new volatile write_ticket(s_address, r_address, data, Callback, Callback_parameters);
+	if (ticket == nullptr)
+		return nullptr;
+
+	if (slot != nullptr)
+	{
+		ticket->coalesce = slot;
+		slot->ticket = ticket;
+		slot->pending.store(true);
+	}
+
+	// Counted before the ticket is queued, it may complete before enqueue() returns
+	if (shadow != nullptr)
+	{
+		shadow->in_flight[index].fetch_add(1);
+		shadow->known |= 1 << index;
+	}
+
+	if (!enqueue(bus, ticket))
+	{
+		if (slot != nullptr)
+			slot->pending.store(false);
+		if (shadow != nullptr)
+		{
+			shadow->known &= ~(1 << index);
+			shadow->in_flight[index].fetch_sub(1);
+		}
+		delete ticket;
+		return nullptr;
+	}
 
 	return ticket;
 }
 
-void TMC_Serial::deleteTicketCallback(volatile access_ticket* ticket, void*)
+volatile TMC_Serial::write_ticket* TMC_Serial::write_fanout(uint8_t slave_mask, uint32_t r_address, uint32_t data, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters)
+{
+	slave_mask &= 0x0F;
+	if (slave_mask == 0)
+		return nullptr;
+
+	uint8_t first = 0;
+	while (!(slave_mask & (1 << first)))
+		++first;
+
+	volatile write_ticket* ticket = new volatile write_ticket(first, r_address, data, Callback, Callback_parameters);
+	if (ticket == nullptr)
+		return nullptr;
+	ticket->fanout = slave_mask;
+
+	// Counted before the ticket is queued, it may complete before enqueue() returns
+	track_writes(bus, slave_mask, r_address, data);
+	if (!enqueue(bus, ticket))
+	{
+		untrack_writes(bus, slave_mask, r_address);
+		delete ticket;
+		return nullptr;
+	}
+
+	return ticket;
+}
+
+bool TMC_Serial::resubmit(volatile access_ticket* ticket)
+{
+	if (!ticket->transfer_complete())
+		return false;
+
+	// A write counts toward the shadows of its slaves again
+	uint8_t slaves = 0;
+	uint32_t s_address = ticket->datagram.data_transfer.device_address;
+	uint32_t r_address = ticket->datagram.data_transfer.register_address;
+	if (ticket->datagram.data_transfer.rw_access)
+		slaves = ticket->fanout ? ticket->fanout : s_address < 4 ? 1 << s_address : 0;
+
+	uint8_t previous = ticket->status;
+	ticket->reset();
+	if (ticket->fanout_data != nullptr)
+	{
+		for (uint8_t s = 0; s < 4; ++s)
+			if (slaves & (1 << s))
+				track_writes(bus, 1 << s, r_address, ticket->fanout_data[s]);
+	}
+	else
+		track_writes(bus, slaves, r_address, ticket->get_data());
+	if (!enqueue(bus, ticket))
+	{
+		untrack_writes(bus, slaves, r_address);
+		ticket->status = previous;
+		return false;
+	}
+
+	return true;
+}
+
+void TMC_Serial::track_writes(size_t bus, uint8_t slave_mask, uint32_t r_address, uint32_t data, bool hand_over)
+{
+	int8_t index = shadow_index(r_address);
+	for (uint8_t s = 0; s < 4; ++s)
+	{
+		if (!(slave_mask & (1 << s)))
+			continue;
+
+		// A write still waiting in a coalescing slot goes out before us, make it send our value and let
+		//    later writes queue behind us instead of folding into it
+		coalesce_slot* slot = find_coalesce_slot(bus, s, r_address);
+		if (slot != nullptr)
+		{
+			if (hand_over)
+				slot->value.store(data);
+			slot->pending.store(false);
+		}
+
+		if (index >= 0)
+		{
+			register_shadow& shadow = shadows[bus][s];
+			shadow.requested[index] = data;
+			shadow.in_flight[index].fetch_add(1);
+			shadow.known |= 1 << index;
+		}
+	}
+}
+
+void TMC_Serial::untrack_writes(size_t bus, uint8_t slave_mask, uint32_t r_address)
+{
+	int8_t index = shadow_index(r_address);
+	if (index < 0)
+		return;
+
+	for (uint8_t s = 0; s < 4; ++s)
+		if (slave_mask & (1 << s))
+		{
+			shadows[bus][s].known &= ~(1 << index);
+			shadows[bus][s].in_flight[index].fetch_sub(1);
+		}
+}
+
+int8_t TMC_Serial::shadow_index(uint32_t r_address)
+{
+	switch (r_address)
+	{
+	case GCONF:			return 0;
+	case SLAVECONF:		return 1;
+	case IHOLD_IRUN:	return 2;
+	case TPOWERDOWN:	return 3;
+	case TPWMTHRS:		return 4;
+	case VACTUAL:		return 5;
+	case TCOOLTHRS:		return 6;
+	case SGTHRS:		return 7;
+	case COOL_CONF:		return 8;
+	case CHOPCONF:		return 9;
+	case PWMCONF:		return 10;
+	default:			return -1;
+	}
+}
+
+bool TMC_Serial::readable_shadow(uint32_t r_address)
 {
+	return r_address == GCONF || r_address == CHOPCONF || r_address == PWMCONF;
+}
+
+bool TMC_Serial::shadow_value(uint32_t s_address, uint32_t r_address, uint32_t& value) const
+{
+	int8_t index = shadow_index(r_address);
+	if (s_address >= 4 || index < 0)
+		return false;
+
+	const register_shadow& shadow = shadows[bus][s_address];
+	if (!(shadow.known & (1 << index)))
+		return false;
+
+	value = shadow.requested[index];
+	return true;
+}
+
+bool TMC_Serial::write_field(uint32_t s_address, uint32_t r_address, uint32_t field_mask, uint32_t field_value, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters)
+{
+	uint32_t current;
+	if (shadow_value(s_address, r_address, current))
+	{
+		uint32_t value = (current & ~field_mask) | (field_value & field_mask);
+
+		// A redundant fire-and-forget write comes back as 'redundant_write', only exhaustion returns nullptr
+		return write(s_address, r_address, value, Callback, Callback_parameters) != nullptr;
+	}
+
+	// Only registers that can be read back can be updated without knowing their value
+	if (!readable_shadow(r_address))
+		return false;
+
+	field_update* update = (field_update*)ticketPool.acquire();
+	if (update == nullptr)
+		return false;
+
+	update->driver = this;
+	update->field_mask = field_mask;
+	update->field_value = field_value;
+	update->callback = Callback;
+	update->callback_parameters = Callback_parameters;
+
+	if (read(s_address, r_address, write_field_callback, update) == nullptr)
+	{
+		ticketPool.release(update);
+		return false;
+	}
+	return true;
+}
+
+void TMC_Serial::write_field_callback(volatile access_ticket* ticket, void* field_update_pointer)
+{
+	// The update's slot is given back first, so the write can have it
+	field_update update = *(field_update*)field_update_pointer;
+	ticketPool.release(field_update_pointer);
+
+	if (ticket->status == access_ticket::state::completed_successfully)
+	{
+		uint32_t value = (ticket->get_data() & ~update.field_mask) | (update.field_value & update.field_mask);
+		update.driver->write(ticket->datagram.data_transfer.device_address, ticket->datagram.data_transfer.register_address,
+			value, update.callback, update.callback_parameters);
+	}
+
 	delete ticket;
 }
 
-void TMC_Serial::storeRegisterAt(volatile access_ticket* ticket, void* uint32_pointer)
+bool TMC_Serial::sync_shadow(uint32_t s_address)
 {
-	*(uint32_t*)uint32_pointer = ticket->get_data();
+	if (s_address >= 4)
+		return false;
 
-	// The code above looks a bit complex because of the type punning
-	//    essentially all thats going on is were treating the void*
-	//    'uint32_pointer' as an actual uint32_t* so we can write to
-	//    it. Then we're treating the access_ticket* 'ticket' as a
-	//    read_ticket* so we can call the 'get_data()' method to easily
-	//    retrieve the data from the datagram.'
+	return read(s_address, IFCNT, sync_shadow_callback, &shadows[bus][s_address]) != nullptr;
 }
 
-void TMC_Serial::begin_transfers(Usart* serial, volatile  access_ticket* ticket)
+void TMC_Serial::sync_shadow_callback(volatile access_ticket* ticket, void*)
 {
-	bool access_type = ticket->datagram.data_transfer.rw_access;
+	// The count was compared by update_shadow() when the read completed, the callback may run much later
+	delete ticket;
+}
 
-	serial->US_RPR = (uint32_t)&ticket->datagram;
-	serial->US_RNPR = (uint32_t)&ticket->datagram;
-	serial->US_TPR = (uint32_t)&ticket->datagram;
+void TMC_Serial::invalidate_shadow(uint32_t s_address)
+{
+	if (s_address >= 4)
+		return;
 
-	if (ticket->datagram.data_transfer.rw_access)	// if this is a write ticket
+	register_shadow& shadow = shadows[bus][s_address];
+	shadow.known = 0;
+	shadow.ifcnt_known = false;
+}
+
+bool TMC_Serial::write_verified(uint32_t s_address, write_batch& batch, const batch_write* writes, uint8_t count, void(*Callback)(write_batch&, void*), void* Callback_parameters)
+{
+	if (s_address >= 4 || count == 0 || count > 32)
+		return false;
+
+	batch.status = write_batch::state::running;
+	batch.landed = 0;
+	batch.lost = 0;
+	batch.unverified = 0;
+	batch.driver = this;
+	batch.writes = writes;
+	batch.callback = Callback;
+	batch.callback_parameters = Callback_parameters;
+	batch.s_address = s_address;
+	batch.count = count;
+
+	return read(s_address, IFCNT, batch_counted, &batch) != nullptr;
+}
+
+void TMC_Serial::batch_counted(volatile access_ticket* ticket, void* batch_pointer)
+{
+	write_batch& batch = *(write_batch*)batch_pointer;
+	bool succeeded = ticket->status == access_ticket::state::completed_successfully;
+	batch.ifcnt = ticket->get_data() & 0xFF;
+	delete ticket;
+
+	if (!succeeded)
 	{
-		serial->US_RCR	= ticket->datagram.data_transfer.datagram_length;
-		serial->US_RNCR	= 0;
-		serial->US_TCR	= ticket->datagram.data_transfer.datagram_length;
+		finish_batch(batch, write_batch::state::failed);
+		return;
 	}
-	else	// if this is a read ticket
+
+	// Exact writes, so each one is sent and reports back to us, and they still go out as bursts.
+	//    'outstanding' holds one count until all writes are queued, so the last completion can't come early.
+	batch.outstanding.store(1);
+	for (uint8_t i = 0; i < batch.count; ++i)
 	{
-		serial->US_RCR	= ticket->datagram.read_request.datagram_length;
-		serial->US_RNCR	= ticket->datagram.data_transfer.datagram_length;
-		serial->US_TCR	= ticket->datagram.read_request.datagram_length;
+		batch.outstanding.fetch_add(1);
+		if (batch.driver->write_exact(batch.s_address, batch.writes[i].r_address, batch.writes[i].data, batch_written, &batch) == nullptr)
+		{
+			batch.outstanding.fetch_sub(1);
+			batch.lost = batch.lost | (1ul << i);
+		}
+	}
+	batch_written(nullptr, &batch);
+}
 
-		serial->US_RTOR = 24;			// Trigger a timeout if the start of two recieved characters excedes 24 bit-times (1/baudrate)
-		serial->US_CR = US_CR_RETTO;	// Rearm Timeout, this tells the timeout counter to begin immediately
+void TMC_Serial::batch_written(volatile access_ticket* ticket, void* batch_pointer)
+{
+	write_batch& batch = *(write_batch*)batch_pointer;
+	if (ticket != nullptr)
+		delete ticket;
+
+	if (batch.outstanding.fetch_sub(1) > 1)
+		return;
+
+	if (batch.lost != 0)
+	{
+		finish_batch(batch, write_batch::state::failed);
+		return;
 	}
 
-	serial->US_CR = US_CR_TXEN | US_CR_RXEN;
-	serial->US_PTCR = US_PTCR_TXTEN | US_PTCR_RXTEN;
-	serial->US_IER = US_IER_RXBUFF | US_IER_TIMEOUT;
+	// The writes have all completed, so the counter can be read right away
+	batch.outstanding.store(1);
+	if (batch.driver->read(batch.s_address, IFCNT, batch_recounted, &batch) == nullptr)
+		finish_batch(batch, write_batch::state::failed);
 }
 
+void TMC_Serial::batch_recounted(volatile access_ticket* ticket, void* batch_pointer)
+{
+	write_batch& batch = *(write_batch*)batch_pointer;
+	bool succeeded = ticket->status == access_ticket::state::completed_successfully;
+	batch.landed = (ticket->get_data() & 0xFF) - batch.ifcnt;	// IFCNT wraps at 255
+	delete ticket;
+
+	if (!succeeded)
+	{
+		batch.landed = 0;
+		finish_batch(batch, write_batch::state::failed);
+		return;
+	}
+	if (batch.landed == batch.count)
+	{
+		finish_batch(batch, write_batch::state::verified);
+		return;
+	}
+
+	// Read back what can be read to find the lost writes. A register written twice only holds the later value.
+	batch.outstanding.store(1);
+	for (uint8_t i = 0; i < batch.count; ++i)
+	{
+		uint32_t r_address = batch.writes[i].r_address;
+		bool overwritten = false;
+		for (uint8_t j = i + 1; j < batch.count; ++j)
+			overwritten |= batch.writes[j].r_address == r_address;
+
+		batch.outstanding.fetch_add(1);
+		if (overwritten || !readable_shadow(r_address) || batch.driver->read(batch.s_address, r_address, batch_read_back, &batch) == nullptr)
+		{
+			batch.outstanding.fetch_sub(1);
+			batch.unverified = batch.unverified | (1ul << i);
+		}
+	}
+	batch_read_back(nullptr, &batch);
+}
 
-inline void message_queue_idle_handler() {
-	for (size_t i = 0; i < 4; i++)
+void TMC_Serial::batch_read_back(volatile access_ticket* ticket, void* batch_pointer)
+{
+	write_batch& batch = *(write_batch*)batch_pointer;
+	if (ticket != nullptr)
 	{
-		uint8_t& idle_time = TMC_Serial::idleTimes[i];
-		if (idle_time == 0xFF)
-			continue;	// this message queue is not idle
+		// The read belongs to the last write of its register
+		uint32_t r_address = ticket->datagram.data_transfer.register_address;
+		uint8_t i = batch.count - 1;
+		while (batch.writes[i].r_address != r_address)
+			--i;
+
+		if (ticket->status != access_ticket::state::completed_successfully)
+			batch.unverified = batch.unverified | (1ul << i);
+		else if (ticket->get_data() != batch.writes[i].data)
+			batch.lost = batch.lost | (1ul << i);
+		delete ticket;
+	}
 
-		Ring_Buffer<volatile TMC_Serial::access_ticket*>& message_queue = TMC_Serial::messageQueues[i];
-		++idle_time;	// add 1ms to the idle time
+	if (batch.outstanding.fetch_sub(1) == 1)
+		finish_batch(batch, write_batch::state::mismatch);
+}
 
-		if (idle_time > 1) {
-			TMC_Serial::begin_transfers(&(USART0[i]), message_queue.pull((bool)false));
-			idle_time = 0xFF;
+void TMC_Serial::finish_batch(write_batch& batch, uint8_t status)
+{
+	// The shadow can't vouch for writes that may not have landed
+	if (status == write_batch::state::mismatch)
+	{
+		register_shadow& shadow = shadows[batch.driver->bus][batch.s_address];
+		for (uint8_t i = 0; i < batch.count; ++i)
+		{
+			int8_t index = shadow_index(batch.writes[i].r_address);
+			if (index >= 0 && ((batch.lost | batch.unverified) & (1ul << i)))
+				shadow.known &= ~(1 << index);
 		}
 	}
+
+	batch.status = status;
+	if (batch.callback != nullptr)
+		batch.callback(batch, batch.callback_parameters);
 }
 
-extern "C" {
-	int sysTickHook() {
-		message_queue_idle_handler();
-		return 0;
+void TMC_Serial::update_shadow(size_t bus, volatile access_ticket* ticket)
+{
+	uint32_t s_address = ticket->datagram.data_transfer.device_address;
+	uint32_t r_address = ticket->datagram.data_transfer.register_address;
+	bool succeeded = ticket->status == access_ticket::state::completed_successfully;
+
+	if (ticket->fanout)
+	{
+		uint32_t data = ticket->get_data();
+		for (uint8_t s = 0; s < 4; ++s)
+			if (ticket->fanout & (1 << s))
+				update_written(bus, s, r_address, ticket->fanout_data ? ticket->fanout_data[s] : data, !(ticket->fanout_failed & (1 << s)));
+		return;
+	}
+
+	if (s_address >= 4)
+		return;
+
+	if (ticket->datagram.data_transfer.rw_access)	// write tickets
+	{
+		update_written(bus, s_address, r_address, ticket->get_data(), succeeded);
+		return;
+	}
+
+	register_shadow& shadow = shadows[bus][s_address];
+
+	// A sync_shadow() read. The writes counted in 'ifcnt' are the ones whose transfers completed, which
+	//    are exactly the ones the driver could have counted when it replied, whatever is still queued. So
+	//    the counter must match unless the driver lost a write or was reset.
+	if (succeeded && r_address == IFCNT && ticket->callback == sync_shadow_callback)
+	{
+		uint8_t ifcnt = ticket->get_data() & 0xFF;
+		if (shadow.ifcnt_known && shadow.ifcnt != ifcnt)
+			shadow.known.store(0);
+		shadow.ifcnt = ifcnt;
+		shadow.ifcnt_known = true;
+		return;
+	}
+
+	int8_t index = shadow_index(r_address);
+	if (succeeded && readable_shadow(r_address) && shadow.in_flight[index].load() == 0)	// a read with no write racing it
+	{
+		uint32_t value = ticket->get_data();
+		shadow.requested[index] = value;
+		shadow.confirmed[index] = value;
+		shadow.known |= 1 << index;
 	}
 }
 
+void TMC_Serial::update_written(size_t bus, uint32_t s_address, uint32_t r_address, uint32_t data, bool succeeded)
+{
+	register_shadow& shadow = shadows[bus][s_address];
+	int8_t index = shadow_index(r_address);
+
+	if (succeeded)
+		shadow.ifcnt = shadow.ifcnt + 1;		// The driver counts every write it accepts, shadowed or not
 
-void USART_Handler(Usart* serial, uint32_t status) {
-	if ( (status & US_CSR_RXBUFF) || (status & US_CSR_TIMEOUT) )
+	// SENDDELAY (bits 11..8) delays the slave's replies by 8 bit times per odd step (0 and 1 are both 8).
+	//    If the write failed it may still have landed, so keep whichever delay is longer.
+	if (r_address == SLAVECONF)
 	{
-		Ring_Buffer<volatile TMC_Serial::access_ticket*>& message_queue = TMC_Serial::messageQueues[0];
-		volatile TMC_Serial::access_ticket* ticket = message_queue.pull((bool)true);
+		uint8_t delay = 8 * (((data >> 8) & 0x0F) | 1);
+		if (succeeded || delay > sendDelays[bus][s_address])
+			sendDelays[bus][s_address] = delay;
+	}
 
-		if (!message_queue.empty())
-			TMC_Serial::idleTimes[0] = 0;
+	if (index < 0)
+		return;
 
-		serial->US_RTOR = 0; // Disable timeouts
-		serial->US_CR = US_CR_TXDIS | US_CR_RXDIS | US_CR_RSTTX | US_CR_RSTRX;
-		serial->US_PTCR = US_PTCR_TXTDIS | US_PTCR_RXTDIS;
-		serial->US_IDR = US_IDR_RXBUFF | US_IDR_TIMEOUT;
+	if (succeeded)
+		shadow.confirmed[index] = data;
+	else
+		shadow.known &= ~(1 << index);	// We can't tell whether the write landed
+	shadow.in_flight[index].fetch_sub(1);
+}
 
-		// If the ticket timed out, assign the status the timedout status
-		if (status & US_CSR_TIMEOUT)
-			ticket->status = TMC_Serial::access_ticket::state::timedout;
-		
-		// Everything completed successfully, assign the completed_successfully flag
-		else if (ticket->validate_crc())
-			ticket->status = TMC_Serial::access_ticket::state::completed_successfully;
+bool TMC_Serial::set_coalescing(uint32_t r_address, bool enable)
+{
+	coalesce_entry* entries = coalesceTable[bus];
+	coalesce_entry* unused = nullptr;
 
-		// If the ticket's CRC does not match what it should, assign the crc_error status
-		else
-			ticket->status = TMC_Serial::access_ticket::state::crc_error;
+	for (size_t i = 0; i < TMC_COALESCE_REGISTERS; ++i)
+	{
+		if (entries[i].enabled && entries[i].r_address == r_address)
+		{
+			if (!enable)
+				entries[i].enabled = false;
+			return true;
+		}
+		if (!entries[i].enabled && unused == nullptr)
+			unused = &entries[i];
+	}
+
+	if (!enable)
+		return true;
+	if (unused == nullptr)
+		return false;
+
+	unused->r_address = r_address;
+	for (size_t s = 0; s < 4; ++s)
+		unused->slaves[s].pending.store(false);
+	unused->enabled = true;
+	return true;
+}
+
+TMC_Serial::coalesce_slot* TMC_Serial::find_coalesce_slot(size_t bus, uint32_t s_address, uint32_t r_address)
+{
+	if (s_address >= 4)
+		return nullptr;
+
+	coalesce_entry* entries = coalesceTable[bus];
+	for (size_t i = 0; i < TMC_COALESCE_REGISTERS; ++i)
+	{
+		if (entries[i].enabled && entries[i].r_address == r_address)
+			return &entries[i].slaves[s_address];
+	}
+	return nullptr;
+}
+
+void TMC_Serial::take_coalesced(volatile access_ticket* ticket)
+{
+	coalesce_slot* slot = ticket->coalesce;
+	if (slot == nullptr)
+		return;
+
+	slot->pending.store(false);	// From here on new writes get their own ticket
+	uint32_t data = slot->value.load();
+	ticket->coalesce = nullptr;		// A retry sends the same value again
+
+	uint32_t s_address = ticket->datagram.data_transfer.device_address;
+	uint32_t r_address = ticket->datagram.data_transfer.register_address;
+	new ((void*)&ticket->datagram) access_ticket::_request(s_address, r_address, data);
+}
 
-		if (ticket->callback != nullptr)	// execute the ticket's callback function if one was provided
-			ticket->callback(ticket, ticket->callback_parameters);
+bool TMC_Serial::enqueue(size_t bus, volatile access_ticket* ticket)
+{
+	ticket->priority = priority_of(bus, ticket->datagram.data_transfer.register_address, ticket->datagram.data_transfer.rw_access);
+#ifdef TMC_SERIAL_STATS
+	ticket->queued_at = micros();
+#endif
+	if (!messageQueues[bus][ticket->priority].push(ticket))
+		return false;
+
+	// Schedule it if nobody owns the USART. If someone does, they'll pick the ticket up when
+	//    they're done with theirs.
+	if (claim_bus(bus))
+		schedule_next(bus);
+
+	return true;
+}
+
+int8_t TMC_Serial::subscribe(uint32_t s_address, uint32_t r_address, uint16_t period_ms)
+{
+	if (period_ms == 0)
+		period_ms = 1;
+
+	subscription* table = subscriptions[bus];
+	int8_t handle = -1;
+	for (uint8_t i = 0; i < TMC_SUBSCRIPTIONS && handle < 0; ++i)
+		if (!table[i].active && !table[i].in_flight.load())
+			handle = i;
+	if (handle < 0)
+		return -1;
+
+	// Two subscriptions with phases a and b ever start in the same millisecond if a - b is a multiple
+	//    of the gcd of their periods. Take the first phase that collides with the fewest others.
+	uint32_t now = millis();
+	uint16_t best_phase = 0;
+	uint8_t best_collisions = 0xFF;
+	for (uint16_t phase = 0; phase < period_ms && phase < 64 && best_collisions > 0; ++phase)
+	{
+		uint8_t collisions = 0;
+		for (uint8_t i = 0; i < TMC_SUBSCRIPTIONS; ++i)
+		{
+			const subscription& other = table[i];
+			if (!other.active)
+				continue;
+			int32_t a = period_ms, b = other.period_ms;
+			while (b != 0) { int32_t t = a % b; a = b; b = t; }
+			collisions += (int32_t)(now + phase - other.due_ms) % a == 0;
+		}
+		if (collisions < best_collisions)
+		{
+			best_collisions = collisions;
+			best_phase = phase;
+		}
+	}
+
+	subscription& sub = table[handle];
+	::new (sub.ticket) read_ticket(s_address, r_address, subscription_callback, &sub);
+	sub.s_address = s_address;
+	sub.r_address = r_address;
+	sub.period_ms = period_ms;
+	sub.due_ms = now + best_phase;
+	sub.sequence.store(0);
+	sub.active = true;
+	return handle;
+}
+
+void TMC_Serial::unsubscribe(int8_t handle)
+{
+	if (handle >= 0 && handle < (int8_t)TMC_SUBSCRIPTIONS)
+		subscriptions[bus][handle].active = false;
+}
+
+bool TMC_Serial::read_snapshot(int8_t handle, snapshot& latest) const
+{
+	if (handle < 0 || handle >= (int8_t)TMC_SUBSCRIPTIONS)
+		return false;
+
+	const subscription& sub = subscriptions[bus][handle];
+	uint32_t sequence;
+	do {
+		sequence = sub.sequence.load();
+		if (sequence == 0)
+			return false;
+		latest = sub.buffers[sequence & 1];
+	} while (sub.sequence.load() != sequence);
+	return true;
+}
+
+void TMC_Serial::poll_subscriptions()
+{
+	uint32_t now = millis();
+	for (size_t bus = 0; bus < 4; ++bus)
+		for (uint8_t i = 0; i < TMC_SUBSCRIPTIONS; ++i)
+		{
+			subscription& sub = subscriptions[bus][i];
+			if (!sub.active || (int32_t)(now - sub.due_ms) < 0 || sub.in_flight.load())
+				continue;
+
+			// Keep the phase, but don't try to catch up on periods the bus was too busy for
+			sub.due_ms += sub.period_ms;
+			if ((int32_t)(now - sub.due_ms) >= 0)
+				sub.due_ms += ((now - sub.due_ms) / sub.period_ms + 1) * sub.period_ms;
+
+			// The ticket lives in the subscription and still holds its request, it goes out again as it is
+			volatile access_ticket* ticket = (volatile access_ticket*)sub.ticket;
+			ticket->reset();
+			sub.in_flight.store(true);
+			if (!enqueue(bus, ticket))
+				sub.in_flight.store(false);
+		}
+}
+
+void TMC_Serial::subscription_callback(volatile access_ticket* ticket, void* subscription_pointer)
+{
+	subscription& sub = *(subscription*)subscription_pointer;
+	uint32_t sequence = sub.sequence.load();
+	const snapshot& current = sub.buffers[sequence & 1];
+	snapshot& next = sub.buffers[(sequence + 1) & 1];
+
+	next.status = ticket->status;
+	next.value = ticket->status == access_ticket::state::completed_successfully ? ticket->get_data() : current.value;
+	next.timestamp = micros();
+	next.sequence = sequence + 1;
+	sub.sequence.store(sequence + 1);
+	sub.in_flight.store(false);
+}
+
+bool TMC_Serial::set_ramp(uint32_t s_address, uint32_t acceleration, uint32_t jerk, uint16_t period_ms)
+{
+	if (s_address >= 4)
+		return false;
+
+	// A rejected call leaves the ramp running as it was, a successful one keeps the ticks from
+	//    sending an update while the ramp is set up
+	ramp& r = ramps[bus][s_address];
+	noInterrupts();
+	bool busy = r.in_flight.load();
+	if (!busy)
+		r.configured = false;
+	interrupts();
+	if (busy)
+		return false;
+
+	uint32_t vactual = 0;
+	shadow_value(s_address, VACTUAL, vactual);
+
+	// a of the braking distance has to fit 64 bits
+	r.max_acceleration = acceleration > 4000000 ? 4000000 : acceleration;
+	r.jerk = jerk;
+	r.period_ms = period_ms == 0 ? 1 : period_ms;
+	r.interval_ms = r.period_ms;
+	r.target = (int32_t)vactual;
+	r.velocity = (int64_t)(int32_t)vactual * 1000000;
+	r.acceleration = 0;
+	r.applied = (int32_t)vactual;
+	r.average_us = 0;
+	r.updates = 0;
+	r.skipped = 0;
+	r.running = false;
+	r.configured = true;
+	return true;
+}
+
+bool TMC_Serial::ramp_to(uint32_t s_address, int32_t velocity)
+{
+	if (s_address >= 4 || !ramps[bus][s_address].configured)
+		return false;
+
+	// VACTUAL is 24 bits, signed
+	if (velocity > 0x7FFFFF)
+		velocity = 0x7FFFFF;
+	else if (velocity < -0x7FFFFF)
+		velocity = -0x7FFFFF;
+
+	ramp& r = ramps[bus][s_address];
+	noInterrupts();
+	if (!r.running)
+	{
+		// Picks up from where the ramp stood, the update is sent with the next tick. The pause doesn't count
+		//    toward the update rate.
+		r.stepped_us = micros();
+		r.completed_us = r.stepped_us;
+		r.due_ms = millis();
+	}
+	r.target = velocity;
+	r.running = true;
+	interrupts();
+	return true;
+}
+
+bool TMC_Serial::read_ramp(uint32_t s_address, ramp_state& state) const
+{
+	if (s_address >= 4 || !ramps[bus][s_address].configured)
+		return false;
+
+	const ramp& r = ramps[bus][s_address];
+	noInterrupts();
+	state.target = r.target;
+	state.velocity = (int32_t)(r.velocity / 1000000);
+	state.applied = r.applied;
+	state.update_rate = r.average_us == 0 ? 0 : 1000000 / r.average_us;
+	state.interval_ms = r.interval_ms;
+	state.updates = r.updates;
+	state.skipped = r.skipped;
+	state.running = r.running;
+	interrupts();
+	state.tracking_error = state.velocity - state.applied;
+	return true;
+}
+
+void TMC_Serial::end_ramp(uint32_t s_address)
+{
+	if (s_address < 4)
+		ramps[bus][s_address].configured = false;
+}
+
+void TMC_Serial::step_ramp(ramp& r, uint32_t elapsed_us)
+{
+	const int64_t scale = 1000000;
+	if (elapsed_us > 100000)
+		elapsed_us = 100000;	// Don't jump after a long pause
+
+	int64_t target = (int64_t)r.target * scale;
+	int64_t remaining = target - r.velocity;
+	if (remaining == 0 && r.acceleration == 0)
+		return;
+
+	int64_t limit = (int64_t)r.max_acceleration * scale;
+	int8_t direction = remaining > 0 ? 1 : remaining < 0 ? -1 : 0;
+	if (r.jerk == 0)
+		r.acceleration = direction * limit;
+	else
+	{
+		// Taking the acceleration back to 0 at full jerk still adds a / 2j to the velocity, start in time
+		uint64_t a = (uint64_t)(r.acceleration < 0 ? -r.acceleration : r.acceleration) / 1000;
+		int64_t settling = (int64_t)(a * a / (2 * (uint64_t)r.jerk));
+		int64_t step = (int64_t)r.jerk * elapsed_us;
+		bool easing = r.acceleration != 0 &&
+			(direction == 0 || ((direction > 0) == (r.acceleration > 0) && direction * remaining <= settling));
+		if (easing)
+			r.acceleration = r.acceleration > 0 ? (r.acceleration > step ? r.acceleration - step : 0) :
+				(-r.acceleration > step ? r.acceleration + step : 0);
+		else
+		{
+			r.acceleration += direction * step;
+			if (r.acceleration > limit)
+				r.acceleration = limit;
+			else if (r.acceleration < -limit)
+				r.acceleration = -limit;
+		}
+	}
+
+	r.velocity += r.acceleration * (int64_t)elapsed_us / scale;
+
+	// Arrived, or the last step went past it
+	int64_t left = target - r.velocity;
+	if ((remaining > 0 && left <= 0) || (remaining < 0 && left >= 0))
+	{
+		r.velocity = target;
+		r.acceleration = 0;
+	}
+}
+
+void TMC_Serial::poll_ramps()
+{
+	uint32_t now = millis();
+	uint32_t now_us = micros();
+	for (size_t bus = 0; bus < 4; ++bus)
+		for (uint8_t s_address = 0; s_address < 4; ++s_address)
+		{
+			ramp& r = ramps[bus][s_address];
+			if (!r.configured || !r.running || (int32_t)(now - r.due_ms) < 0)
+				continue;
+
+			step_ramp(r, now_us - r.stepped_us);
+			r.stepped_us = now_us;
+			int32_t velocity = (int32_t)(r.velocity / 1000000);
+
+			if (r.in_flight.load() || queue_depth(bus) > TMC_BURST_LENGTH)
+			{
+				// The bus doesn't keep up, send less often
+				++r.skipped;
+				if (r.interval_ms < 16 * r.period_ms)
+					r.interval_ms *= 2;
+			}
+			else if (velocity != r.applied)
+			{
+				volatile access_ticket* ticket = (volatile access_ticket*)::new (r.ticket) write_ticket(s_address, VACTUAL, (uint32_t)velocity, ramp_callback, &r);
+				track_writes(bus, 1 << s_address, VACTUAL, (uint32_t)velocity);
+				r.in_flight.store(true);
+				if (!enqueue(bus, ticket))
+				{
+					untrack_writes(bus, 1 << s_address, VACTUAL);
+					r.in_flight.store(false);
+					++r.skipped;
+				}
+				else if (r.interval_ms > r.period_ms)
+					r.interval_ms = r.interval_ms / 2 < r.period_ms ? r.period_ms : r.interval_ms / 2;
+			}
+			else if (velocity == r.target)
+				r.running = false;		// The driver holds the target
+
+			r.due_ms = now + r.interval_ms;
+		}
+}
+
+void TMC_Serial::ramp_callback(volatile access_ticket* ticket, void* ramp_pointer)
+{
+	ramp& r = *(ramp*)ramp_pointer;
+	if (ticket->status == access_ticket::state::completed_successfully)
+	{
+		uint32_t now = micros();
+		int32_t interval = now - r.completed_us;
+		r.average_us = r.average_us == 0 ? interval : r.average_us + (interval - (int32_t)r.average_us) / 8;
+		r.completed_us = now;
+		r.applied = (int32_t)ticket->get_data();
+		++r.updates;
+	}
+	r.in_flight.store(false);
+}
+
+bool TMC_Serial::stage_setpoint(group_commit& group, uint32_t s_address, uint32_t data)
+{
+	if (s_address >= 4)
+		return false;
+
+	group.staged[bus][s_address] = data;
+	group.staged_masks[bus] |= 1 << s_address;
+	return true;
+}
+
+bool TMC_Serial::commit_group(group_commit& group, uint32_t r_address, void(*Callback)(group_commit& group, void* additional_parameters), void* Callback_parameters)
+{
+	// It waits for the USARTs, from a handler they might never get to finish their transfers
+	if (group.status == group_commit::state::running || __get_IPSR() != 0)
+		return false;
+
+	// One fan-out write per USART, each slave with its own value
+	uint8_t buses = 0;
+	volatile access_ticket* tickets[4] = { nullptr, nullptr, nullptr, nullptr };
+	for (size_t bus = 0; bus < 4; ++bus)
+	{
+		uint8_t mask = group.staged_masks[bus] & 0x0F;
+		if (mask == 0)
+			continue;
+
+		uint8_t first = __builtin_ctz(mask);
+		memcpy(group.values[bus], group.staged[bus], sizeof(group.values[bus]));
+		tickets[bus] = new volatile write_ticket(first, r_address, group.values[bus][first], group_written, &group);
+		if (tickets[bus] == nullptr)
+		{
+			for (size_t b = 0; b < bus; ++b)
+				if (tickets[b] != nullptr)
+					delete tickets[b];
+			return false;
+		}
+		tickets[bus]->fanout = mask;
+		tickets[bus]->fanout_data = group.values[bus];
+		tickets[bus]->priority = priority_of(bus, r_address, true);
+		++buses;
+	}
+	if (buses == 0)
+		return false;
+
+	for (size_t bus = 0; bus < 4; ++bus)
+	{
+		group.masks[bus] = tickets[bus] != nullptr ? group.staged_masks[bus] & 0x0F : 0;
+		group.staged_masks[bus] = 0;
+		group.failed_slaves[bus] = 0;
+		group.tickets[bus] = tickets[bus];
+	}
+	group.callback = Callback;
+	group.callback_parameters = Callback_parameters;
+	group.skew = 0;
+	group.outstanding.store(buses);
+	group.status = group_commit::state::running;
+
+	// Take every USART of the group: an idle one right away, a busy one once its owner parks it after the
+	//    current transfer. Queued tickets wait behind the commit.
+	uint32_t gap_us = 0;
+	for (size_t bus = 0; bus < 4; ++bus)
+		if (tickets[bus] != nullptr)
+			holds[bus] = true;
+	for (size_t bus = 0; bus < 4; ++bus)
+	{
+		if (tickets[bus] == nullptr)
+			continue;
+		while (!claim_bus(bus) && !parked[bus])
+			__WFI();
+
+		uint32_t gap = frameGaps[bus] == follow_send_delay ? send_delay(bus) : frameGaps[bus];
+		uint32_t us = gap * bit_cycles(bus) / (SystemCoreClock / 1000000) + 1;
+		if (us > gap_us)
+			gap_us = us;
+	}
+
+	// The transfer a USART was parked after may have just ended, let the longest frame gap pass
+	delayMicroseconds(gap_us);
+
+	uint32_t started[4];
+	noInterrupts();
+	for (size_t bus = 0; bus < 4; ++bus)
+	{
+		volatile access_ticket* ticket = tickets[bus];
+		if (ticket == nullptr)
+			continue;
+		for (uint8_t s = 0; s < 4; ++s)
+			if (ticket->fanout & (1 << s))
+				track_writes(bus, 1 << s, r_address, group.values[bus][s]);
+#ifdef TMC_SERIAL_STATS
+		ticket->queued_at = micros();
+#endif
+		holds[bus] = false;
+		parked[bus] = false;
+		begin_transfers(bus, ticket);
+		started[bus] = DWT->CYCCNT;
+	}
+	interrupts();
+
+	// A value lands once its datagram is through, the datagrams of a USART follow each other
+	uint32_t first_start = 0, last_start = 0, earliest = 0xFFFFFFFF, latest = 0;
+	bool any = false;
+	for (size_t bus = 0; bus < 4; ++bus)
+		if (tickets[bus] != nullptr && (!any || (int32_t)(started[bus] - first_start) < 0))
+		{
+			first_start = started[bus];
+			any = true;
+		}
+	for (size_t bus = 0; bus < 4; ++bus)
+	{
+		if (tickets[bus] == nullptr)
+			continue;
+		uint32_t datagram_cycles = 10 * data_transfer_datagram::datagram_length * bit_cycles(bus);
+		uint32_t offset = started[bus] - first_start;
+		if (offset > last_start)
+			last_start = offset;
+		if (offset + datagram_cycles < earliest)
+			earliest = offset + datagram_cycles;
+		if (offset + __builtin_popcount(group.masks[bus]) * datagram_cycles > latest)
+			latest = offset + __builtin_popcount(group.masks[bus]) * datagram_cycles;
+	}
+	group.start_spread = last_start;
+	group.skew_bound = latest - earliest;
+	return true;
+}
+
+uint32_t TMC_Serial::landing_clock()
+{
+#ifdef SAM3X_SIM
+	return (uint32_t)SAM3X_Sim::instance().now();	// The simulator's DWT counts host time, the wire runs on the simulated clock
+#else
+	return DWT->CYCCNT;
+#endif
+}
+
+void TMC_Serial::group_written(volatile access_ticket* ticket, void* group_pointer)
+{
+	group_commit& group = *(group_commit*)group_pointer;
+	for (size_t bus = 0; bus < 4; ++bus)
+		if (group.tickets[bus] == ticket)
+			group.failed_slaves[bus] = ticket->status == access_ticket::state::completed_successfully ? 0 :
+				ticket->fanout_failed ? ticket->fanout_failed : group.masks[bus];
+	delete ticket;
+
+	if (group.outstanding.fetch_sub(1) != 1)
+		return;
+
+	// The last value of a USART landed when USART_Handler took its echo, the first ones a datagram time apart before it
+	bool failed = false, any = false;
+	uint32_t first = 0, last = 0;
+	for (size_t bus = 0; bus < 4; ++bus)
+	{
+		failed |= group.failed_slaves[bus] != 0;
+		if (group.masks[bus] == 0)
+			continue;
+		uint32_t ahead = (__builtin_popcount(group.masks[bus]) - 1) * 10 * data_transfer_datagram::datagram_length * bit_cycles(bus);
+		uint32_t earliest = group.landed[bus] - ahead;
+		if (!any || (int32_t)(earliest - first) < 0)
+			first = earliest;
+		if (!any || (int32_t)(group.landed[bus] - last) > 0)
+			last = group.landed[bus];
+		any = true;
+	}
+	group.skew = last - first;
+	group.status = failed ? group_commit::state::failed : group_commit::state::committed;
+	if (group.callback != nullptr)
+		group.callback(group, group.callback_parameters);
+}
+
+volatile TMC_Serial::write_ticket* TMC_Serial::write_at(uint32_t s_address, uint32_t r_address, uint32_t data, uint32_t at_us, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters)
+{
+	volatile write_ticket* ticket = new volatile write_ticket(s_address, r_address, data, Callback, Callback_parameters);
+	if (ticket == nullptr)
+		return nullptr;
+
+	// Counted before the ticket is queued, it may complete before enqueue_at() returns
+	uint8_t slaves = s_address < 4 ? 1 << s_address : 0;
+	track_writes(bus, slaves, r_address, data, false);
+	if (!enqueue_at(bus, ticket, at_us))
+	{
+		untrack_writes(bus, slaves, r_address);
+		delete ticket;
+		return nullptr;
+	}
+
+	return ticket;
+}
+
+volatile TMC_Serial::read_ticket* TMC_Serial::read_at(uint32_t s_address, uint32_t r_address, uint32_t at_us, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters)
+{
+	volatile read_ticket* ticket = new volatile read_ticket(s_address, r_address, Callback, Callback_parameters);
+	if (ticket == nullptr)
+		return nullptr;
+
+	if (!enqueue_at(bus, ticket, at_us))
+	{
+		delete ticket;
+		return nullptr;
+	}
+
+	return ticket;
+}
+
+bool TMC_Serial::enqueue_at(size_t bus, volatile access_ticket* ticket, uint32_t at_us)
+{
+	ticket->priority = priority_of(bus, ticket->datagram.data_transfer.register_address, ticket->datagram.data_transfer.rw_access);
+	ticket->deadline = at_us;
+
+	// The owner sorts it in, like the queues the push is lock-free
+	if (!timedInbox[bus].push(ticket))
+		return false;
+
+	if (claim_bus(bus))
+		schedule_next(bus);
+	return true;
+}
+
+void TMC_Serial::collect_timed(size_t bus)
+{
+	uint8_t count = timedCounts[bus];
+	volatile access_ticket* ticket;
+	while (count < TMC_TIMED_TICKETS && timedInbox[bus].pop(ticket))
+	{
+		uint8_t i = count++;
+		for (; i > 0 && (int32_t)(ticket->deadline - timedTickets[bus][i - 1]->deadline) < 0; --i)
+			timedTickets[bus][i] = timedTickets[bus][i - 1];
+		timedTickets[bus][i] = ticket;
+	}
+
+	if (count > 0)
+		nextDeadlines[bus] = timedTickets[bus][0]->deadline;
+	timedCounts[bus] = count;
+}
+
+bool TMC_Serial::timed_waiting(size_t bus)
+{
+	return timedCounts[bus] < TMC_TIMED_TICKETS && !timedInbox[bus].empty();
+}
+
+void TMC_Serial::poll_deadlines()
+{
+	for (size_t bus = 0; bus < 4; ++bus)
+		if ((timedCounts[bus] > 0 || timed_waiting(bus)) && claim_bus(bus))
+			schedule_next(bus);
+}
+
+bool TMC_Serial::deadline_near(size_t bus, uint32_t& wait)
+{
+	if (timedCounts[bus] == 0)
+		return false;
+	uint32_t at_us = nextDeadlines[bus];
+
+	// Close enough that the next SysTick could come too late
+	wait = bits_until(bus, at_us);
+	uint32_t near = 2000 * (SystemCoreClock / 1000000) / bit_cycles(bus);
+	return wait <= (near > 0xFFFF ? 0xFFFF : near);
+}
+
+void TMC_Serial::begin_timed(size_t bus)
+{
+	volatile access_ticket* ticket = timedTickets[bus][0];
+	uint8_t count = timedCounts[bus] - 1;
+	for (uint8_t i = 0; i < count; ++i)
+		timedTickets[bus][i] = timedTickets[bus][i + 1];
+	if (count > 0)
+		nextDeadlines[bus] = timedTickets[bus][0]->deadline;
+	timedCounts[bus] = count;
+
+	ticket->sent_at = micros();
+#ifdef TMC_SERIAL_STATS
+	// It waited on purpose, that's no queue latency
+	ticket->queued_at = ticket->sent_at;
+	uint32_t late = (int32_t)(ticket->sent_at - ticket->deadline) > 0 ? ticket->sent_at - ticket->deadline : 0;
+	bus_statistics& stats = busStatistics[bus];
+	++stats.deadlines.tickets;
+	stats.deadlines.late_us += late;
+	if (late > stats.deadlines.max_late_us)
+		stats.deadlines.max_late_us = late;
+#endif
+	begin_transfers(bus, ticket);
+}
+
+uint32_t TMC_Serial::bits_until(size_t bus, uint32_t at_us)
+{
+	int32_t us = (int32_t)(at_us - micros());
+	if (us <= 0)
+		return 0;
+	uint32_t cycles = bit_cycles(bus);
+	return (uint32_t)(((uint64_t)us * (SystemCoreClock / 1000000) + cycles - 1) / cycles);
+}
+
+uint32_t TMC_Serial::bit_cycles(size_t bus)
+{
+	// Baudrate = MCK / (16 * (CD + FP / 8))
+	uint32_t brgr = bus_usart(bus)->US_BRGR;
+	return 16 * (brgr & US_BRGR_CD_Msk) + 2 * ((brgr & US_BRGR_FP_Msk) >> US_BRGR_FP_Pos);
+}
+
+bool TMC_Serial::stage_profile(bring_up& profile, const profile_row* rows, uint8_t count)
+{
+	if (profile.status == bring_up::state::running)
+		return false;
+
+	bring_up::table& table = profile.tables[bus];
+	table.owner = &profile;
+	table.driver = this;
+	table.rows = rows;
+	table.count = count;
+	table.slaves = 0;
+	for (uint8_t s = 0; s < 4; ++s)
+		table.expected[s] = 0;
+	for (uint8_t i = 0; i < count; ++i)
+	{
+		uint8_t mask = rows[i].slave_mask & 0x0F;
+		table.slaves |= mask;
+		for (uint8_t s = 0; s < 4; ++s)
+			table.expected[s] += (mask >> s) & 1;
+	}
+	return true;
+}
+
+bool TMC_Serial::start_bring_up(bring_up& profile, void(*Callback)(bring_up&, void*), void* Callback_parameters)
+{
+	if (profile.status == bring_up::state::running)
+		return false;
+
+	uint8_t buses = 0;
+	for (size_t bus = 0; bus < 4; ++bus)
+	{
+		profile.failed_slaves[bus] = 0;
+		for (uint8_t s = 0; s < 4; ++s)
+		{
+			profile.landed[bus][s] = 0;
+			profile.gstat[bus][s] = 0;
+		}
+		buses += profile.tables[bus].slaves != 0;
+	}
+	if (buses == 0)
+		return false;
+
+	profile.callback = Callback;
+	profile.callback_parameters = Callback_parameters;
+	profile.elapsed_us = 0;
+	profile.running_buses.store(buses);
+	profile.status = bring_up::state::running;
+	profile.started_at = micros();
+
+	// Every USART starts on its own, 'outstanding' holds one count until all reads are queued
+	for (size_t bus = 0; bus < 4; ++bus)
+	{
+		bring_up::table& table = profile.tables[bus];
+		if (table.slaves == 0)
+			continue;
+
+		table.failed = 0;
+		table.outstanding.store(1);
+		for (uint8_t s = 0; s < 4; ++s)
+			if (table.slaves & (1 << s))
+			{
+				table.outstanding.fetch_add(1);
+				if (table.driver->read(s, IFCNT, profile_counted, &table) == nullptr)
+				{
+					table.outstanding.fetch_sub(1);
+					table.failed |= 1 << s;
+				}
+			}
+		profile_counted(nullptr, &table);
+	}
+	return true;
+}
+
+void TMC_Serial::profile_counted(volatile access_ticket* ticket, void* table_pointer)
+{
+	bring_up::table& table = *(bring_up::table*)table_pointer;
+	if (ticket != nullptr)
+	{
+		uint8_t s = ticket->datagram.data_transfer.device_address & 0x03;
+		if (ticket->status == access_ticket::state::completed_successfully)
+			table.ifcnt[s] = ticket->get_data() & 0xFF;
+		else
+			table.failed |= 1 << s;
+		delete ticket;
+	}
+
+	if (table.outstanding.fetch_sub(1) > 1)
+		return;
+
+	// One exact write per row and slave, each slave with its own value straight from the row. A slave whose
+	//    count couldn't be read is still configured, it just can't be verified. An idle USART is held while
+	//    the writes are queued, so they go out as bursts from the first one on instead of the first going alone.
+	size_t bus = table.driver->bus;
+	bool held = claim_bus(bus);
+	table.outstanding.store(1);
+	for (uint8_t i = 0; i < table.count; ++i)
+	{
+		const profile_row& row = table.rows[i];
+		for (uint8_t s = 0; s < 4; ++s)
+		{
+			if (!(row.slave_mask & (1 << s)))
+				continue;
+
+			table.outstanding.fetch_add(1);
+			if (table.driver->write_exact(s, row.r_address, row.data[s], profile_written, &table) == nullptr)
+			{
+				table.outstanding.fetch_sub(1);
+				table.failed |= 1 << s;
+			}
+		}
+	}
+	if (held)
+		schedule_next(bus);
+	profile_written(nullptr, &table);
+}
+
+void TMC_Serial::profile_written(volatile access_ticket* ticket, void* table_pointer)
+{
+	bring_up::table& table = *(bring_up::table*)table_pointer;
+	if (ticket != nullptr)
+		delete ticket;
+
+	if (table.outstanding.fetch_sub(1) > 1)
+		return;
+
+	// The writes have all completed, so the counters can be read right away
+	static const uint8_t read_backs[] = { IFCNT, GSTAT };
+	table.outstanding.store(1);
+	for (uint8_t s = 0; s < 4; ++s)
+		if (table.slaves & (1 << s))
+			for (uint8_t r = 0; r < 2; ++r)
+			{
+				table.outstanding.fetch_add(1);
+				if (table.driver->read(s, read_backs[r], profile_read_back, &table) == nullptr)
+				{
+					table.outstanding.fetch_sub(1);
+					table.failed |= 1 << s;
+				}
+			}
+	profile_read_back(nullptr, &table);
+}
+
+void TMC_Serial::profile_read_back(volatile access_ticket* ticket, void* table_pointer)
+{
+	bring_up::table& table = *(bring_up::table*)table_pointer;
+	bring_up& profile = *table.owner;
+	size_t bus = table.driver->bus;
+	if (ticket != nullptr)
+	{
+		uint8_t s = ticket->datagram.data_transfer.device_address & 0x03;
+		if (ticket->status != access_ticket::state::completed_successfully)
+			table.failed |= 1 << s;
+		else if (ticket->datagram.data_transfer.register_address == IFCNT)
+			profile.landed[bus][s] = (ticket->get_data() & 0xFF) - table.ifcnt[s];	// IFCNT wraps at 255
+		else
+			profile.gstat[bus][s] = ticket->get_data();
+		delete ticket;
+	}
+
+	if (table.outstanding.fetch_sub(1) > 1)
+		return;
+
+	for (uint8_t s = 0; s < 4; ++s)
+		if ((table.slaves & (1 << s)) && profile.landed[bus][s] != table.expected[s])
+			table.failed |= 1 << s;
+	profile.failed_slaves[bus] = table.failed;
+
+	if (profile.running_buses.fetch_sub(1) > 1)
+		return;
+
+	bool failed = false;
+	for (size_t b = 0; b < 4; ++b)
+		failed |= profile.failed_slaves[b] != 0;
+	profile.elapsed_us = micros() - profile.started_at;
+	profile.status = failed ? bring_up::state::failed : bring_up::state::verified;
+	if (profile.callback != nullptr)
+		profile.callback(profile, profile.callback_parameters);
+}
+
+uint32_t TMC_Serial::brgr_for(uint32_t baud)
+{
+	// Baudrate = MCK / (16 * (CD + FP / 8)), so the divider in eighths is MCK / (2 * baud), rounded.
+	//    CD 0 would stop the clock.
+	uint32_t eighths = (SystemCoreClock + baud) / (2 * baud);
+	if (eighths < 8)
+		eighths = 8;
+	if (eighths > (US_BRGR_CD_Msk << 3 | 7))
+		eighths = US_BRGR_CD_Msk << 3 | 7;
+	return US_BRGR_CD(eighths >> 3) | US_BRGR_FP(eighths & 7);
+}
+
+size_t TMC_Serial::queue_depth(size_t bus)
+{
+	size_t depth = retryCounts[bus];
+	for (uint8_t cls = 0; cls < priority_classes; ++cls)
+		depth += messageQueues[bus][cls].size();
+	return depth;
+}
+
+bool TMC_Serial::claim_bus(size_t bus)
+{
+	return !busyFlags[bus].exchange(true);
+}
+
+void TMC_Serial::release_bus(size_t bus)
+{
+	busyFlags[bus].store(false);
+
+	// A producer may have pushed after we last looked at the queue, but before we released the bus
+	uint32_t wait;
+	if ((!queues_empty(bus) || timed_waiting(bus) || deadline_near(bus, wait)) && claim_bus(bus))
+		schedule_next(bus);
+}
+
+uint8_t TMC_Serial::priority_of(size_t bus, uint32_t r_address, bool write)
+{
+	uint8_t cls = priorityOverrides[bus][r_address & 0x7F];
+	if (cls != 0)
+		return cls - 1;
+	if (!write)
+		return telemetry;
+	return r_address == VACTUAL ? realtime : configuration;
+}
+
+void TMC_Serial::set_priority(uint32_t r_address, uint8_t cls)
+{
+	priorityOverrides[bus][r_address & 0x7F] = cls < priority_classes ? cls + 1 : 0;
+}
+
+bool TMC_Serial::pop_next(size_t bus, volatile access_ticket*& ticket)
+{
+	ticket_queue* queues = messageQueues[bus];
+	uint8_t* passed_over = passedOver[bus];
+
+	if (retryCounts[bus] > 0)
+	{
+		ticket = retryTickets[bus][0];
+		for (uint8_t i = 1; i < retryCounts[bus]; ++i)
+			retryTickets[bus][i - 1] = retryTickets[bus][i];
+		--retryCounts[bus];
+		return true;
+	}
+
+	// A class that was passed over too often goes first, the lowest one first so the middle can't starve it either
+	for (uint8_t cls = priority_classes - 1; cls > 0; --cls)
+		if (passed_over[cls] >= TMC_STARVATION_LIMIT && queues[cls].pop(ticket))
+		{
+			passed_over[cls] = 0;
+			return true;
+		}
+
+	for (uint8_t cls = 0; cls < priority_classes; ++cls)
+		if (queues[cls].pop(ticket))
+		{
+			passed_over[cls] = 0;
+			for (uint8_t lower = cls + 1; lower < priority_classes; ++lower)
+				if (!queues[lower].empty() && passed_over[lower] < TMC_STARVATION_LIMIT)
+					++passed_over[lower];
+			return true;
+		}
+
+	return false;
+}
+
+bool TMC_Serial::pop_burst_write(size_t bus, uint8_t cls, uint8_t count, volatile access_ticket*& ticket)
+{
+	// The retries go first, a newer write to the same register must not overtake them
+	if (retryCounts[bus] > 0)
+	{
+		ticket = retryTickets[bus][0];
+		return ticket->datagram.data_transfer.rw_access && !ticket->fanout && !in_burst(bus, count, ticket) && pop_next(bus, ticket);
+	}
+
+	ticket_queue& queue = messageQueues[bus][cls];
+	if (waiting_above(bus, cls) || !queue.peek(ticket) || !ticket->datagram.data_transfer.rw_access || ticket->fanout ||
+		in_burst(bus, count, ticket))
+		return false;
+	return queue.pop(ticket);
+}
+
+bool TMC_Serial::in_burst(size_t bus, uint8_t count, volatile access_ticket* ticket)
+{
+	for (uint8_t i = 0; i < count; ++i)
+	{
+		volatile access_ticket* sent = activeTickets[bus][i];
+		if (sent->datagram.data_transfer.device_address == ticket->datagram.data_transfer.device_address &&
+			sent->datagram.data_transfer.register_address == ticket->datagram.data_transfer.register_address)
+			return true;
+	}
+	return false;
+}
+
+bool TMC_Serial::queues_empty(size_t bus)
+{
+	return retryCounts[bus] == 0 && !waiting_above(bus, priority_classes);
+}
+
+bool TMC_Serial::retry(size_t bus, volatile access_ticket* ticket)
+{
+	const retry_policy& policy = retryPolicies[bus][ticket->priority];
+	if (ticket->attempts >= policy.attempts)
+		return false;
+
+	if (policy.head_of_queue)
+	{
+		if (retryCounts[bus] >= TMC_BURST_LENGTH)
+			return false;
+		retryTickets[bus][retryCounts[bus]++] = ticket;
+	}
+	else if (!messageQueues[bus][ticket->priority].push(ticket))
+		return false;
+
+	ticket->status = access_ticket::state::pending;
+#ifdef TMC_SERIAL_STATS
+	++busStatistics[bus].retries;
+#endif
+	return true;
+}
+
+void TMC_Serial::set_retry_policy(uint8_t cls, uint8_t attempts, bool head_of_queue, uint16_t backoff_bits)
+{
+	if (cls >= priority_classes)
+		return;
+
+	retry_policy& policy = retryPolicies[bus][cls];
+	noInterrupts();
+	policy.attempts = attempts;
+	policy.head_of_queue = head_of_queue;
+	policy.backoff_bits = backoff_bits;
+	interrupts();
+}
+
+bool TMC_Serial::waiting_above(size_t bus, uint8_t cls)
+{
+	for (uint8_t higher = 0; higher < cls; ++higher)
+		if (!messageQueues[bus][higher].empty())
+			return true;
+	return false;
+}
+
+void TMC_Serial::schedule_next(size_t bus, bool gap_passed)
+{
+	// A group commit is waiting for the USART, it keeps the ownership and starts the next transfer itself
+	if (holds[bus])
+	{
+		parked[bus] = true;
+		return;
+	}
+
+	collect_timed(bus);
+	bool unpublished = timed_waiting(bus);	// A timed ticket that's pushed but not published yet, it's looked for again after a gap
+	if (queues_empty(bus) && timedCounts[bus] == 0 && !unpublished)
+	{
+		release_bus(bus);
+		return;
+	}
+
+	Usart* serial = bus_usart(bus);
+	uint32_t gap = gap_passed ? 0 : frameGaps[bus];
+	if (gap == follow_send_delay)
+		gap = send_delay(bus);
+
+	// Back off before a retry, twice as long for each attempt it already had
+	if (!gap_passed && retryCounts[bus] > 0)
+	{
+		volatile access_ticket* retried = retryTickets[bus][0];
+		uint32_t backoff = retried->attempts > 16 ? 0xFFFF : (uint32_t)retryPolicies[bus][retried->priority].backoff_bits << (retried->attempts - 1);
+		if (backoff > 0xFFFF)
+			backoff = 0xFFFF;	// The receiver timeout counts 16 bits
+		if (backoff > gap)
+			gap = backoff;
+	}
+
+	// A timed ticket goes out once its deadline and the gap have passed. A queued transfer goes ahead only
+	//    if it's over by then, otherwise the bus waits for the deadline. A deadline that isn't near is left
+	//    to poll_deadlines() if there's nothing else to send.
+	bool waits_for_deadline = false;
+	uint32_t wait = 0;
+	if (timedCounts[bus] > 0)
+	{
+		bool near = deadline_near(bus, wait);
+		if (wait < gap)
+			wait = gap;
+		uint32_t longest = max_burst * 80;	// A write burst, or a read: the request, the reply delay and the reply
+		uint32_t read = 40u + send_delay(bus) + 80;
+		if (read > longest)
+			longest = read;
+
+		if (wait == 0)
+		{
+			begin_timed(bus);
+			return;
+		}
+		if (queues_empty(bus) && !near && !unpublished)
+		{
+			release_bus(bus);
+			return;
+		}
+		if ((queues_empty(bus) && !unpublished) || wait <= gap + longest)
+		{
+			gap = wait > 0xFFFF ? 0xFFFF : wait;
+			waits_for_deadline = true;
+		}
+	}
+
+	volatile access_ticket* next;
+	if (!waits_for_deadline && gap == 0 && pop_next(bus, next))
+	{
+		begin_transfers(bus, next);
+		return;
+	}
+
+	// Let the receiver timeout count the gap, USART_Handler starts the transfer when it expires.
+	//    This also covers a push that isn't published yet, the next attempt is at least a bit time away.
+	turnarounds[bus] = true;
+	serial->US_RTOR = gap == 0 ? 1 : gap;
+	serial->US_CR = US_CR_RXEN | US_CR_RETTO;
+	serial->US_IER = US_IER_TIMEOUT;
+}
+
+uint8_t TMC_Serial::send_delay(size_t bus)
+{
+	uint8_t delay = 0;
+	for (size_t s = 0; s < 4; ++s)
+		if (sendDelays[bus][s] > delay)
+			delay = sendDelays[bus][s];
+	return delay;
+}
+
+Usart* TMC_Serial::bus_usart(size_t bus)
+{
+	switch (bus)
+	{
+	case 0:		return USART0;
+	case 1:		return USART1;
+	case 2:		return USART2;
+	default:	return USART3;
+	}
+}
+
+uint8_t TMC_Serial::bus_index(const Usart* serial)
+{
+	if (serial == USART0)		return 0;
+	else if (serial == USART1)	return 1;
+	else if (serial == USART2)	return 2;
+	else						return 3;
+}
+
+void TMC_Serial::set_frame_gap(uint8_t bits)
+{
+	frameGaps[bus] = bits;
+}
+
+void TMC_Serial::set_baud(uint32_t baud)
+{
+	// The divider may only change between transfers
+	while (!claim_bus(bus))
+		__WFI();
+	serial->US_BRGR = brgr_for(baud);
+	release_bus(bus);
+}
+
+uint32_t TMC_Serial::get_baud() const
+{
+	return SystemCoreClock / bit_cycles(bus);
+}
+
+bool TMC_Serial::negotiate_baud(baud_negotiation& result, uint32_t max_baud, uint8_t slave_mask, uint8_t reads)
+{
+	slave_mask &= 0x0F;
+	result.baud = get_baud();
+	result.steps = 0;
+	if (slave_mask == 0 || reads == 0)
+		return false;
+
+	// A retry would hide the error we're counting, whatever class the IFCNT reads are queued in
+	uint8_t cls = priority_of(bus, IFCNT, false);
+	retry_policy policy = retryPolicies[bus][cls];
+	retryPolicies[bus][cls].attempts = 1;
+
+	uint32_t baud = result.baud, reliable = 0;
+	while (result.steps < max_baud_steps)
+	{
+		set_baud(baud);
+		baud_step& step = result.tried[result.steps++];
+		step.baud = get_baud();
+		step.reads = 0;
+		step.crc_errors = 0;
+		step.timeouts = 0;
+
+		// 'reads' counts the completed reads, the burst is queued as fast as the pool allows
+		volatile uint8_t& completed = *(volatile uint8_t*)&step.reads;
+		uint8_t s = 0;
+		for (uint8_t queued = 0; queued < reads; )
+		{
+			while (!(slave_mask & (1 << s)))
+				s = (s + 1) & 0x03;
+			if (read(s, IFCNT, baud_probed, &step) == nullptr)
+			{
+				__WFI();	// Wait for a ticket to complete
+				continue;
+			}
+			s = (s + 1) & 0x03;
+			++queued;
+		}
+		while (completed < reads)
+			__WFI();
+
+		if (step.crc_errors != 0 || step.timeouts != 0)
+			break;
+		reliable = step.baud;
+
+		// Steps that round to the same divider as this one have been tried already
+		uint32_t next = baud + baud / 8 > max_baud ? max_baud : baud + baud / 8;
+		if (next <= baud || brgr_for(next) == brgr_for(baud))
+			break;
+		baud = next;
+	}
+
+	retryPolicies[bus][cls] = policy;
+	result.baud = reliable != 0 ? reliable : result.tried[0].baud;
+	set_baud(result.baud);
+	return reliable != 0;
+}
+
+void TMC_Serial::baud_probed(volatile access_ticket* ticket, void* step_pointer)
+{
+	baud_step& step = *(baud_step*)step_pointer;
+	if (ticket->status == access_ticket::state::timedout)
+		++step.timeouts;
+	else if (ticket->status != access_ticket::state::completed_successfully)
+		++step.crc_errors;
+	delete ticket;
+	volatile uint8_t& completed = *(volatile uint8_t*)&step.reads;
+	completed = completed + 1;
+}
+
+void TMC_Serial::set_completion_mode(uint8_t mode)
+{
+	// PendSV has to be the lowest priority, so the callbacks never delay another interrupt
+	if (mode == pendsv)
+		NVIC_SetPriority(PendSV_IRQn, (1 << __NVIC_PRIO_BITS) - 1);
+	completionModes[bus] = mode;
+}
+
+uint32_t TMC_Serial::dispatch()
+{
+	uint32_t count = 0;
+	volatile access_ticket* ticket;
+	while (completions.pop(ticket))
+	{
+		ticket->callback(ticket, ticket->callback_parameters);
+		++count;
+	}
+	return count;
+}
+
+#ifdef TMC_SERIAL_STATS
+TMC_Serial::bus_statistics TMC_Serial::statistics() const
+{
+	noInterrupts();
+	bus_statistics copy = busStatistics[bus];
+	interrupts();
+	return copy;
+}
+
+void TMC_Serial::reset_statistics()
+{
+	noInterrupts();
+	memset(&busStatistics[bus], 0, sizeof(bus_statistics));
+	interrupts();
+}
+
+void TMC_Serial::count_queue_latency(size_t bus, volatile access_ticket* ticket)
+{
+	uint32_t us = micros() - ticket->queued_at;
+	auto& latency = busStatistics[bus].queue_latency[ticket->priority];
+	++latency.tickets;
+	latency.us += us;
+	if (us > latency.max_us)
+		latency.max_us = us;
+}
+#endif
+
+void TMC_Serial::deleteTicketCallback(volatile access_ticket* ticket, void*)
+{
+	delete ticket;
+}
+
+void TMC_Serial::storeRegisterAt(volatile access_ticket* ticket, void* uint32_pointer)
+{
+	*(uint32_t*)uint32_pointer = ticket->get_data();
+
+	// The code above looks a bit complex because of the type punning
+	//    essentially all thats going on is were treating the void*
+	//    'uint32_pointer' as an actual uint32_t* so we can write to
+	//    it. Then we're treating the access_ticket* 'ticket' as a
+	//    read_ticket* so we can call the 'get_data()' method to easily
+	//    retrieve the data from the datagram.'
+}
+
+uint8_t TMC_Serial::echo_status(const uint8_t* sent, const uint8_t* echo, uint8_t length)
+{
+	if (memcmp(sent, echo, length) == 0)
+		return access_ticket::state::completed_successfully;
+
+	// Noise almost never leaves a valid CRC behind, a complete datagram does
+	return TMC_CRC::calc(echo, length) == echo[length - 1] ? access_ticket::state::collision : access_ticket::state::crc_error;
+}
+
+void TMC_Serial::begin_transfers(size_t bus, volatile  access_ticket* ticket)
+{
+	Usart* serial = bus_usart(bus);
+	activeTickets[bus][0] = ticket;
+	activeCounts[bus] = 1;
+	take_coalesced(ticket);
+	ticket->attempts = ticket->attempts + 1;
+
+#ifdef TMC_SERIAL_STATS
+	++busStatistics[bus].transfers;
+	count_queue_latency(bus, ticket);
+#endif
+
+	serial->US_TPR = (uintptr_t)&ticket->datagram;
+
+	if (ticket->datagram.data_transfer.rw_access)	// if this is a write ticket
+	{
+		// Writes get no reply, so the writes queued behind this one in its class can follow it back to
+		//    back, unless a higher class is waiting. The first datagram is sent straight from its ticket,
+		//    the rest are packed into the bus's burst buffer which the PDC picks up through the next
+		//    pointer registers.
+		uint8_t count = 1;		// Datagrams in the transfer
+		if (ticket->fanout)
+		{
+			// The ticket's datagram goes to the lowest slave of the mask, the copies for the others follow it
+			uint32_t first = ticket->datagram.data_transfer.device_address;
+			uint32_t r_address = ticket->datagram.data_transfer.register_address;
+			uint32_t data = ticket->get_data();
+			for (uint8_t s = first + 1; s < 4; ++s)
+				if (ticket->fanout & (1 << s))
+					new (txBursts[bus] + (count++ - 1) * 8) data_transfer_datagram(s, r_address, ticket->fanout_data ? ticket->fanout_data[s] : data);
+		}
+		else
+		{
+			// Writes that would still be on the wire at the next timed ticket's deadline wait for the transfer after it
+			uint8_t limit = TMC_BURST_LENGTH;
+			uint32_t wait;
+			if (timedCounts[bus] > 0 && deadline_near(bus, wait))
+			{
+				uint32_t gap = frameGaps[bus] == follow_send_delay ? send_delay(bus) : frameGaps[bus];
+				uint32_t room = wait > gap ? (wait - gap) / (10 * data_transfer_datagram::datagram_length) : 0;
+				if (room < limit)
+					limit = room;
+			}
+
+			volatile access_ticket* next;
+			while (count < limit && pop_burst_write(bus, ticket->priority, count, next))
+			{
+				take_coalesced(next);
+				next->attempts = next->attempts + 1;
+#ifdef TMC_SERIAL_STATS
+				count_queue_latency(bus, next);
+#endif
+				memcpy(txBursts[bus] + (count - 1) * 8, (const void*)&next->datagram, 8);
+				activeTickets[bus][count++] = next;
+			}
+			activeCounts[bus] = count;
+		}
+
+		serial->US_TNPR	= (uintptr_t)txBursts[bus];
+		serial->US_TNCR	= (count - 1) * ticket->datagram.data_transfer.datagram_length;
+		serial->US_TCR	= ticket->datagram.data_transfer.datagram_length;
+
+		serial->US_RPR	= (uintptr_t)rxBursts[bus];	// The echo of every datagram is validated in one go at the end
+		serial->US_RNCR	= 0;
+		serial->US_RCR	= count * ticket->datagram.data_transfer.datagram_length;
+	}
+	else	// if this is a read ticket
+	{
+		// The echo and the reply land right behind the request, in one piece
+		serial->US_RPR	= (uintptr_t)ticket->received;
+		serial->US_RNCR	= 0;
+		serial->US_RCR	= sizeof(ticket->received);
+		serial->US_TCR	= ticket->datagram.read_request.datagram_length;
+
+		serial->US_RTOR = send_delay(bus) + 16;	// Trigger a timeout if the reply doesn't start within the slave's SENDDELAY (+ 2 characters of slack)
+		serial->US_CR = US_CR_RETTO;	// Rearm Timeout, this tells the timeout counter to begin immediately
+	}
+
+	serial->US_CR = US_CR_TXEN | US_CR_RXEN;
+	serial->US_PTCR = US_PTCR_TXTEN | US_PTCR_RXTEN;
+	serial->US_IER = US_IER_RXBUFF | US_IER_TIMEOUT;
+}
+
+
+extern "C" {
+	int sysTickHook() {
+		TMC_Serial::poll_subscriptions();
+		TMC_Serial::poll_ramps();
+		TMC_Serial::poll_deadlines();
+		return 0;
+	}
+
+	// The Due core declares it void, unlike sysTickHook
+	void pendSVHook() {
+		TMC_Serial::dispatch();
+	}
+}
+
+
+void USART_Handler(Usart* serial, size_t bus, uint32_t status) {
+	// The frame gap before the next transfer has passed
+	if (TMC_Serial::turnarounds[bus])
+	{
+		if (status & US_CSR_TIMEOUT)
+		{
+			TMC_Serial::turnarounds[bus] = false;
+			serial->US_RTOR = 0;
+			serial->US_CR = US_CR_RXDIS | US_CR_RSTRX | US_CR_STTTO;
+			serial->US_IDR = US_IDR_TIMEOUT;
+
+			TMC_Serial::schedule_next(bus, true);
+		}
+		return;
+	}
+
+	if ( (status & US_CSR_RXBUFF) || (status & US_CSR_TIMEOUT) )
+	{
+#ifdef TMC_SERIAL_STATS
+		uint32_t isr_start = DWT->CYCCNT;
+#endif
+		uint32_t landed = TMC_Serial::landing_clock();	// When the last datagram of a write burst landed
+
+		// Take the tickets out of the bus state first, once the bus is released another context may start a new transfer
+		volatile TMC_Serial::access_ticket* tickets[TMC_BURST_LENGTH];
+		uint8_t count = TMC_Serial::activeCounts[bus];
+		for (uint8_t i = 0; i < count; ++i)
+			tickets[i] = TMC_Serial::activeTickets[bus][i];
+
+		serial->US_RTOR = 0; // Disable timeouts
+		serial->US_CR = US_CR_TXDIS | US_CR_RXDIS | US_CR_RSTTX | US_CR_RSTRX | US_CR_STTTO;
+		serial->US_PTCR = US_PTCR_TXTDIS | US_PTCR_RXTDIS;
+		serial->US_IDR = US_IDR_RXBUFF | US_IDR_TIMEOUT;
+		serial->US_TNCR = 0;
+
+		// Compare the echo of every datagram of a write burst with what was sent, bit 'i' of 'failed_echoes' is set
+		//    if datagram 'i' came back different, bit 'i' of 'collided_echoes' if it came back as someone else's datagram
+		uint32_t failed_echoes = 0, collided_echoes = 0;
+		bool write_burst = tickets[0]->datagram.data_transfer.rw_access;
+		uint8_t fanout = tickets[0]->fanout;
+		uint8_t datagrams = fanout ? __builtin_popcount(fanout) : count;
+		if (write_burst && !(status & US_CSR_TIMEOUT))
+			for (uint8_t d = 0; d < datagrams; ++d)
+			{
+				const uint8_t* sent = d == 0 ? (const uint8_t*)&tickets[0]->datagram : TMC_Serial::txBursts[bus] + (d - 1) * 8;
+				uint8_t echo = TMC_Serial::echo_status(sent, TMC_Serial::rxBursts[bus] + d * 8, TMC_Serial::data_transfer_datagram::datagram_length);
+				if (echo != TMC_Serial::access_ticket::state::completed_successfully)
+					failed_echoes |= 1ul << d;
+				if (echo == TMC_Serial::access_ticket::state::collision)
+					collided_echoes |= 1ul << d;
+			}
+
+		// A fan-out write is one ticket whose datagrams went to the slaves of its mask in ascending order,
+		//    its ticket fails if any of them did. A timeout fails them all.
+		if (fanout)
+		{
+			uint8_t failed = (status & US_CSR_TIMEOUT) ? fanout : 0, d = 0;
+			for (uint8_t s = 0; s < 4; ++s)
+				if (fanout & (1 << s))
+					if (failed_echoes & (1ul << d++))
+						failed |= 1 << s;
+			tickets[0]->fanout_failed = failed;
+			failed_echoes = failed != 0;
+			collided_echoes = collided_echoes != 0;
+		}
+
+		// A read has to get its own request back before the reply counts
+		uint8_t read_status = TMC_Serial::access_ticket::state::crc_error;
+		if (!write_burst && !(status & US_CSR_TIMEOUT))
+		{
+			const uint8_t* received = (const uint8_t*)tickets[0]->received;
+			read_status = TMC_Serial::echo_status((const uint8_t*)&tickets[0]->datagram, received, TMC_Serial::read_access_datagram::datagram_length);
+			const uint8_t* reply = received + TMC_Serial::read_access_datagram::datagram_length;
+			if (read_status == TMC_Serial::access_ticket::state::completed_successfully &&
+				TMC_CRC::calc(reply, TMC_Serial::data_transfer_datagram::datagram_length) != reply[TMC_Serial::data_transfer_datagram::datagram_length - 1])
+				read_status = TMC_Serial::access_ticket::state::crc_error;
+		}
+
+		uint8_t completed = 0;
+		for (uint8_t i = 0; i < count; ++i)
+		{
+			volatile TMC_Serial::access_ticket* ticket = tickets[i];
+
+			// If the ticket timed out, assign the status the timedout status
+			if (status & US_CSR_TIMEOUT)
+				ticket->status = TMC_Serial::access_ticket::state::timedout;
+
+			// A read's status follows its echo and reply
+			else if (!write_burst)
+				ticket->status = read_status;
+
+			// Everything completed successfully, assign the completed_successfully flag
+			else if (!(failed_echoes & (1ul << i)))
+				ticket->status = TMC_Serial::access_ticket::state::completed_successfully;
+
+			// If the echo was another valid datagram, another device was driving the line
+			else if (collided_echoes & (1ul << i))
+				ticket->status = TMC_Serial::access_ticket::state::collision;
+
+			// If the ticket's CRC does not match what it should, assign the crc_error status
+			else
+				ticket->status = TMC_Serial::access_ticket::state::crc_error;
+
+			// A failed ticket goes out again if its class allows, it completes once that's over
+			if (ticket->status != TMC_Serial::access_ticket::state::completed_successfully && TMC_Serial::retry(bus, ticket))
+				continue;
+
+			// A group commit measures its skew from when the transfers of its USARTs ended, its callback may run much later
+			if (ticket->callback == TMC_Serial::group_written)
+				((TMC_Serial::group_commit*)ticket->callback_parameters)->landed[bus] = landed;
+
+			TMC_Serial::update_shadow(bus, ticket);
+			tickets[completed++] = ticket;
+		}
+
+		// Start the gap before the next transfer if there's more to send, otherwise let the bus go.
+		//    The shadows are updated first, so a SLAVECONF write already counts for the gap.
+		TMC_Serial::schedule_next(bus);
+
+		bool deferred = false;
+		for (uint8_t i = 0; i < completed; ++i)
+		{
+			volatile TMC_Serial::access_ticket* ticket = tickets[i];
+			if (ticket->callback == nullptr)
+				continue;
+
+			// Leave the callback to dispatch() if asked to and the ring has room, deleting a ticket is quick enough for here
+			if (TMC_Serial::completionModes[bus] != TMC_Serial::immediate && ticket->callback != TMC_Serial::deleteTicketCallback &&
+				TMC_Serial::completions.push(ticket))
+				deferred = true;
+			else
+				ticket->callback(ticket, ticket->callback_parameters);	// execute the ticket's callback function if one was provided
+		}
+		if (deferred && TMC_Serial::completionModes[bus] == TMC_Serial::pendsv)
+			SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+
+#ifdef TMC_SERIAL_STATS
+		TMC_Serial::bus_statistics& stats = TMC_Serial::busStatistics[bus];
+		uint32_t isr_cycles = DWT->CYCCNT - isr_start;
+		stats.tickets += completed;
+		++stats.isr_count;
+		stats.isr_cycles += isr_cycles;
+		if (isr_cycles > stats.isr_max_cycles)
+			stats.isr_max_cycles = isr_cycles;
+#endif
 	}
 }
 
 
 void USART0_Handler() {
 	uint32_t status = USART0->US_CSR;
-	USART_Handler(USART0, status);
+	USART_Handler(USART0, 0, status);
 }
 
 
 void USART1_Handler() {
 	uint32_t status = USART1->US_CSR;
-	USART_Handler(USART1, status);
+	USART_Handler(USART1, 1, status);
 }
 
 
 void USART2_Handler() {
 	uint32_t status = USART2->US_CSR;
-	USART_Handler(USART2, status);
+	USART_Handler(USART2, 2, status);
 }
 
 
 void USART3_Handler() {
 	uint32_t status = USART3->US_CSR;
-	USART_Handler(USART3, status);
+	USART_Handler(USART3, 3, status);
 }
\ No newline at end of file
@@ -1,6 +1,46 @@
 #pragma once
 #include <Arduino.h>
 #include "Ring_Buffer.h"
+#include "TMC_CRC.h"
+#include "TMC_Registers.h"
+#include "Ticket_Pool.h"
+#include "MPSC_Queue.h"
+
+#ifndef TMC_TICKET_POOL_SIZE
+#define TMC_TICKET_POOL_SIZE 128u		// Number of tickets that can be in flight at once, shared by all USARTs
+#endif
+
+#ifndef TMC_QUEUE_DEPTH
+#define TMC_QUEUE_DEPTH 128u			// Number of tickets each USART can queue (power of two)
+#endif
+
+#ifndef TMC_COALESCE_REGISTERS
+#define TMC_COALESCE_REGISTERS 4u		// Number of registers per USART that can have write coalescing enabled
+#endif
+
+#ifndef TMC_BURST_LENGTH
+#define TMC_BURST_LENGTH 8u				// Maximum number of consecutive write tickets sent in one PDC transfer
+#endif
+static_assert(TMC_BURST_LENGTH >= 2 && TMC_BURST_LENGTH <= 32, "TMC_BURST_LENGTH must be between 2 and 32");
+
+#ifndef TMC_SUBSCRIPTIONS
+#define TMC_SUBSCRIPTIONS 8u			// Number of periodic register reads each USART can run (see 'subscribe()')
+#endif
+
+#ifndef TMC_COMPLETION_DEPTH
+#define TMC_COMPLETION_DEPTH 64u		// Number of completed tickets waiting for their deferred callbacks, shared by all USARTs (power of two)
+#endif
+
+#ifndef TMC_TIMED_TICKETS
+#define TMC_TIMED_TICKETS 8u			// Number of tickets with a transmit time each USART can hold (see 'write_at()', power of two)
+#endif
+
+#ifndef TMC_STARVATION_LIMIT
+#define TMC_STARVATION_LIMIT 16u		// Transfers of higher priority classes a waiting class lets go ahead before it's served anyway
+#endif
+
+// Define to count transfers and time USART_Handler per USART with the DWT cycle counter (see 'statistics()')
+//#define TMC_SERIAL_STATS
 
 class TMC_Serial
 {
@@ -35,7 +75,7 @@ public:
 
 
 
-	// used to calculate the CRC byte for datagrams
+	// used to calculate the CRC byte for datagrams (see TMC_CRC for the table driven engine)
 	//    datagram: pointer to the first byte of the datagram
 	//    datagram_size: length in bytes of the datagram
 	static uint8_t calc_CRC(uint8_t* datagram, uint8_t datagram_size);
@@ -43,13 +83,15 @@ public:
 
 
 	// This is the structure of a datagram that requests a read access from the drivers registers
+	//    The fields are for reading, the constructors write the bytes one by one like TMC_Datagram
+	//    so what goes on the wire doesn't depend on how the compiler allocates bitfields
 	struct read_access_datagram {
-		const uint8_t sync : 4;					// Sequence of bits (1010) which allows the TMC2209 to synchronize its baud rate.
-		const uint8_t reserved : 4;				// Reserved: The TMC2209 does nothing with these bits, but they are included in the CRC calculation
-		const uint8_t device_address : 8;		// The slave address of the driver we're communicating with (selected using the ms1, ms2 pins)
-		const uint8_t register_address : 7;		// The address of the register we're writing to/reading from
-		const uint8_t rw_access : 1;			// The read/write access bit to signal to the TMC2209 whether we want to write to or read from a register
-		const uint8_t CRC : 8;					// This is the CRC byte used to validate each datagram
+		uint8_t sync : 4;					// Sequence of bits (1010) which allows the TMC2209 to synchronize its baud rate.
+		uint8_t reserved : 4;				// Reserved: The TMC2209 does nothing with these bits, but they are included in the CRC calculation
+		uint8_t device_address : 8;		// The slave address of the driver we're communicating with (selected using the ms1, ms2 pins)
+		uint8_t register_address : 7;		// The address of the register we're writing to/reading from
+		uint8_t rw_access : 1;			// The read/write access bit to signal to the TMC2209 whether we want to write to or read from a register
+		uint8_t CRC : 8;					// This is the CRC byte used to validate each datagram
 
 		static const uint8_t datagram_length = 4;	// All read access datagrams are 4 bytes (datasheet 15)
 		read_access_datagram(uint8_t s_address, uint32_t r_address);
@@ -61,16 +103,16 @@ public:
 	//    When we write to the driver, we use this datagram, and when the driver responds to read access
 	//    requests, we store the data_transfer as this struct
 	struct data_transfer_datagram {
-		const uint8_t sync : 4;					// Sequence of bits (1010) which allows the TMC2209 to synchronize its baud rate.
-		const uint8_t reserved : 4;				// Reserved: The TMC2209 does nothing with these bits, but they are included in the CRC calculation
-		const uint8_t device_address : 8;		// The slave address of the driver we're communicating with (selected using the ms1, ms2 pins)
-		const uint8_t register_address : 7;		// The address of the register we're writing to/reading from
-		const uint8_t rw_access : 1;			// The read/write access bit to signal to the TMC2209 whether we want to write to or read from a register
-		const uint8_t data3 : 8;				// The TMC2209 reqiures the data bytes are sent in reverse order
-		const uint8_t data2 : 8;				//    Thus, we send the 4th byte first, then the 3rd, 2nd, and lastly
-		const uint8_t data1 : 8;				//    the first.
-		const uint8_t data0 : 8;				//
-		const uint8_t CRC : 8;					// This is the CRC byte used to validate each datagram
+		uint8_t sync : 4;					// Sequence of bits (1010) which allows the TMC2209 to synchronize its baud rate.
+		uint8_t reserved : 4;				// Reserved: The TMC2209 does nothing with these bits, but they are included in the CRC calculation
+		uint8_t device_address : 8;		// The slave address of the driver we're communicating with (selected using the ms1, ms2 pins)
+		uint8_t register_address : 7;		// The address of the register we're writing to/reading from
+		uint8_t rw_access : 1;			// The read/write access bit to signal to the TMC2209 whether we want to write to or read from a register
+		uint8_t data3 : 8;				// The TMC2209 reqiures the data bytes are sent in reverse order
+		uint8_t data2 : 8;				//    Thus, we send the 4th byte first, then the 3rd, 2nd, and lastly
+		uint8_t data1 : 8;				//    the first.
+		uint8_t data0 : 8;				//
+		uint8_t CRC : 8;					// This is the CRC byte used to validate each datagram
 
 		static const uint8_t datagram_length = 8;	// All read data_transfer datagrams are 8 bytes (datasheet 15)
 
@@ -79,34 +121,73 @@ public:
 	};
 
 
+	struct access_ticket;
+
+	// Holds the latest value written to a register that has write coalescing enabled (see 'set_coalescing()')
+	struct coalesce_slot {
+		std::atomic<uint32_t> value;				// The value the queued write will carry once it's transmitted
+		std::atomic<bool> pending;					// Set while a write for this register is queued but not yet transmitted
+		volatile access_ticket* volatile ticket;	// That queued write
+	};
+
+
 	// This is the base class for communication tickets, it can act as either a read_request, or a write_request
-	//    via the untion.
+	//    via the untion. What is sent and what comes back are kept apart, back to back, so the request
+	//    stays intact and the ticket can be sent again as it is.
 	struct access_ticket {
 		union _request {
 			read_access_datagram read_request;
 			data_transfer_datagram data_transfer;
 			_request(uint32_t s_address, uint32_t r_address);
 			_request(uint32_t s_address, uint32_t r_address, uint32_t data);
-		} datagram;	// The datagram information
+			_request(const TMC_Datagram& prebuilt);
+		} datagram;	// The request, as it goes out on the wire
+
+		// What a read receives: the echo of its request followed by the reply. The echo of a write burst
+		//    lands in the bus's burst buffer instead, next to the datagrams it's compared against.
+		uint8_t received[read_access_datagram::datagram_length + data_transfer_datagram::datagram_length];
+
+		// The reply of a read, valid once the read completed successfully
+		const volatile data_transfer_datagram& reply() const volatile { return *(const volatile data_transfer_datagram*)(received + read_access_datagram::datagram_length); }
 
 		enum state
 		{
 			pending = 0,	// Waiting to transmit
 			completed_successfully = 1,	// Communication finished without error
 			crc_error = 2,				// Reply was corrupted
-			timedout = 3				// Communication timedout on data_transfer
+			timedout = 3,				// Communication timedout on data_transfer
+			collision = 4				// The echo was a valid datagram other than ours, something else drove the line
 		};
 
 		uint8_t status;																	// current state of this ticket
+		uint8_t priority;																// the priority class the ticket was queued in
+		uint8_t fanout;																	// bit 's' is set for every slave a fan-out write goes to, 0 for any other ticket
+		uint8_t fanout_failed;															// bit 's' is set for every slave of a fan-out write whose echo was corrupted or timed out
+		const uint32_t* fanout_data;													// the value of each slave of a fan-out write by slave address, nullptr if they all get the datagram's
+		uint8_t attempts;																// number of times the ticket was transferred, more than 1 if it was retried
 		void(* const callback)(volatile access_ticket*, void* additional_parameters);	// callback to be called when the ticket has completed or failed
 		void* callback_parameters;
+		coalesce_slot* coalesce;														// if set, the data is taken from this slot when the ticket is transmitted
+		uint32_t deadline;																// micros() at which a ticket of write_at() or read_at() is to start transferring
+		uint32_t sent_at;																// micros() at which it did, 0 until then
+#ifdef TMC_SERIAL_STATS
+		uint32_t queued_at;																// micros() when the ticket was queued
+#endif
 
 		access_ticket(uint32_t s_address, uint32_t r_address, void(*Callback)(volatile access_ticket*, void*), void* Callback_parameters);
 		access_ticket(uint32_t s_address, uint32_t r_address, uint32_t data, void(*Callback)(volatile access_ticket*, void*), void* Callback_parameters);
+		access_ticket(const TMC_Datagram& prebuilt, void(*Callback)(volatile access_ticket*, void*), void* Callback_parameters);
 
 		bool transfer_complete() const volatile;
-		bool validate_crc() const volatile;
-		uint32_t get_data() volatile const;
+		void reset() volatile;		// Makes a completed ticket pending again, to send it once more
+		bool validate_crc() const volatile;		// Checks the reply of a read, the request of a write
+		uint32_t get_data() volatile const;		// Returns the data of the reply of a read, the request of a write
+
+		// Tickets are allocated from 'TMC_Serial::ticketPool' instead of the heap, so creating and
+		//    deleting them is safe from interrupts and never fragments the heap.
+		//    NOTE: 'new' returns nullptr when the pool is exhausted
+		static void* operator new(size_t size) noexcept;
+		static void operator delete(void* ticket);
 	};
 
 
@@ -118,9 +199,32 @@ public:
 	// Used to handle tickets that write to the drivers registers
 	struct write_ticket : public access_ticket {
 		write_ticket(uint32_t s_address, uint32_t r_address, uint32_t data, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters);
+		write_ticket(const TMC_Datagram& prebuilt, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters);
 	};
 
-	static void begin_transfers(Usart* serial, volatile access_ticket* ticket);
+	// The pool every ticket is allocated from
+	typedef Ticket_Pool<sizeof(access_ticket), TMC_TICKET_POOL_SIZE> ticket_pool;
+	static ticket_pool ticketPool;
+	static_assert(sizeof(read_ticket) <= sizeof(access_ticket) && sizeof(write_ticket) <= sizeof(access_ticket), "TMC_Serial: tickets must fit in a pool slot");
+
+	// What write() returns for a fire-and-forget write it dropped because the register already holds the value.
+	//    It points to a ticket that's completed successfully, never delete or queue it.
+	static volatile write_ticket* const redundant_write;
+
+	// The queue type tickets wait in until their USART is free
+	typedef MPSC_Queue<volatile access_ticket*, TMC_QUEUE_DEPTH> ticket_queue;
+
+	// Starts transferring 'ticket'. If it's a write, the write tickets queued right behind it are
+	//    packed into the same PDC transfer (up to TMC_BURST_LENGTH datagrams). A fan-out write goes
+	//    out on its own, with one datagram per slave of its mask.
+	static void begin_transfers(size_t bus, volatile access_ticket* ticket);
+
+	// Compares the echo of a datagram with what was sent
+	//    returns access_ticket::state::completed_successfully if they match, collision if the echo is another valid datagram, crc_error otherwise
+	static uint8_t echo_status(const uint8_t* sent, const uint8_t* echo, uint8_t length);
+
+	// Takes the latest value out of a coalescing ticket's slot and re-encodes its datagram, called right before transmission
+	static void take_coalesced(volatile access_ticket* ticket);
 
 	static void deleteTicketCallback(volatile access_ticket* ticket, void*);
 	static void storeRegisterAt(volatile access_ticket* ticket, void*);
@@ -131,6 +235,7 @@ public:
 	//    s_address: The slave address of the driver to read from
 	//    r_address: Address of the register to read from
 	//     Callback: A callback function that'll be called whenever the transfer has compeleted
+	//    NOTE: returns nullptr if the ticket pool is exhausted, consider checking the return value.
 	volatile read_ticket* read(uint32_t s_address, uint32_t r_address, void(*Callback)(volatile access_ticket*, void* additional_parameters) = nullptr, void* Callback_parameters = nullptr);
 
 
@@ -140,19 +245,770 @@ public:
 	//	data: The data to write to the register
 	//	Callback: A callback function that'll be called whenever the transfer has compeleted
 	//	Callback_parameters: A pointer to the parameters the callback function will utilize
+	//	NOTE: returns nullptr if the ticket pool is exhausted, the write is dropped in that case. A fire-and-forget
+	//	      write of the value the register is known to hold isn't sent, it returns 'redundant_write' instead.
 	volatile write_ticket* write(uint32_t s_address, uint32_t r_address, uint32_t data, void(*Callback)(volatile access_ticket*, void* additional_parameters) = deleteTicketCallback, void* Callback_parameters = nullptr);
 
+	// Sends a write datagram built at compile time (see TMC_Registers.h), the bytes are copied as they are
+	//	prebuilt: The datagram, ie. 'TMC_Datagram::write<TMC_GCONF>(0, TMC_GCONF::pdn_disable(1))'
+	//	Callback, Callback_parameters: Same as above
+	//	NOTE: Shadowing and coalescing apply as for any other write, a coalesced write is re-encoded.
+	volatile write_ticket* write(const TMC_Datagram& prebuilt, void(*Callback)(volatile access_ticket*, void* additional_parameters) = deleteTicketCallback, void* Callback_parameters = nullptr);
+
+	// Same as write(), but the datagram goes out exactly as asked: it's never folded into a queued write or
+	//    dropped as redundant, so it's counted by IFCNT and its callback sees its own value. It still joins bursts.
+	//	s_address, r_address, data, Callback, Callback_parameters: Same as write()
+	//	NOTE: returns nullptr if the ticket pool is exhausted
+	volatile write_ticket* write_exact(uint32_t s_address, uint32_t r_address, uint32_t data, void(*Callback)(volatile access_ticket*, void* additional_parameters) = deleteTicketCallback, void* Callback_parameters = nullptr);
+
+	// Writes the same value to a register of several drivers on this bus with a single ticket
+	//    The datagrams for all slaves go out back to back in one PDC transfer, so there's one allocation, one
+	//    frame gap and one interrupt instead of one per driver. The ticket's datagram is addressed to the lowest
+	//    slave of the mask, the others are built in the bus's burst buffer.
+	//	slave_mask: Bit 's' selects slave address 's' (0 - 3), ie. 0x0F for all four drivers
+	//	r_address, data: The register and the value every selected driver gets
+	//	Callback, Callback_parameters: Called once when all datagrams are sent. 'status' is completed_successfully
+	//	      only if every echo was intact, 'fanout_failed' tells which slaves' writes failed.
+	//	NOTE: Returns nullptr for an empty mask or if the ticket pool is exhausted. Fan-out writes are never
+	//	      coalesced or dropped as redundant, the shadows of the selected slaves are updated as for write().
+	volatile write_ticket* write_fanout(uint8_t slave_mask, uint32_t r_address, uint32_t data, void(*Callback)(volatile access_ticket*, void* additional_parameters) = deleteTicketCallback, void* Callback_parameters = nullptr);
+
+	// Queues a completed ticket again, exactly as it went out before: no encoding and no allocation
+	//    Meant for accesses that repeat, ie. from the ticket's own callback instead of deleting it.
+	//	ticket: A ticket of this instance that has completed
+	//	returns false if the ticket is still pending or the queue is full, the ticket keeps its status then
+	bool resubmit(volatile access_ticket* ticket);
+
+
+	// Enables or disables write coalescing for a register on slave addresses 0 - 3
+	//    While a fire-and-forget write to a coalesced register is queued and not yet transmitted, further
+	//    fire-and-forget writes to the same register of the same slave replace its data (the CRC is recomputed
+	//    at transmission) instead of queueing another ticket, so only the latest value goes out. Meant for
+	//    setpoints like VACTUAL, IHOLD_IRUN, TPWMTHRS.
+	//	r_address: The register to enable/disable coalescing for
+	//	enable: Whether to coalesce writes to the register
+	//	NOTE: Only writes with Callback == deleteTicketCallback are folded. A write with a callback always gets its
+	//	      own ticket and goes out with its own value. Returns false if TMC_COALESCE_REGISTERS are in use.
+	bool set_coalescing(uint32_t r_address, bool enable = true);
+
+
+	// Sets the pause between the end of one transfer and the start of the next on this instance's USART
+	//    The pause is counted by the USART's receiver timeout, so the next datagram goes out after exactly
+	//    'bits' bit times. By default it follows the largest SENDDELAY written to a slave on the bus
+	//    (8 bit times after power-on), which also sets how long a read waits for its reply.
+	//	bits: The pause in bit times, 0 starts the next transfer right away, 'follow_send_delay' to go back to the default
+	void set_frame_gap(uint8_t bits = follow_send_delay);
+	static const uint8_t follow_send_delay = 0xFF;
+
+
+	// ===== Baudrate ====================================================================================
+	//    The divider has a fractional part in eighths, Baudrate = MCK / (16 * (CD + FP / 8)), so 460800
+	//    baud on 84 MHz is off by 0.2 % instead of 3.6 % with CD alone.
+
+	// Sets the baudrate of this instance's USART, as close as the divider gets
+	//	baud: The baudrate, at most MCK / 16
+	//	NOTE: Waits with __WFI() for the transfer in progress to end, call it from the main loop. The TMC2209
+	//	      measures the rate from every datagram, so it follows without being told.
+	void set_baud(uint32_t baud);
+
+	// Returns the baudrate this instance's USART runs at, as set in the divider
+	uint32_t get_baud() const;
+
+	// One rate tried by negotiate_baud()
+	struct baud_step {
+		uint32_t baud;
+		uint8_t reads;			// IFCNT reads sent
+		uint8_t crc_errors;		// Reads whose echo or reply was corrupted
+		uint8_t timeouts;		// Reads that got no reply
+	};
+
+	// The outcome of negotiate_baud()
+	static const uint8_t max_baud_steps = 16;
+	struct baud_negotiation {
+		uint32_t baud;			// The rate the USART was left at
+		uint8_t steps;			// Entries of 'tried'
+		baud_step tried[max_baud_steps];
+	};
+
+	// Finds the highest baudrate every slave on this instance's USART answers reliably at
+	//    Starts at the current rate and steps up by 1/8 at a time. Every step sends a burst of IFCNT reads
+	//    to the slaves of the mask, the first one with a corrupted or missing reply ends the search and
+	//    the USART is left at the step before it.
+	//	result: Every rate tried with its errors, and the one chosen
+	//	max_baud: The highest rate to try
+	//	slave_mask: Bit 's' selects slave address 's' (0 - 3), the slaves that are connected
+	//	reads: IFCNT reads per step, spread over the slaves
+	//	returns false if the slaves didn't answer reliably at the current rate already, the rate isn't changed then
+	//	NOTE: Waits with __WFI(), call it from setup() before other traffic, which would go out at the rates
+	//	      tried. While it runs, nothing in the priority class of IFCNT reads is retried.
+	bool negotiate_baud(baud_negotiation& result, uint32_t max_baud, uint8_t slave_mask = 0x0F, uint8_t reads = 32);
+
+
+	// The priority classes tickets are queued in, each USART has one queue per class
+	enum priority_class {
+		realtime = 0,			// Motion setpoints, by default writes to VACTUAL
+		configuration = 1,		// By default writes to every other register
+		telemetry = 2			// By default every read
+	};
+	static const uint8_t priority_classes = 3;
+
+	// Sets the priority class reads and writes of a register are queued in on this instance's USART
+	//    The next transfer always comes from the highest class that has tickets waiting, unless a lower
+	//    class was passed over TMC_STARVATION_LIMIT times, then that one is served first. Tickets of one
+	//    class go out in the order they were queued.
+	//	r_address: The register
+	//	cls: The class to queue its tickets in, or 'default_priority' to go back to the defaults above
+	void set_priority(uint32_t r_address, uint8_t cls = default_priority);
+	static const uint8_t default_priority = 0xFF;
+
+	// How the failed tickets of a priority class are retried, see 'set_retry_policy()'
+	struct retry_policy {
+		uint8_t attempts;			// Transfers per ticket at most, 0 and 1 don't retry
+		bool head_of_queue;			// Whether a retry goes before everything queued or behind the tickets of its class
+		uint16_t backoff_bits;		// Bit times to wait before the first head-of-queue retry, doubled for every further one
+	};
+
+	// Sets how tickets of a priority class are retried on this instance's USART when they end with crc_error or timedout
+	//    A retry sends the ticket's datagram again as it is, its callback only runs once the ticket succeeded or
+	//    ran out of attempts. A read keeps its request while the reply is checked, so it can go out again too.
+	//	cls: The priority class
+	//	attempts: Transfers per ticket at most, 1 turns retries off (the default)
+	//	head_of_queue: true to send retries before any other ticket, false to queue them behind their class
+	//	backoff_bits: Bit times to wait before a head-of-queue retry, doubled for every further attempt (up to 65535)
+	//	NOTE: A write retried behind its class may land after a newer write to the same register, keep
+	//	      'head_of_queue' for setpoints. Retried tickets are counted in 'bus_statistics::retries'.
+	void set_retry_policy(uint8_t cls, uint8_t attempts, bool head_of_queue = true, uint16_t backoff_bits = 0);
+
+
+	// ===== Register shadow ===============================================================================
+	//    Every write to a writable register (except GSTAT and OTP_PROG) of slave addresses 0 - 3 is
+	//    remembered. Fire-and-forget writes (Callback == deleteTicketCallback) of the value a register
+	//    already holds are dropped, and field updates are served from the shadow instead of a read.
+
+	// Returns the latest value queued for/read from a register, if it's known
+	//	s_address: The slave address of the driver
+	//	r_address: The register address
+	//	value: Where to store the value
+	//	returns false if the value is not known
+	bool shadow_value(uint32_t s_address, uint32_t r_address, uint32_t& value) const;
+
+	// Updates the bits of 'field_mask' in a register, leaving the other bits as they are
+	//    Served from the shadow when the register's value is known (one write). Otherwise GCONF, CHOPCONF
+	//    and PWMCONF are read first, the write is queued from the read's callback.
+	//	s_address: The slave address of the driver
+	//	r_address: The register address
+	//	field_mask: The bits to update
+	//	field_value: The new value of the bits, already shifted into place
+	//	Callback, Callback_parameters: Passed on to the write ticket
+	//	NOTE: returns false if the update couldn't be queued, or the value isn't known and can't be read.
+	//	      If the read of the fallback fails, the update is dropped and Callback is not called. An update
+	//	      that changes nothing returns true without a write only if Callback is deleteTicketCallback.
+	bool write_field(uint32_t s_address, uint32_t r_address, uint32_t field_mask, uint32_t field_value, void(*Callback)(volatile access_ticket*, void* additional_parameters) = deleteTicketCallback, void* Callback_parameters = nullptr);
+
+	// Same as above, with the fields built from the register description, ie. 'TMC_CHOPCONF::toff(0)'
+	template<uint8_t Address>
+	bool write_field(uint32_t s_address, TMC_Value<Address> fields, void(*Callback)(volatile access_ticket*, void* additional_parameters) = deleteTicketCallback, void* Callback_parameters = nullptr)
+	{
+		return write_field(s_address, Address, fields.mask, fields.bits, Callback, Callback_parameters);
+	}
+
+	// Checks whether the shadow of a slave can still be trusted by reading its IFCNT register
+	//    The driver counts its successful writes in IFCNT. If the count doesn't match the writes that
+	//    completed since the last sync (the driver was reset, or a write got lost), the shadow of the
+	//    slave is dropped. The first sync only records the counter.
+	//	s_address: The slave address of the driver
+	//	returns false if the read couldn't be queued
+	bool sync_shadow(uint32_t s_address);
+
+	// Forgets every shadowed register value of a slave
+	void invalidate_shadow(uint32_t s_address);
+
+
+	// ===== Verified write batches ======================================================================
+	//    A write completes when its echo arrives intact, which doesn't tell whether the driver took it.
+	//    A verified batch reads IFCNT, sends its writes back to back and reads IFCNT again: if the counter
+	//    moved by exactly the number of writes, all of them landed, for two reads per batch instead of a
+	//    read-back per register. Only if it didn't are the readable registers of the batch (GCONF, CHOPCONF,
+	//    PWMCONF) read back to find the lost writes.
+
+	// One register value of a batch
+	struct batch_write {
+		uint32_t r_address;
+		uint32_t data;
+	};
+
+	// The progress and result of a verified batch, owned by the caller
+	struct write_batch {
+		enum state
+		{
+			running = 0,	// Not finished yet
+			verified = 1,	// IFCNT counted every write
+			mismatch = 2,	// IFCNT disagreed, 'lost' and 'unverified' tell which writes are in question
+			failed = 3		// IFCNT couldn't be read or a write couldn't be queued
+		};
+
+		volatile uint8_t status;		// write_batch::state
+		volatile uint8_t landed;		// Number of writes IFCNT counted
+		volatile uint32_t lost;			// Bit i is set if write i couldn't be queued or its read-back didn't return its value
+		volatile uint32_t unverified;	// Bit i is set if write i was part of a mismatch and couldn't be read back
+
+		// Used by the driver while the batch runs
+		TMC_Serial* driver;
+		const batch_write* writes;
+		void(*callback)(write_batch& batch, void* additional_parameters);
+		void* callback_parameters;
+		uint8_t s_address;
+		uint8_t count;
+		uint8_t ifcnt;			// IFCNT before the writes
+		std::atomic<uint8_t> outstanding;	// Tickets of the current step that haven't completed, counted down from USART_Handler or dispatch()
+	};
+
+	// Sends a batch of writes to one driver and confirms them with IFCNT
+	//	s_address: The slave address of the driver
+	//	batch: Holds the progress and the result
+	//	writes: The registers and values, sent in this order
+	//	count: Number of writes (1 - 32)
+	//	Callback: Called from the USART interrupt once 'batch.status' is set
+	//	Callback_parameters: A pointer to the parameters the callback function will utilize
+	//	NOTE: 'batch' and 'writes' must stay valid until the batch is finished. Returns false if the batch
+	//	      couldn't be started. IFCNT counts every write the driver accepts, so nothing else may write to
+	//	      the slave while the batch runs. The writes are never coalesced or dropped as redundant.
+	bool write_verified(uint32_t s_address, write_batch& batch, const batch_write* writes, uint8_t count, void(*Callback)(write_batch& batch, void* additional_parameters) = nullptr, void* Callback_parameters = nullptr);
+
+
+	// ===== Subscriptions ===============================================================================
+	//    A subscription reads a register every 'period_ms' in the background and keeps the latest reply
+	//    in a snapshot, so polling a register costs no ticket and no waiting. The reads are started
+	//    from sysTickHook and queued as telemetry; each subscription reuses its own ticket. Phases are
+	//    picked so subscriptions of one bus fall on different milliseconds wherever the periods allow.
+
+	// The latest reply of a subscription
+	struct snapshot {
+		uint32_t value;			// The register value
+		uint32_t timestamp;		// micros() when the reply arrived
+		uint32_t sequence;		// Number of replies so far, skipped numbers mean the reader missed updates
+		uint8_t status;			// access_ticket::state of the read, 'value' is only updated by successful reads
+	};
+
+	// Starts reading a register periodically
+	//	s_address: The slave address of the driver
+	//	r_address: The register to read
+	//	period_ms: Time between two reads in milliseconds (at least 1)
+	//	returns the handle of the subscription, or -1 if all TMC_SUBSCRIPTIONS of this USART are in use
+	int8_t subscribe(uint32_t s_address, uint32_t r_address, uint16_t period_ms);
+
+	// Stops a subscription, a read that's already queued still completes
+	void unsubscribe(int8_t handle);
+
+	// Copies the latest reply of a subscription, safe to call from any context
+	//	handle: The value 'subscribe()' returned
+	//	latest: Where to store the snapshot
+	//	returns false if there's no reply yet
+	bool read_snapshot(int8_t handle, snapshot& latest) const;
+
+	// Starts the reads of every subscription that's due, the driver's sysTickHook calls it every millisecond
+	static void poll_subscriptions();
+
+
+	// ===== Velocity ramps ==============================================================================
+	//    A ramp moves a driver's VACTUAL to a target velocity with limited acceleration and jerk, the
+	//    sketch only sets the target. sysTickHook advances the profile and sends VACTUAL every period,
+	//    with at most one update of a slave in flight. If the previous update hasn't completed yet or more
+	//    than TMC_BURST_LENGTH tickets wait on the bus, the update is put off and the interval doubles (up
+	//    to 16 periods), it halves again as updates get through. The profile follows the clock, not the
+	//    updates, so a slower rate makes the steps coarser but not the ramp longer.
+
+	// The progress of a ramp
+	struct ramp_state {
+		int32_t target;			// The velocity the ramp heads for
+		int32_t velocity;		// The velocity of the profile now
+		int32_t applied;		// The last VACTUAL the driver took
+		int32_t tracking_error;	// 'velocity' - 'applied'
+		uint32_t update_rate;	// Updates per second that got through, averaged over the last few
+		uint16_t interval_ms;	// The interval the updates are sent at now
+		uint32_t updates;		// Updates that completed successfully
+		uint32_t skipped;		// Updates that were put off because the bus was busy
+		bool running;			// false once the driver holds the target velocity
+	};
+
+	// Sets up the ramp of a driver, the profile starts at the shadowed VACTUAL (0 if it's not known)
+	//	s_address: The slave address of the driver (0 - 3)
+	//	acceleration: Largest change of VACTUAL per second (at most 4000000)
+	//	jerk: Largest change of the acceleration per second, 0 for a trapezoidal profile
+	//	period_ms: Time between two VACTUAL updates in milliseconds (at least 1)
+	//	NOTE: returns false for an invalid slave address, or if an update of the slave's previous ramp is still
+	//	      on its way; that ramp then carries on untouched. Don't write VACTUAL of the slave yourself while it has a ramp.
+	bool set_ramp(uint32_t s_address, uint32_t acceleration, uint32_t jerk, uint16_t period_ms);
+
+	// Sets the velocity a driver's ramp heads for, also while the ramp runs
+	//	s_address: The slave address of the driver
+	//	velocity: The target VACTUAL (24 bit signed)
+	//	returns false if the slave has no ramp
+	bool ramp_to(uint32_t s_address, int32_t velocity);
+
+	// Copies the progress of a driver's ramp, safe to call from any context
+	//	returns false if the slave has no ramp
+	bool read_ramp(uint32_t s_address, ramp_state& state) const;
+
+	// Stops a driver's ramp where it is, an update that's already queued still completes
+	void end_ramp(uint32_t s_address);
+
+	// Advances every ramp and sends the updates that are due, the driver's sysTickHook calls it every millisecond
+	static void poll_ramps();
+
+
+	// ===== Group commits ===============================================================================
+	//    Sets a register of several drivers, on one USART or several, at nearly the same moment. The
+	//    values are staged per slave, then each USART gets one transfer with its values back to back and
+	//    all of those transfers start together: the commit waits until every USART of the group finished
+	//    the transfer it's busy with, holds it there and starts them all with interrupts disabled. The
+	//    values on one USART land one datagram time apart, the USARTs start within a few cycles.
+
+	// The staged values, the progress and the measured skew of a group commit, owned by the caller
+	struct group_commit {
+		enum state
+		{
+			idle = 0,		// Nothing committed yet
+			running = 1,	// Committed, not every transfer completed
+			committed = 2,	// Every slave got its value
+			failed = 3		// Some writes failed, see 'failed_slaves'
+		};
+
+		volatile uint8_t status;			// group_commit::state
+		volatile uint8_t failed_slaves[4];	// Bit 's' is set if slave 's' of USART 'i' didn't get its value
+		uint32_t start_spread;				// DWT cycles between the first and the last USART starting its transfer
+		uint32_t skew;						// Measured cycles between the first and the last value landing, set once the commit finished
+		uint32_t skew_bound;				// The worst case skew the commit expects, 'start_spread' plus the datagrams ahead on each USART
+		uint32_t landed[4];					// DWT cycles when the echo of the last datagram of USART 'i' came in
+
+		// Filled by stage_setpoint(), taken by commit_group()
+		uint32_t staged[4][4];
+		uint8_t staged_masks[4];
+
+		// Used by the driver while the commit runs
+		uint32_t values[4][4];				// The committed values, the transfers are built from them
+		uint8_t masks[4];
+		volatile access_ticket* tickets[4];
+		std::atomic<uint8_t> outstanding;
+		void(*callback)(group_commit& group, void* additional_parameters);
+		void* callback_parameters;
+
+		group_commit() : status(idle), failed_slaves(), start_spread(0), skew(0), skew_bound(0), landed(), staged_masks(), masks(), tickets(), outstanding(0), callback(nullptr), callback_parameters(nullptr) {}
+	};
+
+	// Stages the value of one driver for the next commit of a group
+	//	group: The group
+	//	s_address: The slave address of the driver on this instance's USART (0 - 3)
+	//	data: Its value
+	//	returns false for an invalid slave address
+	bool stage_setpoint(group_commit& group, uint32_t s_address, uint32_t data);
+
+	// Writes the staged values of a group to one register, see above
+	//	group: The group, its staged values are taken and cleared
+	//	r_address: The register every staged driver gets its value in
+	//	Callback: Called from the USART interrupt once 'group.status' is set
+	//	Callback_parameters: A pointer to the parameters the callback function will utilize
+	//	NOTE: Returns false if nothing is staged, the previous commit of the group is still running, the ticket
+	//	      pool is exhausted or it's called from an interrupt handler. It blocks with __WFI() until every USART
+	//	      of the group finished its current transfer (a burst of TMC_BURST_LENGTH writes or a read) and the
+	//	      longest frame gap passed, call it from the main loop. On the host simulator 'start_spread' is in host
+	//	      nanoseconds (see host/Arduino.h), 'landed' and the skews are in cycles of the simulated clock.
+	static bool commit_group(group_commit& group, uint32_t r_address, void(*Callback)(group_commit& group, void* additional_parameters) = nullptr, void* Callback_parameters = nullptr);
+
+
+	// ===== Bring-up profiles ===========================================================================
+	//    Configures every driver of a machine at once from tables, one per USART, of registers with a
+	//    value for each slave. Every USART reads the IFCNT of its slaves, sends the rows of all its slaves
+	//    as write bursts, up to TMC_BURST_LENGTH datagrams back to back per PDC transfer, then reads IFCNT
+	//    and GSTAT of each slave. The USARTs run in parallel and every step is started from the interrupt
+	//    of the one before, so the machine is configured in the time its busiest USART needs.
+
+	// One register of a bring-up table
+	struct profile_row {
+		uint32_t r_address;
+		uint8_t slave_mask;		// Bit 's' selects slave address 's' (0 - 3)
+		uint32_t data[4];		// The value of each slave, by slave address
+	};
+
+	// The tables, the progress and the result of a bring-up, owned by the caller
+	struct bring_up {
+		enum state
+		{
+			idle = 0,		// Not started yet
+			running = 1,	// Started, not every slave was read back
+			verified = 2,	// IFCNT counted every write of every slave
+			failed = 3		// Some slaves didn't count every write or couldn't be read, see 'failed_slaves'
+		};
+
+		volatile uint8_t status;			// bring_up::state
+		volatile uint8_t failed_slaves[4];	// Bit 's' is set if slave 's' of USART 'i' failed
+		volatile uint8_t landed[4][4];		// Writes IFCNT counted on each slave of each USART
+		volatile uint32_t gstat[4][4];		// GSTAT of each slave after the writes
+		uint32_t elapsed_us;				// From start_bring_up() until the last slave was read back
+
+		// Filled by stage_profile(), used by the driver while the bring-up runs
+		struct table {
+			bring_up* owner;
+			TMC_Serial* driver;
+			const profile_row* rows;
+			uint8_t count;
+			uint8_t slaves;					// Every slave of the rows
+			uint8_t failed;
+			uint8_t ifcnt[4];				// IFCNT before the writes
+			uint8_t expected[4];			// Rows of each slave
+			std::atomic<uint8_t> outstanding;	// Tickets of the current step that haven't completed
+		} tables[4];
+		std::atomic<uint8_t> running_buses;
+		uint32_t started_at;
+		void(*callback)(bring_up& profile, void* additional_parameters);
+		void* callback_parameters;
+
+		bring_up() : status(idle), failed_slaves(), landed(), gstat(), elapsed_us(0), tables(), running_buses(0), started_at(0), callback(nullptr), callback_parameters(nullptr) {}
+	};
+
+	// Stages this instance's table of a bring-up
+	//	profile: The bring-up
+	//	rows: The registers and values, sent in this order. Include GSTAT with 0x7 to clear the reset flags.
+	//	count: Number of rows (1 - 255)
+	//	returns false if the bring-up is running
+	//	NOTE: 'rows' must stay valid until the bring-up is finished
+	bool stage_profile(bring_up& profile, const profile_row* rows, uint8_t count);
+
+	// Starts every staged table of a bring-up, see above
+	//	profile: The bring-up
+	//	Callback: Called from the USART interrupt that read the last slave back, once 'profile.status' is set
+	//	Callback_parameters: A pointer to the parameters the callback function will utilize
+	//	NOTE: Returns false if nothing is staged or the bring-up is already running, poll 'status' or wait for the
+	//	      callback. IFCNT counts every write the driver accepts, so nothing else may write to the slaves
+	//	      meanwhile. The writes are never coalesced or dropped as redundant.
+	static bool start_bring_up(bring_up& profile, void(*Callback)(bring_up& profile, void* additional_parameters) = nullptr, void* Callback_parameters = nullptr);
+
+
+	// ===== Timed tickets ===============================================================================
+	//    A ticket can carry the moment its transfer is to start instead of going out as soon as the bus
+	//    is free. Timed tickets are pushed to a lock-free queue of their own, the owner of the bus moves them
+	//    to a list sorted by deadline, so no side disables interrupts. Queued transfers go ahead
+	//    only while they're sure to be over before the next deadline, the last stretch is counted by the
+	//    receiver timeout, in bit times like the frame gaps, and the transfer is started from USART_Handler.
+	//    A deadline further away than a couple of milliseconds on an idle bus is picked up again by
+	//    poll_deadlines() from the SysTick. Compare 'sent_at' to 'deadline' to see how close it came.
+
+	// Writes a register at a given time
+	//	s_address, r_address, data: Same as write()
+	//	at_us: The micros() value at which the datagram is to start, less than 2^31 us ahead
+	//	Callback, Callback_parameters: Same as write()
+	//	NOTE: Returns nullptr if the ticket pool is exhausted or TMC_TIMED_TICKETS tickets already wait to be
+	//	      sorted on this USART. A timed write is never coalesced or dropped as redundant. A deadline that's already past
+	//	      goes out after the current transfer. A deadline that's earlier than the one the bus is already
+	//	      counting down to waits for that count to run out, 2 ms at most. A timed ticket that's retried goes out as
+	//	      soon as it can.
+	volatile write_ticket* write_at(uint32_t s_address, uint32_t r_address, uint32_t data, uint32_t at_us, void(*Callback)(volatile access_ticket*, void* additional_parameters) = deleteTicketCallback, void* Callback_parameters = nullptr);
+
+	// Reads a register at a given time, the request starts at 'at_us'
+	//	s_address, r_address, Callback, Callback_parameters: Same as read()
+	//	at_us: Same as above
+	volatile read_ticket* read_at(uint32_t s_address, uint32_t r_address, uint32_t at_us, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters = nullptr);
+
+	// Starts waiting for the next deadline on every idle USART that has timed tickets, the driver's
+	//    sysTickHook calls it every millisecond
+	static void poll_deadlines();
+
+
+	// ===== Deferred completion ===========================================================================
+	//    By default a ticket's callback runs inside USART_Handler, so a slow callback holds up the next
+	//    transfer and every interrupt of lower priority. Deferred, the handler only sets the status,
+	//    updates the shadows and pushes the ticket into a lock-free completion ring, the callbacks run
+	//    later from dispatch(). Fire-and-forget writes are still deleted right away.
+
+	// Where the callbacks of a USART's tickets run
+	enum completion_mode {
+		immediate = 0,		// In USART_Handler, right after the transfer
+		polled = 1,			// In dispatch(), call it from loop()
+		pendsv = 2			// In the PendSV exception at the lowest priority, which USART_Handler triggers
+	};
+
+	// Sets where the callbacks of this instance's tickets run
+	//	mode: A completion_mode
+	//	NOTE: The ring has one consumer, don't use 'polled' on one instance and 'pendsv' on another. When
+	//	      TMC_COMPLETION_DEPTH tickets are waiting, further callbacks run in USART_Handler again.
+	void set_completion_mode(uint8_t mode);
+
+	// Returns where the callbacks of this instance's tickets run, a completion_mode
+	uint8_t get_completion_mode() const { return completionModes[bus]; }
+
+	// Runs the callbacks of the tickets in the completion ring, the driver's pendSVHook calls it too
+	//	returns the number of callbacks run
+	static uint32_t dispatch();
+
+
+	// Returns the USART peripheral this instance transmits over
+	Usart* get_usart() const { return serial; }
+
+#ifdef TMC_SERIAL_STATS
+	// Transfer counters and interrupt cost of one USART
+	struct bus_statistics {
+		uint32_t transfers;			// PDC transfers started, a write burst counts once
+		uint32_t tickets;			// Tickets completed, successfully or not
+		uint32_t retries;			// Failed tickets that were sent again instead of completing
+		uint32_t isr_count;			// Transfers finished by USART_Handler
+		uint32_t isr_cycles;		// DWT cycles USART_Handler spent finishing them
+		uint32_t isr_max_cycles;	// The longest of them
+		struct {
+			uint32_t tickets;		// Tickets of the class that started transferring
+			uint64_t us;			// Microseconds they waited in the queue, in total (wall time, unlike the ISR cycles)
+			uint32_t max_us;		// The longest wait
+		} queue_latency[priority_classes];
+		struct {
+			uint32_t tickets;		// Timed tickets that started transferring
+			uint64_t late_us;		// Microseconds they started after their deadline, in total
+			uint32_t max_late_us;	// The latest of them
+		} deadlines;
+	};
+
+	// Returns a copy of this instance's USART counters
+	bus_statistics statistics() const;
+
+	// Clears this instance's USART counters
+	void reset_statistics();
+#endif
+
 
 protected:
 	Usart* serial;											// The USART peripheral we're transmitting over
-	static Ring_Buffer<volatile access_ticket*> messageQueues[];	// The queues of messages to transmit over each USART
-	static uint8_t idleTimes[];								// How long each queue has been idle for
-	Ring_Buffer<volatile access_ticket*>& message_queue;			// The message queue this instance will work with
+	const uint8_t bus;										// Index of 'serial' (0 - 3) into the per-USART state
+	static ticket_queue messageQueues[][priority_classes];	// The queues of messages to transmit over each USART, one per priority class
+	static uint8_t priorityOverrides[][128];				// The priority class + 1 of each register on each USART, 0: the default class
+	static uint8_t passedOver[][priority_classes];			// Transfers of higher classes started while each class was waiting
+	static volatile access_ticket* volatile activeTickets[][TMC_BURST_LENGTH];	// The tickets each USART is currently transferring
+	static volatile uint8_t activeCounts[];					// The number of tickets in each USART's current transfer
+	static const uint8_t max_burst = TMC_BURST_LENGTH > 4 ? TMC_BURST_LENGTH : 4;	// A fan-out write sends up to four datagrams even with shorter bursts
+	static uint8_t txBursts[][(max_burst - 1) * 8];		// Write datagrams following the first one of a burst, streamed via US_TNPR
+	static uint8_t rxBursts[][max_burst * 8];			// The echo of a burst of write datagrams, or of a read request followed by the reply
+	static std::atomic<bool> busyFlags[];					// Set while a context owns the USART (transferring or waiting to)
+	static volatile uint8_t frameGaps[];					// Bit times between two transfers on each USART, or 'follow_send_delay'
+	static volatile uint8_t sendDelays[][4];				// The reply delay of each slave in bit times, follows SLAVECONF writes
+	static volatile bool turnarounds[];						// Set while a USART's receiver timeout counts the gap before its next transfer
+	static volatile bool holds[];							// Set while a group commit waits for the USART
+	static volatile bool parked[];							// Set once the owner of a held USART handed it to the commit
+	static retry_policy retryPolicies[][priority_classes];	// How each class is retried on each USART
+	static volatile access_ticket* retryTickets[][TMC_BURST_LENGTH];	// Head-of-queue retries waiting on each USART, oldest first
+	static uint8_t retryCounts[];							// Number of 'retryTickets' of each USART, only touched by the USART's owner
+	static volatile uint8_t completionModes[];				// Where the callbacks of each USART's tickets run
+	static MPSC_Queue<volatile access_ticket*, TMC_COMPLETION_DEPTH> completions;	// Completed tickets waiting for dispatch()
+	static MPSC_Queue<volatile access_ticket*, TMC_TIMED_TICKETS> timedInbox[];	// Timed tickets of each USART waiting to be sorted in
+	static volatile access_ticket* timedTickets[][TMC_TIMED_TICKETS];	// The timed tickets of each USART, earliest deadline first, only touched by the USART's owner
+	static volatile uint8_t timedCounts[];					// Number of 'timedTickets' of each USART
+	static volatile uint32_t nextDeadlines[];				// The deadline of each USART's first timed ticket, valid while 'timedCounts' isn't 0
+#ifdef TMC_SERIAL_STATS
+	static bus_statistics busStatistics[];					// Counters of each USART
+
+	// Adds the time a ticket spent in its queue to its class's latency counters, called when it starts transferring
+	static void count_queue_latency(size_t bus, volatile access_ticket* ticket);
+#endif
+
+	// The registers of each USART that have write coalescing enabled, with one slot per slave address
+	struct coalesce_entry {
+		volatile bool enabled;
+		uint8_t r_address;
+		coalesce_slot slaves[4];
+	};
+	static coalesce_entry coalesceTable[][TMC_COALESCE_REGISTERS];
+
+	// Returns the coalescing slot of a slave's register, or nullptr if writes to it are not coalesced
+	static coalesce_slot* find_coalesce_slot(size_t bus, uint32_t s_address, uint32_t r_address);
+
+	// Last known register values of one slave
+	struct register_shadow {
+		static const uint8_t register_count = 11;			// Number of shadowed registers, see 'shadow_index()'
+		volatile uint32_t requested[register_count];		// Value of the latest write queued
+		volatile uint32_t confirmed[register_count];		// Value of the latest write that completed successfully
+		std::atomic<uint8_t> in_flight[register_count];		// Number of queued writes that haven't completed yet
+		std::atomic<uint16_t> known;						// Bit i is set while 'requested[i]' is what the register holds/will hold
+		volatile uint8_t ifcnt;								// The value IFCNT should have, if 'ifcnt_known'
+		volatile bool ifcnt_known;
+	};
+	static register_shadow shadows[][4];
+
+	// Returns the shadow slot of a register, -1 if the register isn't shadowed
+	static int8_t shadow_index(uint32_t r_address);
+
+	// Returns whether a shadowed register can also be read from the driver (GCONF, CHOPCONF, PWMCONF)
+	static bool readable_shadow(uint32_t r_address);
+
+	// Updates the shadow of the ticket's slave (every slave of a fan-out write) once the ticket completed, called from USART_Handler
+	static void update_shadow(size_t bus, volatile access_ticket* ticket);
+
+	// Counts a write queued to the slaves of 'slave_mask' in their shadows and retires the coalescing slots
+	//    it would otherwise overtake, 'untrack_writes()' reverts the count if the write couldn't be queued
+	//	hand_over: Clear for a timed write, the retired slot's write goes out before it with its own value
+	static void track_writes(size_t bus, uint8_t slave_mask, uint32_t r_address, uint32_t data, bool hand_over = true);
+	static void untrack_writes(size_t bus, uint8_t slave_mask, uint32_t r_address);
+
+	// Updates the shadow of one slave after a write to it completed
+	static void update_written(size_t bus, uint32_t s_address, uint32_t r_address, uint32_t data, bool succeeded);
+
+	// Finishes a write_field() whose register value had to be read first
+	static void write_field_callback(volatile access_ticket* ticket, void* field_update);
+
+	// Deletes the IFCNT read of sync_shadow(), update_shadow() compared it with the shadow when it completed
+	static void sync_shadow_callback(volatile access_ticket* ticket, void* shadow);
+
+	// The steps of write_verified(), each one starts when the tickets of the one before completed
+	static void batch_counted(volatile access_ticket* ticket, void* batch);		// IFCNT before, queues the writes
+	static void batch_written(volatile access_ticket* ticket, void* batch);		// queues the IFCNT read once all writes are done
+	static void batch_recounted(volatile access_ticket* ticket, void* batch);	// IFCNT after, queues the read-backs on a mismatch
+	static void batch_read_back(volatile access_ticket* ticket, void* batch);
+	static void finish_batch(write_batch& batch, uint8_t status);
+
+	// The body of both write()s, 'prebuilt' is nullptr if the datagram has to be encoded
+	//    'exact' writes are never coalesced or dropped as redundant
+	volatile write_ticket* queue_write(uint32_t s_address, uint32_t r_address, uint32_t data, const TMC_Datagram* prebuilt, bool exact, void(*Callback)(volatile access_ticket*, void* additional_parameters), void* Callback_parameters);
+
+	// Queues a ticket in its priority class on USART 'bus' and starts the transfer if the USART is free
+	//    returns false if the queue is full
+	static bool enqueue(size_t bus, volatile access_ticket* ticket);
+
+	// A periodic read and its double-buffered snapshot
+	//    Only the completing read writes the snapshot: it fills the buffer readers aren't pointed at,
+	//    then bumps 'sequence', whose lowest bit selects the buffer to read. A reader that sees
+	//    'sequence' change while copying tries again.
+	struct subscription {
+		volatile bool active;
+		std::atomic<bool> in_flight;			// Set while the read is queued or transferring
+		uint8_t s_address, r_address;
+		uint16_t period_ms;
+		uint32_t due_ms;						// millis() at which the next read is started
+		snapshot buffers[2];
+		std::atomic<uint32_t> sequence;
+		alignas(access_ticket) uint8_t ticket[sizeof(read_ticket)];	// The read, built by subscribe() and sent again every period
+	};
+	static subscription subscriptions[][TMC_SUBSCRIPTIONS];
+
+	// Publishes the reply of a subscription's read
+	static void subscription_callback(volatile access_ticket* ticket, void* subscription_pointer);
+
+	// The velocity profile of one slave and the write that carries it
+	//    The profile is kept in millionths: 'velocity' in VACTUAL / 1000000, 'acceleration' in VACTUAL
+	//    per second / 1000000, so the steps of a millisecond don't round away.
+	struct ramp {
+		volatile bool configured;
+		volatile bool running;
+		std::atomic<bool> in_flight;			// Set while the update is queued or transferring
+		volatile int32_t target;
+		uint32_t max_acceleration, jerk;
+		uint16_t period_ms, interval_ms;
+		uint32_t due_ms;						// millis() at which the next update is due
+		uint32_t stepped_us;					// micros() the profile was last advanced to
+		int64_t velocity, acceleration;
+		volatile int32_t applied;				// The value of the last update that completed successfully
+		uint32_t completed_us;					// micros() when it completed
+		uint32_t average_us;					// Average time between two successful updates
+		uint32_t updates, skipped;
+		alignas(access_ticket) uint8_t ticket[sizeof(write_ticket)];	// The update, built again for every value
+	};
+	static ramp ramps[][4];
+
+	// Advances a profile by 'elapsed_us'
+	static void step_ramp(ramp& r, uint32_t elapsed_us);
+
+	// Records a completed update
+	static void ramp_callback(volatile access_ticket* ticket, void* ramp_pointer);
+
+	// Returns the number of tickets waiting on USART 'bus'
+	static size_t queue_depth(size_t bus);
+
+	// Records the completed transfer of one USART of a group commit
+	static void group_written(volatile access_ticket* ticket, void* group_pointer);
+
+	// Returns the cycle count the landing of a group commit's values is measured with
+	static uint32_t landing_clock();
+
+	// The steps of a bring-up on one USART, each one starts when the tickets of the one before completed
+	static void profile_counted(volatile access_ticket* ticket, void* table);		// IFCNT before, queues the rows
+	static void profile_written(volatile access_ticket* ticket, void* table);		// queues the IFCNT and GSTAT reads once all rows are done
+	static void profile_read_back(volatile access_ticket* ticket, void* table);	// finishes the USART, and the bring-up with the last one
+
+	// Returns the priority class of a read or write of a register on USART 'bus'
+	static uint8_t priority_of(size_t bus, uint32_t r_address, bool write);
+
+	// Takes the ticket to transfer next out of USART 'bus's queues, see 'set_priority()'. Head-of-queue retries go first.
+	//    returns false if no ticket is waiting
+	static bool pop_next(size_t bus, volatile access_ticket*& ticket);
+
+	// Takes the next write that can join a burst of class 'cls' on USART 'bus': the pending head-of-queue retries
+	//    first, otherwise the next ticket of the class, unless a higher class is waiting. A write to a register
+	//    the burst already writes ends it, a retry of the earlier one would land after the newer value.
+	//	count: The datagrams in 'activeTickets[bus]' so far
+	//    returns false if the burst has to end here
+	static bool pop_burst_write(size_t bus, uint8_t cls, uint8_t count, volatile access_ticket*& ticket);
+
+	// Returns whether one of the first 'count' datagrams of the burst on USART 'bus' writes the register 'ticket' writes
+	static bool in_burst(size_t bus, uint8_t count, volatile access_ticket* ticket);
+
+	// Queues a failed ticket again if its class's retry policy allows another attempt, called from USART_Handler
+	//    returns false if the ticket has to complete with its failure
+	static bool retry(size_t bus, volatile access_ticket* ticket);
+
+	// Returns whether no ticket of any class (and no retry) is waiting on USART 'bus'
+	static bool queues_empty(size_t bus);
+
+	// Returns whether a ticket of a class higher than 'cls' is waiting on USART 'bus'
+	static bool waiting_above(size_t bus, uint8_t cls);
+
+	// Tries to take ownership of USART 'bus', only the owner may pop from its queue and start transfers
+	static bool claim_bus(size_t bus);
+
+	// Gives up ownership of USART 'bus'. If a ticket was queued in the meantime the bus is claimed
+	//    again and the ticket is scheduled.
+	static void release_bus(size_t bus);
+
+	// Starts the next queued transfer of USART 'bus' once the frame gap has passed, or releases the bus
+	//    if its queue is empty. Only the owner of the bus may call this.
+	//	gap_passed: Set when the receiver timeout just counted the gap
+	static void schedule_next(size_t bus, bool gap_passed = false);
+
+	// Pushes a timed ticket to the timed queue of USART 'bus' and schedules it if the bus is idle,
+	//    returns false if there's no room
+	static bool enqueue_at(size_t bus, volatile access_ticket* ticket, uint32_t at_us);
+
+	// Sorts the pushed timed tickets of USART 'bus' into 'timedTickets' while there's room, only the owner may call this
+	static void collect_timed(size_t bus);
+
+	// Returns whether timed tickets of USART 'bus' are pushed and 'collect_timed()' has room for them
+	static bool timed_waiting(size_t bus);
+
+	// Returns whether the earliest timed ticket of USART 'bus' is due within 2 ms, 'wait' is set to the bit
+	//    times until then. Returns false if there's none. Outside the owner it's a hint, the list may change.
+	static bool deadline_near(size_t bus, uint32_t& wait);
+
+	// Takes the earliest timed ticket of USART 'bus' and starts its transfer, only the owner may call this
+	static void begin_timed(size_t bus);
+
+	// Returns the bit times of USART 'bus' until 'at_us', rounded up, 0 if it's past
+	static uint32_t bits_until(size_t bus, uint32_t at_us);
+
+	// Returns the cycles of one bit time of USART 'bus'
+	static uint32_t bit_cycles(size_t bus);
+
+	// Returns the US_BRGR value closest to a baudrate
+	static uint32_t brgr_for(uint32_t baud);
+
+	// Counts the errors of negotiate_baud()'s reads in a baud_step
+	static void baud_probed(volatile access_ticket* ticket, void* step);
+
+	// Returns the largest reply delay of the slaves on USART 'bus' in bit times
+	static uint8_t send_delay(size_t bus);
+
+	// Returns the USART peripheral of bus index 'bus'
+	static Usart* bus_usart(size_t bus);
+
+	// Returns the bus index of a USART peripheral. The register blocks are 0x4000 apart,
+	//    so 'serial - USART0' is not the index.
+	static uint8_t bus_index(const Usart* serial);
 
-	friend void USART_Handler(Usart* serial, uint32_t status);
+	friend void USART_Handler(Usart* serial, size_t bus, uint32_t status);
 	friend void USART0_Handler();
 	friend void USART1_Handler();
 	friend void USART2_Handler();
 	friend void USART3_Handler();
-	friend void message_queue_idle_handler();
 };
\ No newline at end of file
@@ -0,0 +1,124 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Fixed-size, lock-free pool of equally sized memory slots
+//    acquire() and release() are O(1) and never disable interrupts, so they can be called from
+//    the main loop and from interrupt handlers alike. The free slots are kept as a stack of slot
+//    indices, the head of the stack is tagged with a generation counter so a release/acquire
+//    pair between another context's load and compare-exchange can't corrupt the list (ABA).
+//
+//    _SlotSize: The size in bytes of each slot
+//    _Count: The number of slots in the pool (at most 255)
+template<size_t _SlotSize, size_t _Count>
+class Ticket_Pool
+{
+	static_assert(_Count > 0 && _Count < 0xFF, "Ticket_Pool: slot count must be between 1 and 254");
+
+	static const uint32_t empty = 0xFF;				// Slot index marking the end of the free list
+	static const size_t slot_stride = (_SlotSize + 7) & ~(size_t)7;
+
+	alignas(8) uint8_t slots[_Count * slot_stride];	// The memory handed out by acquire()
+	volatile uint8_t next[_Count];					// The free list, next[i] is the slot after slot i
+	std::atomic<uint32_t> head;						// Generation tag << 8 | index of the first free slot
+	std::atomic<uint32_t> used;						// Number of slots currently acquired
+	std::atomic<uint32_t> peak;						// Highest value 'used' has reached
+	std::atomic<uint32_t> misses;					// Number of times acquire() found the pool empty
+
+public:
+	Ticket_Pool();
+
+	// Takes a slot out of the pool
+	//    NOTE: returns nullptr when the pool is exhausted, consider checking the return value.
+	void* acquire();
+
+	// Returns a slot to the pool
+	//    slot: A pointer previously returned by 'acquire()', nullptr is ignored
+	void release(void* slot);
+
+	// Returns whether 'ptr' points into one of the pools slots
+	bool owns(const volatile void* ptr) const;
+
+	// Returns the index of the slot 'ptr' points to
+	size_t index_of(const volatile void* ptr) const;
+
+	// Returns the number of slots in the pool
+	static constexpr size_t capacity() { return _Count; }
+
+	// Returns the number of slots currently acquired
+	size_t in_use() const { return used.load(); }
+
+	// Returns the highest number of slots that were acquired at the same time
+	size_t high_water() const { return peak.load(); }
+
+	// Returns the number of acquire() calls that failed because the pool was exhausted
+	size_t exhausted() const { return misses.load(); }
+};
+
+
+template<size_t _SlotSize, size_t _Count>
+Ticket_Pool<_SlotSize, _Count>::Ticket_Pool() :
+	head(0),
+	used(0),
+	peak(0),
+	misses(0)
+{
+	for (size_t i = 0; i < _Count; ++i)
+		next[i] = (i + 1 < _Count) ? i + 1 : empty;
+}
+
+
+template<size_t _SlotSize, size_t _Count>
+void* Ticket_Pool<_SlotSize, _Count>::acquire()
+{
+	uint32_t old_head = head.load();
+	uint32_t index;
+	do
+	{
+		index = old_head & 0xFF;
+		if (index == empty)
+		{
+			misses.fetch_add(1);
+			return nullptr;
+		}
+	} while (!head.compare_exchange_weak(old_head, (old_head & ~(uint32_t)0xFF) + 0x100 + next[index]));
+
+	uint32_t now_used = used.fetch_add(1) + 1;
+	uint32_t old_peak = peak.load();
+	while (now_used > old_peak && !peak.compare_exchange_weak(old_peak, now_used))
+	{ /* another context raised the peak, try again */ }
+
+	return slots + index * slot_stride;
+}
+
+
+template<size_t _SlotSize, size_t _Count>
+void Ticket_Pool<_SlotSize, _Count>::release(void* slot)
+{
+	if (slot == nullptr)
+		return;
+
+	uint32_t index = index_of(slot);
+	uint32_t old_head = head.load();
+	do
+	{
+		next[index] = old_head & 0xFF;
+	} while (!head.compare_exchange_weak(old_head, (old_head & ~(uint32_t)0xFF) + 0x100 + index));
+
+	used.fetch_sub(1);
+}
+
+
+template<size_t _SlotSize, size_t _Count>
+inline bool Ticket_Pool<_SlotSize, _Count>::owns(const volatile void* ptr) const
+{
+	return (const volatile uint8_t*)ptr >= slots && (const volatile uint8_t*)ptr < slots + sizeof(slots);
+}
+
+
+template<size_t _SlotSize, size_t _Count>
+inline size_t Ticket_Pool<_SlotSize, _Count>::index_of(const volatile void* ptr) const
+{
+	return ((const volatile uint8_t*)ptr - slots) / slot_stride;
+}
@@ -0,0 +1,180 @@
+#pragma once
+// Host stand-in for the parts of the Arduino Due core and the SAM3X CMSIS headers the driver uses.
+//    The peripherals are backed by SAM3X_Sim, so the driver sources build unchanged with
+//    '-I host' in front of the include path.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SAM3X_Sim.h"
+
+// ===== Peripherals ===============================================================================
+#define USART0	(SAM3X_Sim::instance().usart_registers(0))
+#define USART1	(SAM3X_Sim::instance().usart_registers(1))
+#define USART2	(SAM3X_Sim::instance().usart_registers(2))
+#define USART3	(SAM3X_Sim::instance().usart_registers(3))
+
+// The PIO controllers only hold their values, pin multiplexing isn't modeled
+typedef struct {
+	volatile uint32_t PIO_PER, PIO_PDR, PIO_PSR, PIO_OER, PIO_ODR, PIO_OSR;
+	volatile uint32_t PIO_SODR, PIO_CODR, PIO_ODSR, PIO_PDSR, PIO_PUER, PIO_PUDR, PIO_ABSR;
+} Pio;
+extern Pio sim_pio[4];
+#define PIOA	(&sim_pio[0])
+#define PIOB	(&sim_pio[1])
+#define PIOC	(&sim_pio[2])
+#define PIOD	(&sim_pio[3])
+
+extern volatile uint32_t sim_pmc_pcer0;
+#define REG_PMC_PCER0	sim_pmc_pcer0
+
+extern uint32_t SystemCoreClock;
+
+// Peripheral identifiers
+#define ID_PIOA		11
+#define ID_PIOB		12
+#define ID_PIOC		13
+#define ID_PIOD		14
+#define ID_USART0	17
+#define ID_USART1	18
+#define ID_USART2	19
+#define ID_USART3	20
+
+typedef enum IRQn {
+	PendSV_IRQn		= -2,
+	SysTick_IRQn	= -1,
+	USART0_IRQn		= 17,
+	USART1_IRQn		= 18,
+	USART2_IRQn		= 19,
+	USART3_IRQn		= 20
+} IRQn_Type;
+
+// ===== USART register fields ===============================================================================
+#define US_CR_RSTRX				(0x1u << 2)
+#define US_CR_RSTTX				(0x1u << 3)
+#define US_CR_RXEN				(0x1u << 4)
+#define US_CR_RXDIS				(0x1u << 5)
+#define US_CR_TXEN				(0x1u << 6)
+#define US_CR_TXDIS				(0x1u << 7)
+#define US_CR_RSTSTA			(0x1u << 8)
+#define US_CR_STTTO				(0x1u << 11)
+#define US_CR_RETTO				(0x1u << 15)
+
+#define US_MR_USART_MODE_NORMAL	(0x0u << 0)
+#define US_MR_USCLKS_MCK		(0x0u << 4)
+#define US_MR_CHRL_8_BIT		(0x3u << 6)
+#define US_MR_PAR_NO			(0x4u << 9)
+#define US_MR_NBSTOP_1_BIT		(0x0u << 12)
+#define US_MR_CHMODE_NORMAL		(0x0u << 14)
+
+#define US_CSR_RXRDY			(0x1u << 0)
+#define US_CSR_TXRDY			(0x1u << 1)
+#define US_CSR_ENDRX			(0x1u << 3)
+#define US_CSR_ENDTX			(0x1u << 4)
+#define US_CSR_OVRE				(0x1u << 5)
+#define US_CSR_TIMEOUT			(0x1u << 8)
+#define US_CSR_TXEMPTY			(0x1u << 9)
+#define US_CSR_TXBUFE			(0x1u << 11)
+#define US_CSR_RXBUFF			(0x1u << 12)
+
+// US_IER, US_IDR and US_IMR share the bit positions of US_CSR
+#define US_IER_RXRDY			US_CSR_RXRDY
+#define US_IER_TXRDY			US_CSR_TXRDY
+#define US_IER_ENDRX			US_CSR_ENDRX
+#define US_IER_ENDTX			US_CSR_ENDTX
+#define US_IER_OVRE				US_CSR_OVRE
+#define US_IER_TIMEOUT			US_CSR_TIMEOUT
+#define US_IER_TXEMPTY			US_CSR_TXEMPTY
+#define US_IER_TXBUFE			US_CSR_TXBUFE
+#define US_IER_RXBUFF			US_CSR_RXBUFF
+#define US_IDR_RXRDY			US_CSR_RXRDY
+#define US_IDR_TXRDY			US_CSR_TXRDY
+#define US_IDR_ENDRX			US_CSR_ENDRX
+#define US_IDR_ENDTX			US_CSR_ENDTX
+#define US_IDR_OVRE				US_CSR_OVRE
+#define US_IDR_TIMEOUT			US_CSR_TIMEOUT
+#define US_IDR_TXEMPTY			US_CSR_TXEMPTY
+#define US_IDR_TXBUFE			US_CSR_TXBUFE
+#define US_IDR_RXBUFF			US_CSR_RXBUFF
+
+#define US_BRGR_CD_Pos			0
+#define US_BRGR_CD_Msk			(0xffffu << US_BRGR_CD_Pos)
+#define US_BRGR_CD(value)		((US_BRGR_CD_Msk & ((value) << US_BRGR_CD_Pos)))
+#define US_BRGR_FP_Pos			16
+#define US_BRGR_FP_Msk			(0x7u << US_BRGR_FP_Pos)
+#define US_BRGR_FP(value)		((US_BRGR_FP_Msk & ((value) << US_BRGR_FP_Pos)))
+
+#define US_RTOR_TO_Msk			0xffffu
+
+#define US_PTCR_RXTEN			(0x1u << 0)
+#define US_PTCR_RXTDIS			(0x1u << 1)
+#define US_PTCR_TXTEN			(0x1u << 8)
+#define US_PTCR_TXTDIS			(0x1u << 9)
+#define US_PTSR_RXTEN			(0x1u << 0)
+#define US_PTSR_TXTEN			(0x1u << 8)
+
+// ===== Core ===============================================================================
+// The DWT cycle counter counts host nanoseconds, so CPU costs timed with it are the host's (simulated
+//    time doesn't pass while code runs). Wire time is SAM3X_Sim::now().
+struct Sim_Cycle_Counter {
+	operator uint32_t() const;
+};
+typedef struct {
+	volatile uint32_t CTRL;
+	Sim_Cycle_Counter CYCCNT;
+} DWT_Type;
+typedef struct {
+	volatile uint32_t DEMCR;
+} CoreDebug_Type;
+extern DWT_Type sim_dwt;
+extern CoreDebug_Type sim_core_debug;
+#define DWT							(&sim_dwt)
+#define CoreDebug					(&sim_core_debug)
+#define DWT_CTRL_CYCCNTENA_Msk		(0x1u << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk	(0x1u << 24)
+
+// Only setting PendSV pending through ICSR is modeled
+struct Sim_ICSR {
+	Sim_ICSR& operator=(uint32_t value);
+	operator uint32_t() const;
+};
+typedef struct {
+	Sim_ICSR ICSR;
+} SCB_Type;
+extern SCB_Type sim_scb;
+#define SCB							(&sim_scb)
+#define SCB_ICSR_PENDSVSET_Msk		(0x1u << 28)
+#define __NVIC_PRIO_BITS			4
+
+inline void NVIC_EnableIRQ(IRQn_Type irq) { SAM3X_Sim::instance().enable_irq(irq); }
+inline void NVIC_DisableIRQ(IRQn_Type irq) { SAM3X_Sim::instance().disable_irq(irq); }
+inline void NVIC_SetPriority(IRQn_Type irq, uint32_t priority) { SAM3X_Sim::instance().set_priority(irq, priority); }
+inline uint32_t NVIC_GetPriority(IRQn_Type irq) { return SAM3X_Sim::instance().get_priority(irq); }
+
+inline void __disable_irq() { SAM3X_Sim::instance().disable_interrupts(); }
+inline void __enable_irq() { SAM3X_Sim::instance().enable_interrupts(); }
+inline uint32_t __get_PRIMASK() { return SAM3X_Sim::instance().interrupts_disabled() ? 1 : 0; }
+inline void __set_PRIMASK(uint32_t primask) { if (primask) __disable_irq(); else __enable_irq(); }
+inline uint32_t __get_IPSR() { return SAM3X_Sim::instance().in_handler() ? 1 : 0; }	// Only whether a handler runs is modeled
+inline void __WFI() { SAM3X_Sim::instance().wait_for_interrupt(); }
+inline void __DMB() { __sync_synchronize(); }
+inline void __DSB() { __sync_synchronize(); }
+
+#define noInterrupts()	__disable_irq()
+#define interrupts()	__enable_irq()
+
+// Time, derived from the simulated clock
+inline uint32_t millis() { return (uint32_t)(SAM3X_Sim::instance().now() / (SAM3X_Sim::clock_hz / 1000)); }
+inline uint32_t micros() { return (uint32_t)(SAM3X_Sim::instance().now() / (SAM3X_Sim::clock_hz / 1000000)); }
+inline void delay(uint32_t ms) { SAM3X_Sim::instance().run_for((uint64_t)ms * (SAM3X_Sim::clock_hz / 1000)); }
+inline void delayMicroseconds(uint32_t us) { SAM3X_Sim::instance().run_for((uint64_t)us * (SAM3X_Sim::clock_hz / 1000000)); }
+
+// The vectors the simulator calls, the Due core declares them with C linkage as well (weak defaults in SAM3X_Sim.cpp)
+extern "C" {
+	void USART0_Handler(void);
+	void USART1_Handler(void);
+	void USART2_Handler(void);
+	void USART3_Handler(void);
+	int sysTickHook(void);
+	void pendSVHook(void);
+}
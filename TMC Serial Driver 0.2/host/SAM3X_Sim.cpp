@@ -0,0 +1,605 @@
+#include "Arduino.h"
+#include "TMC2209_Model.h"
+#include <chrono>
+#include <new>
+#include <stdio.h>
+
+Pio sim_pio[4];
+volatile uint32_t sim_pmc_pcer0;
+uint32_t SystemCoreClock = SAM3X_Sim::clock_hz;
+DWT_Type sim_dwt;
+CoreDebug_Type sim_core_debug;
+SCB_Type sim_scb;
+
+Sim_Cycle_Counter::operator uint32_t() const
+{
+	return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Sim_ICSR& Sim_ICSR::operator=(uint32_t value)
+{
+	if (value & SCB_ICSR_PENDSVSET_Msk)
+		SAM3X_Sim::instance().set_pendsv();
+	return *this;
+}
+
+Sim_ICSR::operator uint32_t() const
+{
+	return SAM3X_Sim::instance().pendsv_set() ? SCB_ICSR_PENDSVSET_Msk : 0;
+}
+
+// Like the Due core, the vectors and the SysTick and PendSV hooks default to doing nothing
+extern "C" {
+	__attribute__((weak)) void USART0_Handler(void) {}
+	__attribute__((weak)) void USART1_Handler(void) {}
+	__attribute__((weak)) void USART2_Handler(void) {}
+	__attribute__((weak)) void USART3_Handler(void) {}
+	__attribute__((weak)) int sysTickHook(void) { return 0; }
+	__attribute__((weak)) void pendSVHook(void) {}
+}
+
+static void(* const usart_handlers[SAM3X_Sim::usart_count])(void) = { USART0_Handler, USART1_Handler, USART2_Handler, USART3_Handler };
+
+// USART register offsets (datasheet 35.8)
+enum usart_offset : uint16_t {
+	CR = 0x00, MR = 0x04, IER = 0x08, IDR = 0x0C, IMR = 0x10, CSR = 0x14, RHR = 0x18, THR = 0x1C,
+	BRGR = 0x20, RTOR = 0x24, TTGR = 0x28, FIDI = 0x40, NER = 0x44, IF = 0x4C, MAN = 0x50, WPMR = 0xE4, WPSR = 0xE8,
+	RPR = 0x100, RCR = 0x104, TPR = 0x108, TCR = 0x10C, RNPR = 0x110, RNCR = 0x114, TNPR = 0x118, TNCR = 0x11C,
+	PTCR = 0x120, PTSR = 0x124
+};
+
+
+// ===== Sim_Register ===============================================================================
+void Sim_Register::bind(USART_Model* Owner, uint16_t Offset)
+{
+	owner = Owner;
+	offset = Offset;
+}
+
+Sim_Register& Sim_Register::operator=(uintptr_t value)
+{
+	owner->write(offset, value);
+	return *this;
+}
+
+Sim_Register::operator uintptr_t() const
+{
+	return owner->read(offset);
+}
+
+
+// ===== USART_Model ===============================================================================
+USART_Model::USART_Model(Usart* Registers) :
+	regs(Registers)
+{
+	regs->US_CR.bind(this, CR);		regs->US_MR.bind(this, MR);		regs->US_IER.bind(this, IER);
+	regs->US_IDR.bind(this, IDR);	regs->US_IMR.bind(this, IMR);	regs->US_CSR.bind(this, CSR);
+	regs->US_RHR.bind(this, RHR);	regs->US_THR.bind(this, THR);	regs->US_BRGR.bind(this, BRGR);
+	regs->US_RTOR.bind(this, RTOR);	regs->US_TTGR.bind(this, TTGR);	regs->US_FIDI.bind(this, FIDI);
+	regs->US_NER.bind(this, NER);	regs->US_IF.bind(this, IF);		regs->US_MAN.bind(this, MAN);
+	regs->US_WPMR.bind(this, WPMR);	regs->US_WPSR.bind(this, WPSR);
+	regs->US_RPR.bind(this, RPR);	regs->US_RCR.bind(this, RCR);	regs->US_TPR.bind(this, TPR);
+	regs->US_TCR.bind(this, TCR);	regs->US_RNPR.bind(this, RNPR);	regs->US_RNCR.bind(this, RNCR);
+	regs->US_TNPR.bind(this, TNPR);	regs->US_TNCR.bind(this, TNCR);	regs->US_PTCR.bind(this, PTCR);
+	regs->US_PTSR.bind(this, PTSR);
+
+	reset();
+}
+
+void USART_Model::attach(TMC2209_Model& slave)
+{
+	slaves.push_back(&slave);
+}
+
+void USART_Model::detach_all()
+{
+	slaves.clear();
+}
+
+uint32_t USART_Model::bit_cycles() const
+{
+	// Baudrate = MCK / (16 * (CD + FP / 8)), so a bit lasts 16 * CD + 2 * FP cycles
+	uint32_t cd = brgr & US_BRGR_CD_Msk;
+	uint32_t fp = (brgr & US_BRGR_FP_Msk) >> US_BRGR_FP_Pos;
+	return cd == 0 ? 0 : 16 * cd + 2 * fp;
+}
+
+void USART_Model::reset_statistics()
+{
+	memset(&totals, 0, sizeof(totals));
+}
+
+void USART_Model::reset()
+{
+	mr = brgr = rtor = imr = rhr = thr = 0;
+	rpr = tpr = rnpr = tnpr = 0;
+	rcr = tcr = rncr = tncr = ptsr = 0;
+	rx_enabled = tx_enabled = rx_ready = thr_full = overrun = timeout_flag = false;
+	tx_active = false;
+	busy_until = 0;
+	to_state = timeout_waiting;
+	timeout_at = 0;
+	glitch_countdown = 0;
+	line.clear();
+	reset_statistics();
+}
+
+uint32_t USART_Model::csr() const
+{
+	uint32_t status = 0;
+	if (rx_ready)							status |= US_CSR_RXRDY;
+	if (tx_enabled && !thr_full)			status |= US_CSR_TXRDY;
+	if (rcr == 0)							status |= US_CSR_ENDRX;
+	if (tcr == 0)							status |= US_CSR_ENDTX;
+	if (overrun)							status |= US_CSR_OVRE;
+	if (timeout_flag)						status |= US_CSR_TIMEOUT;
+	if (tx_enabled && !thr_full && !tx_active)	status |= US_CSR_TXEMPTY;
+	if (tcr == 0 && tncr == 0)				status |= US_CSR_TXBUFE;
+	if (rcr == 0 && rncr == 0)				status |= US_CSR_RXBUFF;
+	return status;
+}
+
+bool USART_Model::irq_asserted() const
+{
+	return (csr() & imr) != 0;
+}
+
+uintptr_t USART_Model::read(uint16_t offset)
+{
+	switch (offset)
+	{
+	case MR:	return mr;
+	case IMR:	return imr;
+	case CSR:	return csr();
+	case RHR:	rx_ready = false; return rhr;
+	case BRGR:	return brgr;
+	case RTOR:	return rtor;
+	case RPR:	return rpr;
+	case RCR:	return rcr;
+	case TPR:	return tpr;
+	case TCR:	return tcr;
+	case RNPR:	return rnpr;
+	case RNCR:	return rncr;
+	case TNPR:	return tnpr;
+	case TNCR:	return tncr;
+	case PTSR:	return ptsr;
+	default:	return 0;	// Write-only or not modeled
+	}
+}
+
+void USART_Model::write(uint16_t offset, uintptr_t value)
+{
+	SAM3X_Sim& chip = SAM3X_Sim::instance();
+
+	switch (offset)
+	{
+	case CR:
+		if (value & US_CR_RSTRX)	{ rx_enabled = false; rx_ready = false; overrun = false; }
+		if (value & US_CR_RSTTX)	{ tx_enabled = false; thr_full = false; }	// A byte already on the wire still finishes
+		if (value & US_CR_RXDIS)	rx_enabled = false;
+		else if (value & US_CR_RXEN)	rx_enabled = true;
+		if (value & US_CR_TXDIS)	tx_enabled = false;
+		else if (value & US_CR_TXEN)	tx_enabled = true;
+		if (value & US_CR_RSTSTA)	overrun = false;
+		if (value & US_CR_STTTO)
+		{
+			timeout_flag = false;
+			to_state = timeout_waiting;
+		}
+		if ((value & US_CR_RETTO) && rtor != 0)
+		{
+			to_state = timeout_counting;
+			timeout_at = chip.now() + (uint64_t)rtor * bit_cycles();
+		}
+		break;
+
+	case MR:	mr = value; break;
+	case IER:	imr |= value; break;
+	case IDR:	imr &= ~value; break;
+	case THR:	thr = value & 0xFF; thr_full = true; break;
+	case BRGR:	brgr = value; break;
+
+	case RTOR:
+		rtor = value & US_RTOR_TO_Msk;
+		if (rtor == 0)	// TIMEOUT reads 0 while the timeout is disabled
+		{
+			timeout_flag = false;
+			to_state = timeout_waiting;
+		}
+		break;
+
+	case RPR:	rpr = value; break;
+	case RCR:	rcr = value & 0xFFFF; break;
+	case TPR:	tpr = value; break;
+	case TCR:	tcr = value & 0xFFFF; break;
+	case RNPR:	rnpr = value; break;
+	case RNCR:	rncr = value & 0xFFFF; break;
+	case TNPR:	tnpr = value; break;
+	case TNCR:	tncr = value & 0xFFFF; break;
+
+	case PTCR:
+		if (value & US_PTCR_RXTDIS)		ptsr &= ~US_PTSR_RXTEN;
+		else if (value & US_PTCR_RXTEN)	ptsr |= US_PTSR_RXTEN;
+		if (value & US_PTCR_TXTDIS)		ptsr &= ~US_PTSR_TXTEN;
+		else if (value & US_PTCR_TXTEN)	ptsr |= US_PTSR_TXTEN;
+		break;
+
+	default:
+		break;
+	}
+
+	pump_tx();
+	chip.check_interrupts();
+}
+
+void USART_Model::put_on_line(const line_byte& byte)
+{
+	std::vector<line_byte>::iterator it = line.begin();
+	while (it != line.end() && it->end <= byte.end)
+		++it;
+	line.insert(it, byte);
+}
+
+void USART_Model::pump_tx()
+{
+	if (!tx_enabled || tx_active || bit_cycles() == 0)
+		return;
+
+	// The PDC hands the transmitter one byte at a time, switching to the next buffer when the current one runs out
+	uint8_t value;
+	if ((ptsr & US_PTSR_TXTEN) && tcr > 0)
+	{
+		value = *(const uint8_t*)tpr;
+		++tpr;
+		if (--tcr == 0 && tncr > 0)
+		{
+			tpr = tnpr;
+			tcr = tncr;
+			tncr = 0;
+		}
+	}
+	else if (thr_full)
+	{
+		value = thr;
+		thr_full = false;
+	}
+	else
+		return;
+
+	if (glitch_countdown > 0 && --glitch_countdown == 0)
+		value ^= 0x01;
+
+	tx_active = true;
+	uint64_t now = SAM3X_Sim::instance().now();
+	uint32_t bit = bit_cycles();
+	line_byte byte = { now, now + 10ull * bit, bit, value, -1, false };	// start bit, 8 data bits, stop bit
+	put_on_line(byte);
+}
+
+void USART_Model::receive(uint8_t value, uint64_t end)
+{
+	if (!rx_enabled)
+		return;
+	++totals.bytes_received;
+
+	// Every character reloads the timeout counter
+	if (rtor != 0 && to_state != timeout_expired)
+	{
+		to_state = timeout_counting;
+		timeout_at = end + (uint64_t)rtor * bit_cycles();
+	}
+
+	if ((ptsr & US_PTSR_RXTEN) && rcr > 0)
+	{
+		*(uint8_t*)rpr = value;
+		++rpr;
+		if (--rcr == 0 && rncr > 0)
+		{
+			rpr = rnpr;
+			rcr = rncr;
+			rncr = 0;
+		}
+	}
+	else
+	{
+		if (rx_ready)
+		{
+			overrun = true;
+			++totals.overruns;
+		}
+		rhr = value;
+		rx_ready = true;
+	}
+}
+
+void USART_Model::finish_byte()
+{
+	line_byte byte = line.front();
+	line.erase(line.begin());
+
+	// Anything else on the wire at the same time corrupts both bytes
+	uint8_t sent = byte.value;
+	for (size_t i = 0; i < line.size(); ++i)
+	{
+		line_byte& other = line[i];
+		if (other.start < byte.end && other.end > byte.start)
+		{
+			byte.value &= other.value;
+			other.value &= sent;
+			byte.collided = other.collided = true;
+		}
+	}
+	if (byte.collided)
+		++totals.collisions;
+
+	uint64_t busy_from = byte.start > busy_until ? byte.start : busy_until;
+	if (byte.end > busy_from)
+		totals.busy_cycles += byte.end - busy_from;
+	if (byte.end > busy_until)
+		busy_until = byte.end;
+
+	if (byte.driver < 0)
+	{
+		tx_active = false;
+		++totals.bytes_sent;
+	}
+
+	receive(byte.value, byte.end);	// Our own bytes come back as echo
+
+	// Replies are addressed to the master, the slaves only listen to what we send
+	if (byte.driver < 0)
+	{
+		for (size_t i = 0; i < slaves.size(); ++i)
+		{
+			uint8_t reply[8];
+			uint32_t delay_bits = 0;
+			uint8_t count = slaves[i]->receive(byte.value, byte.start, byte.end, byte.bit_cycles, reply, delay_bits);
+
+			uint64_t start = byte.end + (uint64_t)delay_bits * byte.bit_cycles;
+			for (uint8_t j = 0; j < count; ++j)
+			{
+				line_byte answer = { start, start + 10ull * byte.bit_cycles, byte.bit_cycles, reply[j], (int8_t)i, false };
+				put_on_line(answer);
+				start = answer.end;
+			}
+		}
+	}
+
+	pump_tx();
+}
+
+uint64_t USART_Model::next_event() const
+{
+	uint64_t next = UINT64_MAX;
+	if (!line.empty())
+		next = line.front().end;
+	if (to_state == timeout_counting && timeout_at < next)
+		next = timeout_at;
+	return next;
+}
+
+void USART_Model::advance(uint64_t now)
+{
+	// Bytes first, a character arriving right as the counter runs out reloads it
+	while (!line.empty() && line.front().end <= now)
+		finish_byte();
+
+	if (to_state == timeout_counting && timeout_at <= now)
+	{
+		timeout_flag = true;
+		to_state = timeout_expired;
+		++totals.timeouts;
+	}
+}
+
+
+// ===== SAM3X_Sim ===============================================================================
+SAM3X_Sim& SAM3X_Sim::instance()
+{
+	static SAM3X_Sim chip;
+	return chip;
+}
+
+SAM3X_Sim::SAM3X_Sim()
+{
+	static_assert(sizeof(Usart) <= usart_stride, "SAM3X_Sim: register file doesn't fit its block");
+
+	for (size_t i = 0; i < usart_count; ++i)
+		usarts[i] = new USART_Model(new (usart_space + i * usart_stride) Usart);
+
+	reset();
+}
+
+void SAM3X_Sim::reset()
+{
+	cycles = 0;
+	next_systick = clock_hz / 1000;
+	systick_pending = false;
+	pendsv_pending = false;
+	primask = false;
+	handler_count = 0;
+	storm_cycle = 0;
+	storm_count = 0;
+	running.clear();
+
+	for (int i = 0; i < irq_count; ++i)
+		irq_enabled[i] = false;
+	for (int i = 0; i < irq_count + 2; ++i)
+		priorities[i] = 0;
+	priority_of(systick_irq) = 15;	// The Due core runs SysTick at the lowest priority
+
+	for (size_t i = 0; i < usart_count; ++i)
+		usarts[i]->reset();
+}
+
+void SAM3X_Sim::run_until(uint64_t cycle)
+{
+	if (cycle > cycles)
+		step(cycle);
+}
+
+void SAM3X_Sim::wait_for_interrupt()
+{
+	uint64_t handled = handler_count;
+	while (handler_count == handled && !(primask && any_pending()))
+		step(next_event());
+}
+
+uint64_t SAM3X_Sim::next_event() const
+{
+	uint64_t next = next_systick;
+	for (size_t i = 0; i < usart_count; ++i)
+	{
+		uint64_t event = usarts[i]->next_event();
+		if (event < next)
+			next = event;
+	}
+	return next;
+}
+
+void SAM3X_Sim::step(uint64_t until)
+{
+	uint64_t next;
+	while ((next = next_event()) <= until)
+	{
+		cycles = next;
+		if (next_systick <= cycles)
+		{
+			systick_pending = true;
+			next_systick += clock_hz / 1000;
+		}
+
+		for (size_t i = 0; i < usart_count; ++i)
+			usarts[i]->advance(cycles);
+
+		check_interrupts();
+	}
+
+	if (until > cycles)
+		cycles = until;
+}
+
+void SAM3X_Sim::enable_irq(int irq)
+{
+	if (irq >= 0 && irq < irq_count)
+		irq_enabled[irq] = true;
+	check_interrupts();
+}
+
+void SAM3X_Sim::disable_irq(int irq)
+{
+	if (irq >= 0 && irq < irq_count)
+		irq_enabled[irq] = false;
+}
+
+void SAM3X_Sim::set_priority(int irq, uint32_t priority)
+{
+	if (irq >= pendsv_irq && irq < irq_count)
+		priority_of(irq) = priority > 15 ? 15 : priority;	// 4 priority bits
+}
+
+uint32_t SAM3X_Sim::get_priority(int irq) const
+{
+	return (irq >= pendsv_irq && irq < irq_count) ? priority_of(irq) : 0;
+}
+
+void SAM3X_Sim::enable_interrupts()
+{
+	primask = false;
+	check_interrupts();
+}
+
+void SAM3X_Sim::set_pendsv()
+{
+	pendsv_pending = true;
+	check_interrupts();
+}
+
+bool SAM3X_Sim::pending(int irq) const
+{
+	if (irq == pendsv_irq)
+		return pendsv_pending;
+	if (irq == systick_irq)
+		return systick_pending;
+
+	int usart = irq - usart0_irq;
+	if (usart >= 0 && usart < (int)usart_count)
+		return irq_enabled[irq] && usarts[usart]->irq_asserted();
+
+	return false;
+}
+
+bool SAM3X_Sim::any_pending() const
+{
+	if (pending(pendsv_irq) || pending(systick_irq))
+		return true;
+	for (int i = 0; i < (int)usart_count; ++i)
+		if (pending(usart0_irq + i))
+			return true;
+	return false;
+}
+
+void SAM3X_Sim::check_interrupts()
+{
+	for (;;)
+	{
+		if (primask)
+			return;
+
+		// Only a higher priority (lower number) can preempt the running handler, ties go to the lower exception number
+		uint8_t current = running.empty() ? 0xFF : running.back();
+		int selected = 0;
+		uint8_t selected_priority = current;
+
+		if (pending(pendsv_irq) && priority_of(pendsv_irq) < selected_priority)
+		{
+			selected = pendsv_irq;
+			selected_priority = priority_of(pendsv_irq);
+		}
+		if (pending(systick_irq) && priority_of(systick_irq) < selected_priority)
+		{
+			selected = systick_irq;
+			selected_priority = priority_of(systick_irq);
+		}
+		for (int i = 0; i < (int)usart_count; ++i)
+		{
+			int irq = usart0_irq + i;
+			if (pending(irq) && priority_of(irq) < selected_priority)
+			{
+				selected = irq;
+				selected_priority = priority_of(irq);
+			}
+		}
+
+		if (selected_priority == current)
+			return;
+
+		// A level triggered interrupt its handler doesn't clear would hang the chip, stop the host program instead
+		if (cycles != storm_cycle)
+		{
+			storm_cycle = cycles;
+			storm_count = 0;
+		}
+		if (++storm_count > 100000)
+		{
+			fprintf(stderr, "SAM3X_Sim: interrupt %d is never cleared by its handler\n", selected);
+			abort();
+		}
+
+		running.push_back(selected_priority);
+		++handler_count;
+		if (selected == pendsv_irq)
+		{
+			pendsv_pending = false;
+			pendSVHook();
+		}
+		else if (selected == systick_irq)
+		{
+			systick_pending = false;
+			sysTickHook();
+		}
+		else
+			usart_handlers[selected - usart0_irq]();
+		running.pop_back();
+	}
+}
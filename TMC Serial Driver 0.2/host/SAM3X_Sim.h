@@ -0,0 +1,231 @@
+#pragma once
+#define SAM3X_SIM	// Lets shared code tell the simulator from the chip
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Cycle-approximate model of the parts of the SAM3X8E the driver talks to: the four USARTs with
+//    their PDC channels, the NVIC, SysTick and PendSV. Time only moves when the host program lets it
+//    (run_for(), run_until(), delay(), __WFI()), code in between runs in zero time. Transfers are
+//    timed in bit periods of the configured baudrate, so throughput and latency numbers match the
+//    wire, not the host CPU.
+
+class USART_Model;
+class TMC2209_Model;
+
+// A peripheral register, reads and writes are forwarded to the model that owns it
+class Sim_Register
+{
+	USART_Model* owner;
+	uint16_t offset;		// Byte offset of the register in the peripheral (as in the datasheet)
+
+public:
+	void bind(USART_Model* Owner, uint16_t Offset);
+
+	Sim_Register& operator=(uintptr_t value);
+	Sim_Register& operator=(const Sim_Register& other) { return *this = (uintptr_t)other; }
+	Sim_Register& operator|=(uintptr_t value) { return *this = (uintptr_t)*this | value; }
+	Sim_Register& operator&=(uintptr_t value) { return *this = (uintptr_t)*this & value; }
+	operator uintptr_t() const;
+};
+
+
+// The register file of a USART, laid out like CMSIS' 'Usart' (the reserved gaps are left out)
+struct Usart {
+	Sim_Register US_CR, US_MR, US_IER, US_IDR, US_IMR, US_CSR, US_RHR, US_THR, US_BRGR, US_RTOR, US_TTGR;
+	Sim_Register US_FIDI, US_NER, US_IF, US_MAN, US_WPMR, US_WPSR;
+	Sim_Register US_RPR, US_RCR, US_TPR, US_TCR, US_RNPR, US_RNCR, US_TNPR, US_TNCR, US_PTCR, US_PTSR;
+};
+
+
+// A USART in asynchronous 8N1 mode, its PDC channel and the single-wire bus it drives
+//    The TX and RX pins are tied together like on a TMC2209 UART line, so every byte the USART
+//    sends is echoed back into its receiver, and the attached slaves answer on the same wire.
+class USART_Model
+{
+public:
+	// Totals since the last 'reset_statistics()'
+	struct statistics {
+		uint64_t bytes_sent;			// Bytes the USART transmitted
+		uint64_t bytes_received;		// Bytes the USART received (echo included)
+		uint64_t busy_cycles;			// Cycles the wire was carrying a byte
+		uint64_t collisions;			// Bytes that were corrupted because two nodes drove the wire at once
+		uint64_t overruns;				// Bytes lost because RHR wasn't read in time
+		uint64_t timeouts;				// Receiver timeouts that fired
+	};
+
+	USART_Model(Usart* Registers);
+
+	// Connects a slave to the wire, any number of slaves can share it
+	void attach(TMC2209_Model& slave);
+
+	// Disconnects every slave
+	void detach_all();
+
+	// Returns the register file the driver writes to
+	Usart* registers() const { return regs; }
+
+	// Returns the length of a bit at the current baudrate in clock cycles
+	uint32_t bit_cycles() const;
+
+	const statistics& stats() const { return totals; }
+	void reset_statistics();
+
+	// Puts the peripheral back into its reset state, the attached slaves stay connected
+	void reset();
+
+	// Flips the lowest bit of the 'bytes_ahead'-th byte the USART sends from now on (1 is the next one),
+	//    the slaves and the echo both see the glitched byte
+	void inject_glitch(uint32_t bytes_ahead) { glitch_countdown = bytes_ahead; }
+
+	// ===== Used by Sim_Register and SAM3X_Sim ===============================================================================
+	uintptr_t read(uint16_t offset);
+	void write(uint16_t offset, uintptr_t value);
+
+	// Returns the time of the next thing that happens on its own (a byte finishing, the timeout firing), UINT64_MAX if none
+	uint64_t next_event() const;
+
+	// Handles everything that happens at 'now'
+	void advance(uint64_t now);
+
+	// Returns whether the interrupt line is asserted (US_CSR & US_IMR)
+	bool irq_asserted() const;
+
+private:
+	// A byte on the wire, [start, end) in clock cycles
+	struct line_byte {
+		uint64_t start;
+		uint64_t end;
+		uint32_t bit_cycles;		// The bit length it was sent with
+		uint8_t value;				// What receivers see, collisions pull bits low (wired AND)
+		int8_t driver;				// -1: this USART, otherwise the index of the slave in 'slaves'
+		bool collided;				// Another node drove the wire while this byte was on it
+	};
+
+	enum timeout_state {
+		timeout_waiting,			// Waiting for a character to start counting (after reset/STTTO)
+		timeout_counting,			// Counting down to 'timeout_at'
+		timeout_expired				// TIMEOUT fired, stopped until STTTO/RETTO
+	};
+
+	Usart* regs;
+	std::vector<TMC2209_Model*> slaves;
+	std::vector<line_byte> line;	// Bytes on the wire or scheduled to be, in order of their end
+
+	// Register state
+	uint32_t mr, brgr, rtor, imr, rhr, thr;
+	uintptr_t rpr, tpr, rnpr, tnpr;
+	uint32_t rcr, tcr, rncr, tncr, ptsr;
+	bool rx_enabled, tx_enabled, rx_ready, thr_full, overrun, timeout_flag;
+	bool tx_active;					// A byte of ours is on the wire
+	uint64_t busy_until;			// End of the last byte counted in 'busy_cycles'
+	timeout_state to_state;
+	uint64_t timeout_at;
+	uint32_t glitch_countdown;		// Bytes to send until the glitched one, 0 if none is injected
+
+	statistics totals;
+
+	uint32_t csr() const;
+	void put_on_line(const line_byte& byte);
+	void pump_tx();
+	void receive(uint8_t value, uint64_t end);
+	void finish_byte();
+};
+
+
+class SAM3X_Sim
+{
+public:
+	static const uint32_t clock_hz = 84000000;		// Master clock
+	static const uint32_t usart_count = 4;
+	static const uintptr_t usart_stride = 0x4000;	// Distance between the USART register blocks, as on the chip
+	static const int pendsv_irq = -2;
+	static const int systick_irq = -1;
+	static const int usart0_irq = 17;
+
+	// Returns the simulated chip, it's created on first use so it exists before any global driver object
+	static SAM3X_Sim& instance();
+
+	// Returns a USART's model/register file
+	USART_Model& usart(size_t index) { return *usarts[index]; }
+	Usart* usart_registers(size_t index) { return usarts[index]->registers(); }
+
+	// Returns the current time in clock cycles
+	uint64_t now() const { return cycles; }
+
+	// Lets time pass, handling transfers and interrupts as they happen
+	void run_until(uint64_t cycle);
+	void run_for(uint64_t duration) { run_until(cycles + duration); }
+
+	// Lets time pass until 'done()' returns true, or 'timeout' cycles passed
+	//    returns false on timeout
+	template<typename _Pred>
+	bool run_until(_Pred done, uint64_t timeout);
+
+	// Lets time pass until an interrupt has been taken (or is pending while interrupts are disabled), like WFI
+	void wait_for_interrupt();
+
+	// Returns the number of interrupt handlers that have run
+	uint64_t handlers_run() const { return handler_count; }
+
+	// Puts time, the NVIC and every USART back into their reset state
+	void reset();
+
+	// ===== NVIC and PRIMASK ===============================================================================
+	void enable_irq(int irq);
+	void disable_irq(int irq);
+	void set_priority(int irq, uint32_t priority);
+	uint32_t get_priority(int irq) const;
+	void disable_interrupts() { primask = true; }
+	void enable_interrupts();
+	bool interrupts_disabled() const { return primask; }
+	void set_pendsv();
+	bool pendsv_set() const { return pendsv_pending; }
+	bool in_handler() const { return !running.empty(); }
+
+	// Takes any pending interrupt that may preempt the running code, called whenever that may have changed
+	void check_interrupts();
+
+private:
+	SAM3X_Sim();
+
+	static const int irq_count = 45;
+
+	alignas(16) uint8_t usart_space[usart_count * usart_stride];	// The register blocks
+	USART_Model* usarts[usart_count];
+
+	uint64_t cycles;
+	uint64_t next_systick;
+	bool systick_pending;
+	bool pendsv_pending;
+	bool primask;
+	bool irq_enabled[irq_count];
+	uint8_t priorities[irq_count + 2];				// [0] is PendSV, [1] SysTick
+	std::vector<uint8_t> running;					// Priorities of the handlers currently running
+	uint64_t handler_count;
+	uint64_t storm_cycle;							// Detects handlers that never clear their interrupt
+	uint32_t storm_count;
+
+	uint64_t next_event() const;
+	void step(uint64_t until);
+	bool pending(int irq) const;
+	uint8_t& priority_of(int irq) { return priorities[irq + 2]; }
+	uint8_t priority_of(int irq) const { return priorities[irq + 2]; }
+	bool any_pending() const;
+};
+
+
+template<typename _Pred>
+bool SAM3X_Sim::run_until(_Pred done, uint64_t timeout)
+{
+	uint64_t deadline = cycles + timeout;
+	while (!done())
+	{
+		if (cycles >= deadline)
+			return false;
+
+		uint64_t next = next_event();
+		step(next < deadline ? next : deadline);
+	}
+	return true;
+}
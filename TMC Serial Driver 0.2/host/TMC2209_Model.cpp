@@ -0,0 +1,206 @@
+#include "TMC2209_Model.h"
+#include "SAM3X_Sim.h"
+#include <string.h>
+
+// Register addresses the model treats specially (datasheet 5)
+static const uint8_t GCONF = 0x00, GSTAT = 0x01, IFCNT = 0x02, SLAVECONF = 0x03, IOIN = 0x06;
+static const uint8_t IHOLD_IRUN = 0x10, TPOWERDOWN = 0x11, CHOPCONF = 0x6C, PWMCONF = 0x70;
+
+TMC2209_Model::TMC2209_Model(uint8_t s_address) :
+	slave_address(s_address),
+	received(0),
+	last_end(0),
+	crc_errors_left(0),
+	timeouts_left(0),
+	lost_writes_left(0),
+	crc_error_threshold(0),
+	timeout_threshold(0),
+	random_state(1)
+{
+	set_baud_limits(9600, 500000);
+	power_cycle();
+	reset_statistics();
+}
+
+uint32_t TMC2209_Model::send_delay_bits() const
+{
+	// SENDDELAY 0/1: 8 bit times, 2/3: 3*8, 4/5: 5*8 ... 14/15: 15*8
+	uint32_t send_delay = (registers[SLAVECONF] >> 8) & 0x0F;
+	return 8 * (send_delay | 1);
+}
+
+void TMC2209_Model::set_baud_limits(uint32_t min_baud, uint32_t max_baud)
+{
+	min_bit_cycles = SAM3X_Sim::clock_hz / max_baud;
+	max_bit_cycles = SAM3X_Sim::clock_hz / min_baud;
+}
+
+void TMC2209_Model::power_cycle()
+{
+	memset(registers, 0, sizeof(registers));
+	memset(writes_per_register, 0, sizeof(writes_per_register));
+
+	registers[GCONF]		= 0x00000101;	// I_scale_analog, multistep_filt
+	registers[GSTAT]		= 0x00000001;	// reset
+	registers[IOIN]			= 0x21000040;	// VERSION 0x21, PDN_UART high
+	registers[IHOLD_IRUN]	= 0x00011F10;
+	registers[TPOWERDOWN]	= 20;
+	registers[CHOPCONF]		= 0x10000053;
+	registers[PWMCONF]		= 0xC10D0024;
+
+	received = 0;
+}
+
+void TMC2209_Model::set_fault_rates(double crc_error_rate, double timeout_rate, uint32_t seed)
+{
+	crc_error_threshold = (uint32_t)(crc_error_rate * 4294967295.0);
+	timeout_threshold = (uint32_t)(timeout_rate * 4294967295.0);
+	random_state = seed != 0 ? seed : 1;
+}
+
+void TMC2209_Model::reset_statistics()
+{
+	memset(&totals, 0, sizeof(totals));
+}
+
+uint32_t TMC2209_Model::next_random()
+{
+	// xorshift32
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+bool TMC2209_Model::readable(uint8_t r_address) const
+{
+	switch (r_address)
+	{
+	case 0x00: case 0x01: case 0x02: case 0x05: case 0x06: case 0x07:	// GCONF, GSTAT, IFCNT, OTP_READ, IOIN, FACTORY_CONF
+	case 0x12: case 0x41: case 0x6A: case 0x6B: case 0x6C:				// TSTEP, SG_RESULT, MSCNT, MSCURACT, CHOPCONF
+	case 0x6F: case 0x70: case 0x71: case 0x72:							// DRV_STATUS, PWMCONF, PWM_SCALE, PWM_AUTO
+		return true;
+	default:
+		return false;
+	}
+}
+
+void TMC2209_Model::write_register(uint8_t r_address, uint32_t value)
+{
+	switch (r_address)
+	{
+	case GSTAT:		// Flags are cleared by writing 1
+		registers[GSTAT] &= ~value;
+		break;
+	case IFCNT:
+	case IOIN:		// Read only
+		break;
+	default:
+		registers[r_address] = value;
+		break;
+	}
+}
+
+uint8_t TMC2209_Model::answer(uint8_t r_address, uint8_t* reply)
+{
+	uint32_t value = readable(r_address) ? registers[r_address] : 0;
+
+	reply[0] = 0x05;
+	reply[1] = 0xFF;	// Replies are addressed to the master
+	reply[2] = r_address;
+	reply[3] = value >> 24;
+	reply[4] = value >> 16;
+	reply[5] = value >> 8;
+	reply[6] = value;
+	reply[7] = datasheet_crc(reply, 8);
+
+	if (crc_errors_left > 0 || (crc_error_threshold != 0 && next_random() < crc_error_threshold))
+	{
+		if (crc_errors_left > 0)
+			--crc_errors_left;
+		reply[6] ^= 0x01;	// The data is wrong, not just the CRC
+		++totals.corrupted_replies;
+	}
+	return 8;
+}
+
+uint8_t TMC2209_Model::receive(uint8_t byte, uint64_t start, uint64_t end, uint32_t bit_cycles, uint8_t* reply, uint32_t& delay_bits)
+{
+	// The interface drops a half received datagram after a pause of more than 63 bit times
+	if (received > 0 && start - last_end > 63ull * bit_cycles)
+		received = 0;
+	last_end = end;
+
+	if (received == 0)
+	{
+		// The sync nibble (1010) is what the baudrate is measured from
+		if ((byte & 0x0F) != 0x05 || bit_cycles < min_bit_cycles || bit_cycles > max_bit_cycles)
+		{
+			++totals.bad_datagrams;
+			return 0;
+		}
+	}
+
+	datagram[received++] = byte;
+	uint8_t length = (received >= 3 && !(datagram[2] & 0x80)) ? 4 : 8;
+	if (received < length)
+		return 0;
+
+	received = 0;
+	if (datasheet_crc(datagram, length) != datagram[length - 1])
+	{
+		++totals.bad_datagrams;
+		return 0;
+	}
+
+	if (datagram[1] != slave_address)
+		return 0;
+
+	uint8_t r_address = datagram[2] & 0x7F;
+	if (length == 8)	// write access
+	{
+		if (lost_writes_left > 0)
+		{
+			--lost_writes_left;
+			++totals.lost_writes;
+			return 0;
+		}
+
+		write_register(r_address, ((uint32_t)datagram[3] << 24) | ((uint32_t)datagram[4] << 16) | ((uint32_t)datagram[5] << 8) | datagram[6]);
+		registers[IFCNT] = (registers[IFCNT] + 1) & 0xFF;
+		++writes_per_register[r_address];
+		++totals.writes;
+		return 0;
+	}
+
+	// read access
+	++totals.reads;
+	if (timeouts_left > 0 || (timeout_threshold != 0 && next_random() < timeout_threshold))
+	{
+		if (timeouts_left > 0)
+			--timeouts_left;
+		++totals.dropped_replies;
+		return 0;
+	}
+
+	delay_bits = send_delay_bits();
+	return answer(r_address, reply);
+}
+
+uint8_t TMC2209_Model::datasheet_crc(const uint8_t* datagram, uint8_t datagram_length)
+{
+	uint8_t crc = 0;
+	for (uint8_t i = 0; i + 1 < datagram_length; ++i)
+	{
+		uint8_t byte = datagram[i];
+		for (uint8_t j = 0; j < 8; ++j)
+		{
+			if ((crc >> 7) ^ (byte & 0x01))
+				crc = (crc << 1) ^ 0x07;
+			else
+				crc = crc << 1;
+			byte = byte >> 1;
+		}
+	}
+	return crc;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <stdint.h>
+
+// Behavioral model of a TMC2209's UART interface
+//    Parses datagrams off the wire, checks their CRC, stores written registers, counts writes in
+//    IFCNT and answers reads after the SENDDELAY set in SLAVECONF. Faults can be injected to
+//    exercise the driver's error paths: corrupted replies (CRC error), missing replies (timeout)
+//    and writes that get lost without IFCNT counting them.
+class TMC2209_Model
+{
+public:
+	// Totals since the last 'reset_statistics()'
+	struct statistics {
+		uint32_t reads;					// Read requests addressed to this slave
+		uint32_t writes;				// Write requests addressed to this slave that were accepted
+		uint32_t bad_datagrams;			// Datagrams dropped for a bad CRC, bad sync or an unsupported baudrate
+		uint32_t corrupted_replies;		// Replies sent with a wrong CRC (injected)
+		uint32_t dropped_replies;		// Reads left unanswered (injected)
+		uint32_t lost_writes;			// Writes dropped without counting them (injected)
+	};
+
+	// s_address: The slave address selected by the MS1/MS2 pins (0 - 3)
+	TMC2209_Model(uint8_t s_address);
+
+	uint8_t address() const { return slave_address; }
+
+	// Returns/sets a register as the chip holds it, 'set_register()' is for read-only
+	//    registers like DRV_STATUS or SG_RESULT and doesn't count as a UART write
+	uint32_t get_register(uint8_t r_address) const { return registers[r_address & 0x7F]; }
+	void set_register(uint8_t r_address, uint32_t value) { registers[r_address & 0x7F] = value; }
+
+	// Returns how many accepted writes each register has received
+	uint32_t write_count(uint8_t r_address) const { return writes_per_register[r_address & 0x7F]; }
+
+	// Returns the number of bit times between the end of a read request and the reply
+	uint32_t send_delay_bits() const;
+
+	// Sets the range of baudrates the interface can follow, datagrams outside of it are garbage to the chip
+	void set_baud_limits(uint32_t min_baud, uint32_t max_baud);
+
+	// Puts every register back to its power-on value, like a power cycle or a reset through the EN pin
+	void power_cycle();
+
+	// ===== Fault injection ===============================================================================
+	void inject_crc_errors(uint32_t count) { crc_errors_left = count; }		// Corrupts the next 'count' replies
+	void inject_timeouts(uint32_t count) { timeouts_left = count; }			// Leaves the next 'count' reads unanswered
+	void inject_lost_writes(uint32_t count) { lost_writes_left = count; }	// Drops the next 'count' writes
+
+	// Corrupts/drops replies at random
+	//	crc_error_rate, timeout_rate: Probability (0 - 1) of a reply being corrupted/dropped
+	//	seed: Seed for the random sequence, the same seed gives the same faults
+	void set_fault_rates(double crc_error_rate, double timeout_rate, uint32_t seed = 1);
+
+	const statistics& stats() const { return totals; }
+	void reset_statistics();
+
+	// ===== Used by USART_Model ===============================================================================
+	// Hands the model a byte it saw on the wire
+	//	byte: The byte
+	//	start, end: When the byte started/ended, in clock cycles
+	//	bit_cycles: The length of a bit in clock cycles
+	//	reply: Where to store a reply datagram (8 bytes)
+	//	delay_bits: Where to store the bit times to wait between 'end' and the reply
+	//	returns the number of reply bytes, 0 if the slave doesn't answer
+	uint8_t receive(uint8_t byte, uint64_t start, uint64_t end, uint32_t bit_cycles, uint8_t* reply, uint32_t& delay_bits);
+
+private:
+	uint8_t slave_address;
+	uint32_t registers[128];
+	uint32_t writes_per_register[128];
+
+	uint8_t datagram[8];			// The datagram being received
+	uint8_t received;				// Bytes of it received so far
+	uint64_t last_end;				// End of the last byte received
+
+	uint32_t min_bit_cycles, max_bit_cycles;
+
+	uint32_t crc_errors_left, timeouts_left, lost_writes_left;
+	uint32_t crc_error_threshold, timeout_threshold;	// Rates scaled to 2^32
+	uint32_t random_state;
+
+	statistics totals;
+
+	uint32_t next_random();
+	bool readable(uint8_t r_address) const;
+	void write_register(uint8_t r_address, uint32_t value);
+	uint8_t answer(uint8_t r_address, uint8_t* reply);
+
+	// The CRC routine from the datasheet (4.2), kept separate from TMC_CRC so the model checks the driver independently
+	static uint8_t datasheet_crc(const uint8_t* datagram, uint8_t datagram_length);
+};
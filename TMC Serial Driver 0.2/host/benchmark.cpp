@@ -0,0 +1,51 @@
+/*
+ Name:		benchmark.cpp
+ Runs TMC_Benchmark against the simulator: four TMC2209 models on each USART at 460800 baud.
+ Prints the JSON report, the exit code is 0 if every ticket completed successfully and every
+ scenario put back the registers it wrote.
+
+ Build (from this folder):
+	g++ -O2 -std=c++11 -DTMC_SERIAL_STATS -I. -I.. benchmark.cpp SAM3X_Sim.cpp TMC2209_Model.cpp ../TMC_Benchmark.cpp ../TMC_Serial.cpp ../TMC_CRC.cpp -o benchmark
+ Usage:
+	benchmark [transactions per scenario]
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include "Arduino.h"
+#include "TMC2209_Model.h"
+#include "TMC_Benchmark.h"
+
+int main(int argc, char** argv)
+{
+	uint32_t transactions = argc > 1 ? std::atoi(argv[1]) : 512;
+
+	SAM3X_Sim& sim = SAM3X_Sim::instance();
+	TMC2209_Model drivers[] = {
+		TMC2209_Model(0), TMC2209_Model(1), TMC2209_Model(2), TMC2209_Model(3),
+		TMC2209_Model(0), TMC2209_Model(1), TMC2209_Model(2), TMC2209_Model(3),
+		TMC2209_Model(0), TMC2209_Model(1), TMC2209_Model(2), TMC2209_Model(3),
+		TMC2209_Model(0), TMC2209_Model(1), TMC2209_Model(2), TMC2209_Model(3) };
+	for (int i = 0; i < 16; ++i)
+		sim.usart(i / 4).attach(drivers[i]);
+
+	TMC_Serial usart0(USART0, 460800), usart1(USART1, 460800), usart2(USART2, 460800), usart3(USART3, 460800);
+	TMC_Serial* buses[] = { &usart0, &usart1, &usart2, &usart3 };
+
+	// A configured TPWMTHRS, the scenarios have to write it back
+	for (int i = 0; i < 16; ++i)
+		buses[i / 4]->write(i % 4, TMC_Serial::TPWMTHRS, 200);
+	sim.run_for(SAM3X_Sim::clock_hz / 100);
+
+	TMC_Benchmark benchmark(buses, 4, 4, [](const char* text) { std::fputs(text, stdout); });
+	bool passed = benchmark.run(transactions);
+
+	for (int i = 0; i < 16; ++i)
+		if (drivers[i].get_register(TMC_Serial::VACTUAL) != 0 || drivers[i].get_register(TMC_Serial::TPWMTHRS) != 200)
+		{
+			std::fprintf(stderr, "USART%d slave %d left at VACTUAL %u, TPWMTHRS %u\n", i / 4, i % 4,
+				drivers[i].get_register(TMC_Serial::VACTUAL), drivers[i].get_register(TMC_Serial::TPWMTHRS));
+			passed = false;
+		}
+	return passed ? 0 : 1;
+}
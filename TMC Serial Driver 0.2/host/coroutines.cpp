@@ -0,0 +1,114 @@
+/*
+ Name:		coroutines.cpp
+ Drives hundreds of register conversations at once from one thread with C++20 coroutines and
+ TMC_Future: every conversation reads IFCNT, writes TPWMTHRS and reads IFCNT again, over and over,
+ on one of sixteen TMC2209 models spread over the four USARTs. There are more conversations than
+ tickets, the ones that don't get a ticket wait in TMC_Future::poll(). Each conversation checks its
+ write was counted, each model is checked for the number of writes it accepted. Then get() has to
+ return with every ticket waiting for dispatch(), and for a slave address that doesn't exist. Prints
+ OK if everything matched.
+
+ Build (from this folder):
+	g++ -O2 -std=c++20 -DTMC_COMPLETION_DEPTH=128 -I. -I.. coroutines.cpp SAM3X_Sim.cpp TMC2209_Model.cpp ../TMC_Future.cpp ../TMC_Serial.cpp ../TMC_CRC.cpp -o coroutines
+ Usage:
+	coroutines [conversations] [rounds per conversation]
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include "Arduino.h"
+#include "TMC2209_Model.h"
+#include "TMC_Future.h"
+
+static SAM3X_Sim& sim = SAM3X_Sim::instance();
+static uint32_t finished, failed;
+
+// A coroutine that starts right away and cleans up after itself, nobody waits on it
+struct conversation {
+	struct promise_type {
+		conversation get_return_object() { return conversation(); }
+		std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+		std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+static conversation talk(TMC_Serial& bus, uint8_t slave, uint32_t id, uint32_t rounds)
+{
+	for (uint32_t r = 0; r < rounds; ++r)
+	{
+		TMC_Future::result before = co_await TMC_Future::read(bus, slave, TMC_Serial::IFCNT);
+		TMC_Future::result written = co_await TMC_Future::write(bus, slave, TMC_Serial::TPWMTHRS, (id << 16) | r);
+		TMC_Future::result after = co_await TMC_Future::read(bus, slave, TMC_Serial::IFCNT);
+
+		// Others write the same driver in between, but our own write must have moved the counter
+		if (!before.ok() || !written.ok() || !after.ok() || ((after.value - before.value) & 0xFF) == 0)
+			++failed;
+	}
+	++finished;
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t conversations = argc > 1 ? std::atoi(argv[1]) : 256;
+	const uint32_t rounds = argc > 2 ? std::atoi(argv[2]) : 8;
+
+	TMC2209_Model drivers[] = {
+		TMC2209_Model(0), TMC2209_Model(1), TMC2209_Model(2), TMC2209_Model(3),
+		TMC2209_Model(0), TMC2209_Model(1), TMC2209_Model(2), TMC2209_Model(3),
+		TMC2209_Model(0), TMC2209_Model(1), TMC2209_Model(2), TMC2209_Model(3),
+		TMC2209_Model(0), TMC2209_Model(1), TMC2209_Model(2), TMC2209_Model(3) };
+	for (int i = 0; i < 16; ++i)
+		sim.usart(i / 4).attach(drivers[i]);
+
+	TMC_Serial usart0(USART0, 460800), usart1(USART1, 460800), usart2(USART2, 460800), usart3(USART3, 460800);
+	TMC_Serial* buses[] = { &usart0, &usart1, &usart2, &usart3 };
+
+	// The coroutines resume from poll() below instead of inside USART_Handler
+	for (TMC_Serial* bus : buses)
+		bus->set_completion_mode(TMC_Serial::polled);
+
+	uint64_t start = sim.now();
+	for (uint32_t i = 0; i < conversations; ++i)
+		talk(*buses[i % 4], (i / 4) % 4, i, rounds);
+
+	while (finished < conversations && sim.now() - start < 10 * SAM3X_Sim::clock_hz)
+	{
+		__WFI();
+		TMC_Future::poll();
+	}
+	uint64_t elapsed = sim.now() - start;
+
+	// Conversation i talks to drivers[(i % 4) * 4 + (i / 4) % 4]
+	unsigned mismatches = 0;
+	for (int d = 0; d < 16; ++d)
+	{
+		uint32_t expected = 0;
+		for (uint32_t i = 0; i < conversations; ++i)
+			expected += (i % 4) * 4 + (i / 4) % 4 == (uint32_t)d ? rounds : 0;
+		if (drivers[d].write_count(TMC_Serial::TPWMTHRS) != expected)
+		{
+			std::printf("driver %2d: %u writes, expected %u\n", d, drivers[d].write_count(TMC_Serial::TPWMTHRS), expected);
+			++mismatches;
+		}
+	}
+
+	std::printf("%u of %u conversations finished %u rounds in %.2f ms, %u failed, %u drivers mismatched\n",
+		(unsigned)finished, (unsigned)conversations, (unsigned)rounds, elapsed * 1e3 / SAM3X_Sim::clock_hz, (unsigned)failed, mismatches);
+
+	// Every ticket of the pool completed and waits for dispatch(), get() has to dispatch to get one
+	uint32_t held = 0;
+	while (usart0.read(0, TMC_Serial::IFCNT, [](volatile TMC_Serial::access_ticket* ticket, void*) { delete ticket; }) != nullptr)
+		++held;
+	sim.run_for(SAM3X_Sim::clock_hz / 10);
+	TMC_Future::result crowded = TMC_Future::read(usart0, 0, TMC_Serial::IFCNT).get();
+	TMC_Future::result nowhere = TMC_Future::write(usart0, 4, TMC_Serial::TPWMTHRS, 0).get();
+	std::printf("read with %u tickets waiting for dispatch(): status %u, write to slave 4: status 0x%X\n",
+		(unsigned)held, crowded.status, nowhere.status);
+
+	bool passed = finished == conversations && failed == 0 && mismatches == 0 && crowded.ok() && nowhere.status == TMC_Future::invalid_address;
+	std::printf(passed ? "OK\n" : "FAILED\n");
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+/*
+ Name:		crc_benchmark.cpp
+ Host benchmark for TMC_CRC, compares the table driven engine against the original bit-serial routine.
+
+ Build (from this folder):
+	g++ -O2 -std=c++11 -I.. crc_benchmark.cpp ../TMC_CRC.cpp -o crc_benchmark
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "TMC_CRC.h"
+
+// The bit-serial routine TMC_Serial::calc_CRC used before TMC_CRC (datasheet 4.2), minus the 8 byte overread
+static uint8_t bit_serial_crc(const uint8_t* datagram, uint8_t datagram_length)
+{
+	uint8_t crc = 0;
+	for (uint8_t i = 0; i + 1 < datagram_length; ++i)
+	{
+		uint8_t byte = datagram[i];
+		for (uint8_t j = 0; j < 8; ++j)
+		{
+			if ((crc >> 7) ^ (byte & 0x01))
+				crc = (crc << 1) ^ 0x07;
+			else
+				crc = crc << 1;
+			byte = byte >> 1;
+		}
+	}
+	return crc;
+}
+
+// Reference datagrams, CRC byte included
+static const uint8_t reference[][8] = {
+	{ 0x05, 0x00, 0x00, 0x48 },								// read GCONF, slave 0
+	{ 0x05, 0x00, 0x02, 0x8F },								// read IFCNT, slave 0
+	{ 0x05, 0x00, 0x06, 0x6F },								// read IOIN, slave 0
+	{ 0x05, 0x00, 0x80, 0x00, 0x00, 0x00, 0x84, 0x00 },		// write GCONF = 0x84, slave 0 (CRC checked against the bit-serial routine)
+};
+
+static unsigned failures = 0;
+
+static void check(const char* what, uint8_t expected, uint8_t actual)
+{
+	if (expected != actual)
+	{
+		std::printf("FAIL %s: expected 0x%02X, got 0x%02X\n", what, expected, actual);
+		++failures;
+	}
+}
+
+template<typename _F>
+static double time_ns_per_datagram(_F&& crc, const uint8_t* datagrams, size_t count, uint8_t length, unsigned rounds, unsigned& sink)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned r = 0; r < rounds; ++r)
+		for (size_t i = 0; i < count; ++i)
+			sink += crc(datagrams + i * length, length);
+	auto stop = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(stop - start).count() / ((double)rounds * count);
+}
+
+int main()
+{
+	// ===== Correctness ===============================================================================
+	check("read GCONF", reference[0][3], TMC_CRC::calc(reference[0], 4));
+	check("read IFCNT", reference[1][3], TMC_CRC::calc(reference[1], 4));
+	check("read IOIN", reference[2][3], TMC_CRC::calc(reference[2], 4));
+	check("write GCONF", bit_serial_crc(reference[3], 8), TMC_CRC::write_crc(0, 0x00, 0x84));
+
+	// Every header + a spread of data values against the bit-serial routine
+	for (unsigned s = 0; s < 256; s += 3)
+	{
+		for (unsigned r = 0; r < 128; ++r)
+		{
+			uint32_t data = (s * 2654435761u) ^ (r << 9);
+			const uint8_t read[4] = { TMC_CRC::sync_byte, (uint8_t)s, (uint8_t)r, 0 };
+			const uint8_t write[8] = { TMC_CRC::sync_byte, (uint8_t)s, (uint8_t)(r | TMC_CRC::write_bit),
+				(uint8_t)(data >> 24), (uint8_t)(data >> 16), (uint8_t)(data >> 8), (uint8_t)data, 0 };
+
+			check("read", bit_serial_crc(read, 4), TMC_CRC::calc(read, 4));
+			check("write", bit_serial_crc(write, 8), TMC_CRC::calc(write, 8));
+			check("write_crc", bit_serial_crc(write, 8), TMC_CRC::write_crc(s, r, data));
+		}
+	}
+
+	// Batch validation, corrupt every 5th datagram
+	const size_t batch = 32;
+	uint8_t datagrams[batch * 8];
+	for (size_t i = 0; i < batch; ++i)
+	{
+		uint8_t* d = datagrams + i * 8;
+		d[0] = TMC_CRC::sync_byte; d[1] = 0xFF; d[2] = (uint8_t)i; d[3] = (uint8_t)(i * 7);
+		d[4] = 0; d[5] = (uint8_t)(i >> 1); d[6] = 0xA5;
+		d[7] = bit_serial_crc(d, 8) ^ (i % 5 == 0 ? 0x01 : 0x00);
+	}
+	uint32_t failed_mask = 0;
+	size_t valid = TMC_CRC::validate(datagrams, batch, 8, &failed_mask);
+	check("batch valid count", batch - 7, (uint8_t)valid);
+	check("batch failed mask", 0x21, failed_mask & 0xFF);
+
+	// ===== Timing ===============================================================================
+	unsigned sink = 0;
+	const unsigned rounds = 200000;
+	double serial_ns = time_ns_per_datagram(bit_serial_crc, datagrams, batch, 8, rounds, sink);
+	double table_ns = time_ns_per_datagram(TMC_CRC::calc, datagrams, batch, 8, rounds, sink);
+	double folded_ns = time_ns_per_datagram([](const uint8_t* d, uint8_t) {
+		return TMC_CRC::write_crc(d[1], d[2], ((uint32_t)d[3] << 24) | ((uint32_t)d[4] << 16) | ((uint32_t)d[5] << 8) | d[6]);
+	}, datagrams, batch, 8, rounds, sink);
+
+	std::printf("{\n");
+	std::printf("  \"failures\": %u,\n", failures);
+	std::printf("  \"bit_serial_ns\": %.2f,\n", serial_ns);
+	std::printf("  \"table_ns\": %.2f,\n", table_ns);
+	std::printf("  \"cached_header_ns\": %.2f,\n", folded_ns);
+	std::printf("  \"speedup\": %.2f,\n", serial_ns / table_ns);
+	std::printf("  \"sink\": %u\n", sink & 1);
+	std::printf("}\n");
+
+	return failures == 0 ? 0 : 1;
+}
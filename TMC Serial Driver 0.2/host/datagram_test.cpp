@@ -0,0 +1,124 @@
+/*
+ Name:		datagram_test.cpp
+ Host test of the datagram byte layout: the datagrams the driver builds at runtime, the ones
+ TMC_Datagram builds at compile time and the tickets made from either are compared byte for byte
+ against reference frames (datasheet 4.1), and the fields the driver reads back out of them and out
+ of a reply are checked.
+
+ Build (from this folder):
+	g++ -O2 -std=c++11 -I. -I.. datagram_test.cpp SAM3X_Sim.cpp TMC2209_Model.cpp ../TMC_Serial.cpp ../TMC_CRC.cpp -o datagram_test
+*/
+
+#include <cstdio>
+#include <cstring>
+#include "Arduino.h"
+#include "TMC_Serial.h"
+
+static int failures = 0;
+
+static void check(bool passed, const char* what)
+{
+	if (!passed)
+	{
+		std::printf("FAIL: %s\n", what);
+		++failures;
+	}
+}
+
+static void check_bytes(const void* built, const uint8_t* reference, uint8_t length, const char* what)
+{
+	if (memcmp(built, reference, length) == 0)
+		return;
+
+	std::printf("FAIL: %s\n   built:", what);
+	for (uint8_t i = 0; i < length; ++i)
+		std::printf(" %02X", ((const uint8_t*)built)[i]);
+	std::printf("\n   reference:");
+	for (uint8_t i = 0; i < length; ++i)
+		std::printf(" %02X", reference[i]);
+	std::printf("\n");
+	++failures;
+}
+
+// Reference reads, CRC byte included
+struct read_frame {
+	uint8_t s_address, r_address;
+	uint8_t bytes[4];
+};
+
+static const read_frame reads[] = {
+	{ 0, TMC_Serial::GCONF, { 0x05, 0x00, 0x00, 0x48 } },
+	{ 0, TMC_Serial::IFCNT, { 0x05, 0x00, 0x02, 0x8F } },
+	{ 0, TMC_Serial::IOIN, { 0x05, 0x00, 0x06, 0x6F } },
+};
+
+// Reference writes, CRC byte included
+struct write_frame {
+	uint8_t s_address, r_address;
+	uint32_t data;
+	uint8_t bytes[8];
+};
+
+static const write_frame writes[] = {
+	{ 0, TMC_Serial::GCONF, 0x00000084, { 0x05, 0x00, 0x80, 0x00, 0x00, 0x00, 0x84, 0xAE } },
+	{ 3, TMC_Serial::GCONF, 0x00000082, { 0x05, 0x03, 0x80, 0x00, 0x00, 0x00, 0x82, 0x13 } },
+	{ 0, TMC_Serial::IHOLD_IRUN, 0x00011F02, { 0x05, 0x00, 0x90, 0x00, 0x01, 0x1F, 0x02, 0x20 } },
+	{ 1, TMC_Serial::VACTUAL, 0x00FFFC18, { 0x05, 0x01, 0xA2, 0x00, 0xFF, 0xFC, 0x18, 0xBB } },
+	{ 0, TMC_Serial::CHOPCONF, 0x16000053, { 0x05, 0x00, 0xEC, 0x16, 0x00, 0x00, 0x53, 0xC9 } },
+};
+
+int main()
+{
+	for (const read_frame& frame : reads)
+	{
+		TMC_Serial::read_access_datagram datagram(frame.s_address, frame.r_address);
+		check_bytes(&datagram, frame.bytes, TMC_Serial::read_access_datagram::datagram_length, "read_access_datagram bytes");
+		check(datagram.device_address == frame.s_address && datagram.register_address == frame.r_address && !datagram.rw_access,
+			"read_access_datagram fields");
+
+		TMC_Serial::read_ticket ticket(frame.s_address, frame.r_address, nullptr, nullptr);
+		check_bytes((const void*)&ticket.datagram, frame.bytes, TMC_Serial::read_access_datagram::datagram_length, "read_ticket bytes");
+
+		// The reply of the driver: the master address, the register and its value
+		uint8_t reply[TMC_Serial::data_transfer_datagram::datagram_length] = { 0x05, 0xFF, frame.r_address, 0x12, 0x34, 0x56, 0x78 };
+		reply[7] = TMC_CRC::calc(reply, sizeof(reply));
+		memcpy((void*)ticket.received, frame.bytes, sizeof(frame.bytes));
+		memcpy((void*)(ticket.received + sizeof(frame.bytes)), reply, sizeof(reply));
+		check(ticket.reply().device_address == 0xFF && ticket.reply().register_address == frame.r_address && !ticket.reply().rw_access,
+			"reply fields");
+		check(ticket.get_data() == 0x12345678 && ticket.validate_crc(), "reply data and CRC");
+	}
+
+	for (const write_frame& frame : writes)
+	{
+		TMC_Serial::data_transfer_datagram datagram(frame.s_address, frame.r_address, frame.data);
+		check_bytes(&datagram, frame.bytes, TMC_Datagram::length, "data_transfer_datagram bytes");
+		check(datagram.device_address == frame.s_address && datagram.register_address == frame.r_address && datagram.rw_access,
+			"data_transfer_datagram fields");
+
+		TMC_Datagram prebuilt = TMC_Datagram::encode(frame.s_address, frame.r_address | TMC_CRC::write_bit, frame.data);
+		check_bytes(prebuilt.bytes, frame.bytes, TMC_Datagram::length, "TMC_Datagram bytes");
+		check(prebuilt.s_address() == frame.s_address && prebuilt.r_address() == frame.r_address && prebuilt.data() == frame.data,
+			"TMC_Datagram fields");
+
+		// Both ways of building a write ticket put the same bytes on the wire and read the same data back
+		TMC_Serial::write_ticket runtime(frame.s_address, frame.r_address, frame.data, nullptr, nullptr);
+		TMC_Serial::write_ticket compiled(prebuilt, nullptr, nullptr);
+		check_bytes((const void*)&runtime.datagram, frame.bytes, TMC_Datagram::length, "write_ticket bytes");
+		check_bytes((const void*)&compiled.datagram, frame.bytes, TMC_Datagram::length, "prebuilt write_ticket bytes");
+		check(runtime.get_data() == frame.data && compiled.get_data() == frame.data, "write_ticket data");
+		check(runtime.validate_crc() && compiled.validate_crc(), "write_ticket CRC");
+		check(compiled.datagram.data_transfer.device_address == frame.s_address &&
+			compiled.datagram.data_transfer.register_address == frame.r_address && compiled.datagram.data_transfer.rw_access,
+			"prebuilt write_ticket fields");
+	}
+
+	if (failures)
+	{
+		std::printf("%d checks failed\n", failures);
+		return 1;
+	}
+
+	std::printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ Name:		mpsc_stress.cpp
+ Host stress harness for MPSC_Queue: several std::thread producers push tagged tickets while a
+ single consumer drains the queue, then every ticket is checked to have arrived exactly once and
+ in the order its producer pushed it.
+
+ Build (from this folder):
+	g++ -O2 -std=c++11 -pthread -I.. mpsc_stress.cpp -o mpsc_stress
+ Usage:
+	mpsc_stress [producers] [tickets per producer]
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "MPSC_Queue.h"
+
+// Same depth the driver uses for each USART
+static MPSC_Queue<uint32_t, 128> queue;
+
+int main(int argc, char** argv)
+{
+	const uint32_t producers = argc > 1 ? std::atoi(argv[1]) : 4;
+	const uint32_t per_producer = argc > 2 ? std::atoi(argv[2]) : 1000000;
+
+	if (producers == 0 || producers > 255 || per_producer == 0 || per_producer > 0xFFFFFF)
+	{
+		std::printf("producers must be 1 - 255, tickets per producer 1 - 16777215\n");
+		return 2;
+	}
+
+	std::atomic<uint64_t> full_retries(0);
+	std::atomic<bool> go(false);
+
+	// Tickets are tagged as producer << 24 | sequence number
+	std::vector<std::thread> threads;
+	for (uint32_t p = 0; p < producers; ++p)
+	{
+		threads.emplace_back([p, per_producer, &full_retries, &go]() {
+			while (!go.load()) {}
+			uint64_t retries = 0;
+			for (uint32_t i = 0; i < per_producer; ++i)
+			{
+				while (!queue.push((p << 24) | i))
+				{
+					++retries;
+					std::this_thread::yield();
+				}
+			}
+			full_retries.fetch_add(retries);
+		});
+	}
+
+	std::vector<uint32_t> next_expected(producers, 0);
+	std::vector<bool> seen((size_t)producers * per_producer, false);
+	uint64_t popped = 0, received = 0, duplicated = 0, out_of_order = 0, foreign = 0;
+	const uint64_t total = (uint64_t)producers * per_producer;
+
+	auto start = std::chrono::steady_clock::now();
+	go.store(true);
+
+	while (popped < total)
+	{
+		uint32_t ticket;
+		if (!queue.pop(ticket))
+			continue;
+		++popped;
+
+		uint32_t p = ticket >> 24, i = ticket & 0xFFFFFF;
+		if (p >= producers || i >= per_producer)
+		{
+			++foreign;
+			continue;
+		}
+
+		size_t index = (size_t)p * per_producer + i;
+		if (seen[index])
+		{
+			++duplicated;
+			continue;
+		}
+
+		seen[index] = true;
+		++received;
+		if (i != next_expected[p])
+			++out_of_order;
+		next_expected[p] = i + 1;
+	}
+
+	auto stop = std::chrono::steady_clock::now();
+	for (auto& t : threads)
+		t.join();
+
+	uint32_t leftover = 0, ticket;
+	while (queue.pop(ticket))
+		++leftover;
+
+	uint64_t lost = total - received;
+	double seconds = std::chrono::duration<double>(stop - start).count();
+
+	std::printf("{\n");
+	std::printf("  \"producers\": %u,\n", producers);
+	std::printf("  \"tickets\": %llu,\n", (unsigned long long)total);
+	std::printf("  \"received\": %llu,\n", (unsigned long long)received);
+	std::printf("  \"lost\": %llu,\n", (unsigned long long)lost);
+	std::printf("  \"duplicated\": %llu,\n", (unsigned long long)duplicated);
+	std::printf("  \"out_of_order\": %llu,\n", (unsigned long long)out_of_order);
+	std::printf("  \"foreign\": %llu,\n", (unsigned long long)foreign);
+	std::printf("  \"leftover\": %u,\n", leftover);
+	std::printf("  \"full_retries\": %llu,\n", (unsigned long long)full_retries.load());
+	std::printf("  \"tickets_per_second\": %.0f\n", total / seconds);
+	std::printf("}\n");
+
+	return (lost == 0 && duplicated == 0 && out_of_order == 0 && foreign == 0 && leftover == 0) ? 0 : 1;
+}
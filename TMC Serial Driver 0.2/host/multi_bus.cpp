@@ -0,0 +1,168 @@
+/*
+ Name:		multi_bus.cpp
+ Saturates all four USARTs at once: sixteen TMC2209 models, four per bus, spread with TMC_Bus_Group.
+ Every axis gets a stream of TPWMTHRS writes tagged with its own number plus IFCNT reads, then each
+ model is checked for the last value of its own axis and the number of writes it accepted, so a
+ ticket finished by the wrong bus's interrupt shows up as a mismatch. Then one GCONF value is fanned
+ out to every axis, which has to land exactly once on each model, every axis gets its own
+ VACTUAL in one group commit next to a read per axis, and all sixteen drivers are configured again by
+ one bring-up profile. Prints OK if everything matched and the buses really ran in parallel.
+
+ Build (from this folder):
+	g++ -O2 -std=c++11 -I. -I.. multi_bus.cpp SAM3X_Sim.cpp TMC2209_Model.cpp ../TMC_Bus_Group.cpp ../TMC_Serial.cpp ../TMC_CRC.cpp -o multi_bus
+*/
+
+#include <cstdio>
+#include "Arduino.h"
+#include "TMC2209_Model.h"
+#include "TMC_Bus_Group.h"
+
+static SAM3X_Sim& sim = SAM3X_Sim::instance();
+static volatile uint32_t completed, failed;
+
+static void count_completion(volatile TMC_Serial::access_ticket* ticket, void*)
+{
+	if (ticket->status != TMC_Serial::access_ticket::state::completed_successfully)
+		failed = failed + 1;
+	completed = completed + 1;
+	delete ticket;
+}
+
+int main()
+{
+	const uint8_t axes = 16;
+	const uint32_t rounds = 64;		// Tickets per axis, every fourth one reads IFCNT instead of writing
+	const uint32_t writes = rounds - rounds / 4;
+
+	TMC2209_Model drivers[axes] = {
+		TMC2209_Model(0), TMC2209_Model(1), TMC2209_Model(2), TMC2209_Model(3),
+		TMC2209_Model(0), TMC2209_Model(1), TMC2209_Model(2), TMC2209_Model(3),
+		TMC2209_Model(0), TMC2209_Model(1), TMC2209_Model(2), TMC2209_Model(3),
+		TMC2209_Model(0), TMC2209_Model(1), TMC2209_Model(2), TMC2209_Model(3) };
+
+	TMC_Serial usart0(USART0, 460800), usart1(USART1, 460800), usart2(USART2, 460800), usart3(USART3, 460800);
+	TMC_Serial* buses[] = { &usart0, &usart1, &usart2, &usart3 };
+	TMC_Bus_Group group(buses, 4, axes);
+
+	// Wire each model where the group placed its axis
+	TMC2209_Model* model_of[axes];
+	for (uint8_t axis = 0; axis < group.axes(); ++axis)
+	{
+		uint8_t b = 0;
+		while (buses[b] != group.bus_of(axis))
+			++b;
+		model_of[axis] = &drivers[b * 4 + group.address_of(axis)];
+		sim.usart(b).attach(*model_of[axis]);
+	}
+
+	uint32_t queued = 0;
+	uint64_t start = sim.now();
+	for (uint32_t r = 0; r < rounds; ++r)
+		for (uint8_t axis = 0; axis < group.axes(); ++axis)
+		{
+			bool read = r % 4 == 0;
+			while ((read ? (volatile void*)group.read(axis, TMC_Serial::IFCNT, count_completion)
+			             : (volatile void*)group.write(axis, TMC_Serial::TPWMTHRS, (axis << 16) | r, count_completion)) == nullptr)
+				__WFI();	// Backpressure, wait for a ticket to complete
+			++queued;
+		}
+	sim.run_until([&queued]() { return completed == queued; }, SAM3X_Sim::clock_hz);
+	uint64_t elapsed = sim.now() - start;
+
+	unsigned mismatches = 0;
+	for (uint8_t axis = 0; axis < group.axes(); ++axis)
+	{
+		const TMC2209_Model& model = *model_of[axis];
+		uint32_t expected = (axis << 16) | (rounds - 1);
+		if (model.get_register(TMC_Serial::TPWMTHRS) != expected || model.write_count(TMC_Serial::TPWMTHRS) != writes)
+		{
+			std::printf("axis %2u: TPWMTHRS 0x%08X after %u writes, expected 0x%08X after %u\n", axis,
+				model.get_register(TMC_Serial::TPWMTHRS), model.write_count(TMC_Serial::TPWMTHRS), expected, writes);
+			++mismatches;
+		}
+	}
+
+	// In parallel every wire is busy for most of the run, one after the other they'd add up to 4x
+	double busy_sum = 0;
+	for (int b = 0; b < 4; ++b)
+	{
+		double busy = (double)sim.usart(b).stats().busy_cycles / elapsed;
+		busy_sum += busy;
+		std::printf("USART%d: %llu bytes sent, wire busy %.1f %%\n", b, (unsigned long long)sim.usart(b).stats().bytes_sent, busy * 100);
+	}
+	std::printf("%u tickets on %u axes in %.2f ms, %u failed, %u mismatched\n", (unsigned)completed, group.axes(),
+		elapsed * 1e3 / SAM3X_Sim::clock_hz, (unsigned)failed, mismatches);
+
+	// One fan-out write per bus configures all sixteen drivers
+	const uint32_t gconf = 0x000001C0;
+	uint8_t fanned_out = group.write_all(TMC_Serial::GCONF, gconf);
+	sim.run_until([&]() {
+		for (uint8_t axis = 0; axis < group.axes(); ++axis)
+			if (model_of[axis]->write_count(TMC_Serial::GCONF) == 0)
+				return false;
+		return true;
+	}, SAM3X_Sim::clock_hz / 10);
+	for (uint8_t axis = 0; axis < group.axes(); ++axis)
+		if (model_of[axis]->get_register(TMC_Serial::GCONF) != gconf || model_of[axis]->write_count(TMC_Serial::GCONF) != 1)
+		{
+			std::printf("axis %2u: GCONF 0x%08X after %u writes, expected 0x%08X once\n", axis,
+				model_of[axis]->get_register(TMC_Serial::GCONF), model_of[axis]->write_count(TMC_Serial::GCONF), gconf);
+			++mismatches;
+		}
+	std::printf("GCONF fanned out to %u axes\n", fanned_out);
+
+	// Every axis gets its own velocity in one commit, while the buses are kept busy with other traffic
+	for (uint8_t axis = 0; axis < group.axes(); ++axis)
+	{
+		group.read(axis, TMC_Serial::IFCNT, count_completion);
+		group.stage(axis, 1000 * (axis + 1));
+	}
+	queued += group.axes();
+	bool committed = group.commit(TMC_Serial::VACTUAL);
+	const TMC_Serial::group_commit& commit = group.last_commit();
+	sim.run_until([&]() { return commit.status != TMC_Serial::group_commit::state::running && completed == queued; }, SAM3X_Sim::clock_hz / 10);
+	for (uint8_t axis = 0; axis < group.axes(); ++axis)
+		if (model_of[axis]->get_register(TMC_Serial::VACTUAL) != 1000u * (axis + 1))
+		{
+			std::printf("axis %2u: VACTUAL %u, expected %u\n", axis, model_of[axis]->get_register(TMC_Serial::VACTUAL), 1000 * (axis + 1));
+			++mismatches;
+		}
+	// The DWT counts host nanoseconds here (see Arduino.h), the start spread is host time. The skew is measured on the simulated clock.
+	std::printf("VACTUAL committed to %u axes: status %u, buses started within %.1f us (host), values landed within %.1f us (%.1f datagrams, bound %.1f us)\n",
+		group.axes(), commit.status, commit.start_spread / 1000.0, commit.skew * 1e6 / SAM3X_Sim::clock_hz,
+		commit.skew / (80.0 * SAM3X_Sim::clock_hz / 460800), commit.skew_bound * 1e6 / SAM3X_Sim::clock_hz);
+
+	// The whole configuration of every driver, each one with its own TPWMTHRS, from one table per USART
+	const uint32_t registers[] = { TMC_Serial::GSTAT, TMC_Serial::GCONF, TMC_Serial::CHOPCONF, TMC_Serial::IHOLD_IRUN, TMC_Serial::TPWMTHRS, TMC_Serial::PWMCONF };
+	const uint32_t values[] = { 0x7, 0x000001C0, 0x10000053, 0x00011F02, 0, 0xC10D0024 };
+	TMC_Serial::profile_row rows[4][6];
+	TMC_Serial::bring_up bring_up;
+	for (int b = 0; b < 4; ++b)
+	{
+		for (int r = 0; r < 6; ++r)
+		{
+			rows[b][r].r_address = registers[r];
+			rows[b][r].slave_mask = 0x0F;
+			for (int s = 0; s < 4; ++s)
+				rows[b][r].data[s] = registers[r] == TMC_Serial::TPWMTHRS ? 100 + b * 4 + s : values[r];
+		}
+		buses[b]->stage_profile(bring_up, rows[b], 6);
+	}
+	bool started = TMC_Serial::start_bring_up(bring_up);
+	sim.run_until([&]() { return bring_up.status != TMC_Serial::bring_up::state::running; }, SAM3X_Sim::clock_hz / 10);
+	for (int b = 0; b < 4; ++b)
+		for (int s = 0; s < 4; ++s)
+			if (drivers[b * 4 + s].get_register(TMC_Serial::TPWMTHRS) != 100u + b * 4 + s || bring_up.landed[b][s] != 6 || bring_up.gstat[b][s] != 0)
+			{
+				std::printf("USART%d slave %d: TPWMTHRS %u, %u writes counted, GSTAT 0x%X\n", b, s,
+					drivers[b * 4 + s].get_register(TMC_Serial::TPWMTHRS), bring_up.landed[b][s], (unsigned)bring_up.gstat[b][s]);
+				++mismatches;
+			}
+	std::printf("Bring-up of 16 drivers, 6 registers each: status %u in %.2f ms\n", bring_up.status, bring_up.elapsed_us / 1e3);
+
+	bool passed = completed == queued && failed == 0 && mismatches == 0 && busy_sum > 2.5 && fanned_out == group.axes() &&
+		committed && commit.status == TMC_Serial::group_commit::state::committed &&
+		started && bring_up.status == TMC_Serial::bring_up::state::verified && bring_up.elapsed_us < 10000;
+	std::printf(passed ? "OK\n" : "FAILED\n");
+	return passed ? 0 : 1;
+}
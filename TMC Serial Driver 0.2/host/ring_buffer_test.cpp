@@ -0,0 +1,176 @@
+/*
+ Name:		ring_buffer_test.cpp
+ Host test of Ring_Buffer: pushing and popping across the wrap-around, the two segment views of
+ peek() and prepare(), pulling into a caller buffer, reallocating a wrapped container and running
+ standard algorithms over the iterator.
+
+ Build (from this folder):
+	g++ -O2 -std=c++11 -I.. ring_buffer_test.cpp -o ring_buffer_test
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+#include <numeric>
+#include <vector>
+#include "Ring_Buffer.h"
+
+static int failures = 0;
+
+static void check(bool passed, const char* what)
+{
+	if (!passed)
+	{
+		std::printf("FAIL: %s\n", what);
+		++failures;
+	}
+}
+
+// Returns the elements of the container, front to back
+static std::vector<int> contents(const Ring_Buffer<int>& ring)
+{
+	return std::vector<int>(ring.begin(), ring.end());
+}
+
+static std::vector<int> sequence(int first, int last)
+{
+	std::vector<int> values;
+	for (int i = first; i < last; ++i)
+		values.push_back(i);
+	return values;
+}
+
+// Fills an empty container of capacity 8 with 5 - 10, stored as 5 6 7 at the end of the memory block and 8 9 10 at its beginning
+static void fill_wrapped(Ring_Buffer<int>& ring)
+{
+	for (int i = 0; i < 5; ++i)
+		ring.push(i);
+	ring.pop((size_t)5);
+	for (int i = 5; i < 11; ++i)
+		ring.push(i);
+}
+
+static void wrap_around()
+{
+	Ring_Buffer<int> ring(8);
+	check(ring.capacity() == 8 && ring.empty(), "new container");
+
+	// Keep 4 elements in flight through many laps of the memory block
+	bool in_order = true;
+	int next_in = 0, next_out = 0;
+	for (int lap = 0; lap < 100; ++lap)
+	{
+		while (ring.size() < 4)
+			ring.push(next_in++);
+		in_order &= ring.pull() == next_out++;
+	}
+	check(in_order && ring.capacity() == 8, "elements come out in order across the wrap-around, without reallocating");
+
+	ring.clear();
+	fill_wrapped(ring);
+	check(ring.size() == 6 && contents(ring) == sequence(5, 11), "wrapped contents");
+
+	ring.pop((size_t)2);
+	check(contents(ring) == sequence(7, 11), "pop across the wrap-around");
+
+	const int block[] = { 11, 12, 13, 14 };
+	check(!ring.push(block, 4) && ring.full() && contents(ring) == sequence(7, 15), "bulk push across the wrap-around");
+
+	check(ring.push(15) && ring.capacity() > 8 && contents(ring) == sequence(7, 16), "reallocating a wrapped container keeps the order");
+}
+
+static void spans()
+{
+	Ring_Buffer<int> ring(8);
+	fill_wrapped(ring);
+
+	Ring_Buffer<int>::span_pair peeked = ring.peek();
+	check(peeked.first.size == 3 && peeked.second.size == 3 && peeked.size() == ring.size(), "peek splits at the wrap-around");
+	std::vector<int> viewed(peeked.first.data, peeked.first.data + peeked.first.size);
+	viewed.insert(viewed.end(), peeked.second.data, peeked.second.data + peeked.second.size);
+	check(viewed == sequence(5, 11), "peek views hold the elements in order");
+
+	ring.consume(4);
+	peeked = ring.peek();
+	check(peeked.first.size == 2 && peeked.second.size == 0 && peeked.first.data[0] == 9, "peek of an unwrapped container");
+
+	// 2 elements at indices 1 and 2, the free space runs from 3 to the end of the block and wraps to 0
+	Ring_Buffer<int>::span_pair free = ring.prepare();
+	check(free.first.size == 5 && free.second.size == 1 && free.size() == ring.capacity() - ring.size(), "prepare splits at the wrap-around");
+
+	int value = 11;
+	for (size_t i = 0; i < free.first.size; ++i)
+		free.first.data[i] = value++;
+	for (size_t i = 0; i < free.second.size; ++i)
+		free.second.data[i] = value++;
+	ring.commit(free.size());
+	check(ring.full() && contents(ring) == sequence(9, 17), "commit appends what was written to both views");
+	check(ring.prepare().size() == 0, "prepare of a full container is empty");
+
+	ring.commit(1);
+	check(ring.size() == ring.capacity(), "commit past the free space is clamped");
+}
+
+static void pull()
+{
+	Ring_Buffer<int> ring(8);
+	fill_wrapped(ring);
+
+	int buffer[8] = {};
+	check(ring.pull(buffer, 4, false) == 4 && std::vector<int>(buffer, buffer + 4) == sequence(5, 9) && ring.size() == 6,
+		"pull across the wrap-around without popping");
+
+	check(ring.pull(buffer, 8) == 6 && std::vector<int>(buffer, buffer + 6) == sequence(5, 11) && ring.empty(),
+		"pull more than the container holds");
+
+	check(ring.pull(buffer, 1) == 0, "pull from an empty container");
+
+	fill_wrapped(ring);
+	int* copy = ring.pull((size_t)9, false);
+	check(copy == nullptr, "allocating pull of too many elements");
+
+	copy = ring.pull(8);	// An element, not a count: up to and including the terminator
+	check(copy != nullptr && std::vector<int>(copy, copy + 4) == sequence(5, 9), "allocating pull up to the terminator");
+	delete[] copy;
+	check(contents(ring) == sequence(9, 11), "allocating pull pops");
+}
+
+static void algorithms()
+{
+	Ring_Buffer<int> ring(8);
+	fill_wrapped(ring);
+
+	check(std::distance(ring.begin(), ring.end()) == 6 && ring.end() - ring.begin() == 6, "distance across the wrap-around");
+	check(*ring.find(9) == 9 && ring.find(9) - ring.begin() == 4 && ring.find(42) == ring.end(), "find");
+	check(std::accumulate(ring.begin(), ring.end(), 0) == 5 + 6 + 7 + 8 + 9 + 10, "accumulate");
+	check(std::count_if(ring.begin(), ring.end(), [](int value) { return value % 2 == 0; }) == 3, "count_if");
+	check(*std::lower_bound(ring.begin(), ring.end(), 8) == 8 && std::binary_search(ring.begin(), ring.end(), 10), "binary search");
+	check(std::is_sorted(ring.begin(), ring.end()), "is_sorted");
+
+	std::vector<int> reversed(std::reverse_iterator<Ring_Buffer<int>::iterator>(ring.end()),
+		std::reverse_iterator<Ring_Buffer<int>::iterator>(ring.begin()));
+	check(reversed == std::vector<int>({ 10, 9, 8, 7, 6, 5 }), "reverse iteration");
+
+	Ring_Buffer<int>::iterator it = ring.begin() + 2;
+	check(it[1] == 8 && *(it - 1) == 6 && it < ring.end() && ring.end() > it && (it += 3) == ring.end() - 1, "random access");
+
+	ring.pop(8);
+	check(contents(ring) == sequence(9, 11), "pop up to a terminator across the wrap-around");
+}
+
+int main()
+{
+	wrap_around();
+	spans();
+	pull();
+	algorithms();
+
+	if (failures)
+	{
+		std::printf("%d checks failed\n", failures);
+		return 1;
+	}
+
+	std::printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,329 @@
+/*
+ Name:		sim_example.cpp
+ Runs the driver against the simulated SAM3X and a TMC2209 model, the host counterpart of the sketch:
+ a few configuration writes, reading IOIN back, an injected CRC error, timeout and driver reset, the
+ same faults again with retries and a glitched write burst, then TSTEP and IOIN subscriptions, verified write batches, one
+ of them with a lost write, callbacks deferred to dispatch(), a velocity ramp, accesses timed
+ between other traffic and finding the highest baudrate the driver follows.
+
+ Build (from this folder):
+	g++ -O2 -std=c++11 -I. -I.. sim_example.cpp SAM3X_Sim.cpp TMC2209_Model.cpp ../TMC_Serial.cpp ../TMC_CRC.cpp -o sim_example
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include "Arduino.h"
+#include "TMC2209_Model.h"
+#include "TMC_Serial.h"
+
+static SAM3X_Sim& sim = SAM3X_Sim::instance();
+static TMC2209_Model driver(0);
+
+// The configuration, encoded by the compiler
+static constexpr TMC_Datagram gconf = TMC_Datagram::write<TMC_GCONF>(0, TMC_GCONF::internal_Rsense(1) | TMC_GCONF::mstep_reg_select(1));
+static constexpr TMC_Datagram chopconf = TMC_Datagram::write<TMC_CHOPCONF>(0,
+	TMC_CHOPCONF::toff(3) | TMC_CHOPCONF::hstrt(5) | TMC_CHOPCONF::mres(6) | TMC_CHOPCONF::intpol(1));
+static constexpr TMC_Datagram ihold_irun = TMC_Datagram::write<TMC_IHOLD_IRUN>(0,
+	TMC_IHOLD_IRUN::IHOLD(2) | TMC_IHOLD_IRUN::IRUN(31) | TMC_IHOLD_IRUN::IHOLDDELAY(1));
+
+static const char* status_name(uint8_t status)
+{
+	switch (status)
+	{
+	case TMC_Serial::access_ticket::state::pending:					return "pending";
+	case TMC_Serial::access_ticket::state::completed_successfully:	return "completed_successfully";
+	case TMC_Serial::access_ticket::state::crc_error:				return "crc_error";
+	case TMC_Serial::access_ticket::state::timedout:				return "timedout";
+	case TMC_Serial::access_ticket::state::collision:				return "collision";
+	default:														return "unknown";
+	}
+}
+
+// Reads a register and lets simulated time pass until the ticket completes
+static uint8_t blocking_read(TMC_Serial& bus, uint32_t r_address, uint32_t& value)
+{
+	volatile TMC_Serial::read_ticket* ticket = bus.read(0, r_address);
+	if (ticket == nullptr)
+		return TMC_Serial::access_ticket::state::pending;
+
+	uint64_t start = sim.now();
+	sim.run_until([ticket]() { return ticket->transfer_complete(); }, SAM3X_Sim::clock_hz);
+	std::printf("  read 0x%02X: %-22s %6.1f us\n", (unsigned)r_address, status_name(ticket->status),
+		(sim.now() - start) * 1e6 / SAM3X_Sim::clock_hz);
+
+	if (ticket->attempts > 1)
+		std::printf("    after %u attempts\n", ticket->attempts);
+
+	uint8_t status = ticket->status;
+	value = ticket->get_data();
+	delete ticket;
+	return status;
+}
+
+int main()
+{
+	sim.usart(0).attach(driver);
+	TMC_Serial TMC2209(USART0, 460800);
+	unsigned failures = 0;
+
+	std::printf("configuration writes\n");
+	for (const TMC_Datagram& prebuilt : { gconf, chopconf, ihold_irun })
+	{
+		// The datagram the driver encodes at runtime has to match the one built by the compiler byte for byte
+		TMC_Serial::write_ticket encoded(prebuilt.s_address(), prebuilt.r_address(), prebuilt.data(), nullptr, nullptr);
+		failures += memcmp(&encoded.datagram, prebuilt.bytes, TMC_Datagram::length) != 0;
+		TMC2209.write(prebuilt);
+	}
+	TMC2209.write(0, TMC_Serial::TPWMTHRS, 200);
+	sim.run_until([]() { return driver.stats().writes == 4; }, SAM3X_Sim::clock_hz);
+	std::printf("  %u writes accepted by %.1f ms, GCONF = 0x%08X\n", driver.stats().writes,
+		sim.now() * 1e3 / SAM3X_Sim::clock_hz, driver.get_register(TMC_Serial::GCONF));
+	failures += driver.get_register(TMC_Serial::GCONF) != gconf.data() || driver.get_register(TMC_Serial::CHOPCONF) != 0x16000053;
+	failures += TMC_IHOLD_IRUN::IRUN::get(driver.get_register(TMC_Serial::IHOLD_IRUN)) != 31;
+
+	uint32_t value;
+	std::printf("IOIN and IFCNT\n");
+	failures += blocking_read(TMC2209, TMC_Serial::IOIN, value) != TMC_Serial::access_ticket::state::completed_successfully;
+	std::printf("  IOIN = 0x%08X, VERSION 0x%02X\n", value, value >> 24);
+	failures += blocking_read(TMC2209, TMC_Serial::IFCNT, value) != TMC_Serial::access_ticket::state::completed_successfully;
+	std::printf("  IFCNT = %u\n", value);
+	failures += value != 4;
+
+	std::printf("injected faults\n");
+	driver.inject_crc_errors(1);
+	failures += blocking_read(TMC2209, TMC_Serial::GCONF, value) != TMC_Serial::access_ticket::state::crc_error;
+	driver.inject_timeouts(1);
+	failures += blocking_read(TMC2209, TMC_Serial::GCONF, value) != TMC_Serial::access_ticket::state::timedout;
+	driver.power_cycle();
+	failures += blocking_read(TMC2209, TMC_Serial::IFCNT, value) != TMC_Serial::access_ticket::state::completed_successfully;
+	std::printf("  IFCNT after power cycle = %u\n", value);
+
+	// A slave that answers later than the driver expects talks over the next datagram, whose echo then doesn't match
+	driver.set_register(TMC_Serial::SLAVECONF, 0x0F00);
+	volatile TMC_Serial::read_ticket* late = TMC2209.read(0, TMC_Serial::GCONF);
+	sim.run_for(sim.usart(0).bit_cycles() * 20);	// Reads queue behind writes, let it start first
+	volatile TMC_Serial::write_ticket* first = TMC2209.write(0, TMC_Serial::TPWMTHRS, 300, nullptr);
+	volatile TMC_Serial::write_ticket* overlapped = TMC2209.write(0, TMC_Serial::TCOOLTHRS, 400, nullptr);
+	sim.run_until([overlapped]() { return overlapped->transfer_complete(); }, SAM3X_Sim::clock_hz);
+	sim.run_for(SAM3X_Sim::clock_hz / 1000);
+	std::printf("  late reply: read %s, writes behind it %s, %s\n", status_name(late->status), status_name(first->status), status_name(overlapped->status));
+	failures += late->status != TMC_Serial::access_ticket::state::timedout || first->status != TMC_Serial::access_ticket::state::completed_successfully;
+	failures += overlapped->status == TMC_Serial::access_ticket::state::completed_successfully;
+	driver.set_register(TMC_Serial::SLAVECONF, 0);
+	delete late;
+	delete first;
+	delete overlapped;
+
+	std::printf("retries\n");
+	TMC2209.set_retry_policy(TMC_Serial::telemetry, 3, true, 16);
+	driver.set_register(TMC_Serial::GCONF, gconf.data());
+	driver.inject_crc_errors(1);
+	failures += blocking_read(TMC2209, TMC_Serial::GCONF, value) != TMC_Serial::access_ticket::state::completed_successfully;
+	failures += value != driver.get_register(TMC_Serial::GCONF);
+	driver.inject_timeouts(3);
+	failures += blocking_read(TMC2209, TMC_Serial::GCONF, value) != TMC_Serial::access_ticket::state::timedout;
+	driver.inject_timeouts(2);
+	failures += blocking_read(TMC2209, TMC_Serial::GCONF, value) != TMC_Serial::access_ticket::state::completed_successfully;
+	TMC2209.set_retry_policy(TMC_Serial::telemetry, 1);
+
+	// A retried write of a burst mustn't land after a newer write to the same register
+	TMC2209.set_retry_policy(TMC_Serial::configuration, 3, true);
+	sim.usart(0).inject_glitch(8 + 4);	// The first data byte of the burst's first datagram
+	TMC2209.write(0, TMC_Serial::VACTUAL, 1);	// Keeps the bus busy, so the writes below go out as a burst
+	TMC2209.write(0, TMC_Serial::TPWMTHRS, 100);
+	TMC2209.write(0, TMC_Serial::TCOOLTHRS, 150);
+	TMC2209.write(0, TMC_Serial::TPWMTHRS, 200);
+	sim.run_for(SAM3X_Sim::clock_hz / 100);
+	TMC2209.write(0, TMC_Serial::VACTUAL, 0);
+	sim.run_for(SAM3X_Sim::clock_hz / 100);
+	std::printf("  glitched burst: TPWMTHRS = %u, TCOOLTHRS = %u, %u bad datagrams\n", driver.get_register(TMC_Serial::TPWMTHRS),
+		driver.get_register(TMC_Serial::TCOOLTHRS), driver.stats().bad_datagrams);
+	failures += driver.get_register(TMC_Serial::TPWMTHRS) != 200 || driver.get_register(TMC_Serial::TCOOLTHRS) != 150;
+	TMC2209.set_retry_policy(TMC_Serial::configuration, 1);
+
+	std::printf("subscriptions\n");
+	int8_t tstep = TMC2209.subscribe(0, TMC_Serial::TSTEP, 5);
+	int8_t ioin = TMC2209.subscribe(0, TMC_Serial::IOIN, 10);
+	driver.set_register(TMC_Serial::TSTEP, 1234);
+	sim.run_for(SAM3X_Sim::clock_hz / 20);	// 50 ms
+	TMC_Serial::snapshot latest;
+	failures += !TMC2209.read_snapshot(tstep, latest) || latest.value != 1234;
+	std::printf("  TSTEP = %u after %u reads, ", latest.value, latest.sequence);
+	failures += latest.sequence < 9;
+	failures += !TMC2209.read_snapshot(ioin, latest) || latest.value >> 24 != 0x21;
+	std::printf("IOIN = 0x%08X after %u reads\n", latest.value, latest.sequence);
+	failures += latest.sequence < 4;
+	TMC2209.unsubscribe(tstep);
+	TMC2209.unsubscribe(ioin);
+	sim.run_for(SAM3X_Sim::clock_hz / 1000);
+
+	std::printf("verified write batches\n");
+	const TMC_Serial::batch_write configuration[] = {
+		{ TMC_Serial::GCONF, gconf.data() }, { TMC_Serial::CHOPCONF, chopconf.data() },
+		{ TMC_Serial::IHOLD_IRUN, ihold_irun.data() }, { TMC_Serial::PWMCONF, 0xC10D0024 } };
+	TMC_Serial::write_batch batch;
+	for (int lost = 0; lost < 2; ++lost)
+	{
+		driver.set_register(TMC_Serial::GCONF, 0);
+		driver.inject_lost_writes(lost);	// Drops the GCONF write of the second batch
+		uint32_t bytes = sim.usart(0).stats().bytes_sent;
+		failures += !TMC2209.write_verified(0, batch, configuration, 4);
+		sim.run_until([&batch]() { return batch.status != TMC_Serial::write_batch::state::running; }, SAM3X_Sim::clock_hz);
+		std::printf("  status %u, %u of 4 writes counted, lost 0x%X, unverified 0x%X, %u bytes sent\n", batch.status, batch.landed,
+			(unsigned)batch.lost, (unsigned)batch.unverified, (unsigned)(sim.usart(0).stats().bytes_sent - bytes));
+		failures += lost == 0 && batch.status != TMC_Serial::write_batch::state::verified;
+	}
+	failures += batch.status != TMC_Serial::write_batch::state::mismatch || batch.landed != 3 || batch.lost != 0x1 || batch.unverified != 0x4;
+
+	// Deferred completion: the handler only queues the finished read, its callback waits for dispatch()
+	std::printf("Deferred completion:\n");
+	TMC2209.set_completion_mode(TMC_Serial::polled);
+	volatile bool done = false;
+	TMC2209.read(0, TMC_Serial::IFCNT, [](volatile TMC_Serial::access_ticket* ticket, void* flag) { *(volatile bool*)flag = true; delete ticket; }, (void*)&done);
+	sim.run_for(SAM3X_Sim::clock_hz / 100);
+	bool early = done;
+	uint32_t dispatched = TMC_Serial::dispatch();
+	std::printf("  callback before dispatch(): %s, dispatch() ran %u\n", early ? "yes" : "no", (unsigned)dispatched);
+	failures += early || !done || dispatched != 1;
+
+	// A sync whose callback waits for dispatch() while more writes complete must not drop the shadow
+	TMC2209.sync_shadow(0);
+	sim.run_for(SAM3X_Sim::clock_hz / 100);
+	TMC_Serial::dispatch();
+	TMC2209.sync_shadow(0);
+	sim.run_for(SAM3X_Sim::clock_hz / 100);
+	for (uint32_t v = 1; v <= 4; ++v)
+		TMC2209.write(0, TMC_Serial::TPWMTHRS, 300 + v);
+	sim.run_for(SAM3X_Sim::clock_hz / 100);
+	TMC_Serial::dispatch();
+	uint32_t shadowed = 0;
+	bool kept = TMC2209.shadow_value(0, TMC_Serial::TPWMTHRS, shadowed);
+	std::printf("  shadow after a deferred sync with writes in between: %s (%u)\n", kept ? "kept" : "dropped", (unsigned)shadowed);
+	failures += !kept || shadowed != 304;
+	TMC2209.set_completion_mode(TMC_Serial::immediate);
+
+	// Writing the value the register holds is dropped, and told apart from an exhausted pool
+	uint32_t tpwmthrs_writes = driver.write_count(TMC_Serial::TPWMTHRS);
+	bool redundant = TMC2209.write(0, TMC_Serial::TPWMTHRS, 304) == TMC_Serial::redundant_write;
+	bool unchanged = TMC2209.write_field(0, TMC_Serial::TPWMTHRS, 0xFF, 304 & 0xFF);
+	sim.run_for(SAM3X_Sim::clock_hz / 100);
+	std::printf("  rewriting 304: %s, unchanged field update: %s, sent %u\n", redundant ? "redundant" : "queued",
+		unchanged ? "done" : "failed", driver.write_count(TMC_Serial::TPWMTHRS) - tpwmthrs_writes);
+	failures += !redundant || !unchanged || driver.write_count(TMC_Serial::TPWMTHRS) != tpwmthrs_writes;
+
+	// Fire-and-forget writes to a coalesced register fold into one ticket, a write with a callback keeps its own
+	std::printf("Coalescing:\n");
+	TMC2209.set_coalescing(TMC_Serial::TCOOLTHRS);
+	uint32_t tcoolthrs_writes = driver.write_count(TMC_Serial::TCOOLTHRS);
+	volatile uint32_t called_with = 0;
+	TMC2209.write(0, TMC_Serial::VACTUAL, 1);	// Keeps the bus busy, so the writes below wait in the queue
+	for (uint32_t v = 1; v <= 3; ++v)
+		TMC2209.write(0, TMC_Serial::TCOOLTHRS, 500 + v);
+	TMC2209.write(0, TMC_Serial::TCOOLTHRS, 600, [](volatile TMC_Serial::access_ticket* ticket, void* value) {
+		*(volatile uint32_t*)value = ticket->get_data();
+		delete ticket;
+	}, (void*)&called_with);
+	for (uint32_t v = 4; v <= 6; ++v)
+		TMC2209.write(0, TMC_Serial::TCOOLTHRS, 500 + v);
+	sim.run_for(SAM3X_Sim::clock_hz / 100);
+	TMC2209.write(0, TMC_Serial::VACTUAL, 0);
+	sim.run_for(SAM3X_Sim::clock_hz / 100);
+	std::printf("  7 writes sent as %u, callback saw %u, register holds %u\n", driver.write_count(TMC_Serial::TCOOLTHRS) - tcoolthrs_writes,
+		(unsigned)called_with, driver.get_register(TMC_Serial::TCOOLTHRS));
+	failures += called_with != 600 || driver.get_register(TMC_Serial::TCOOLTHRS) != 506 || driver.write_count(TMC_Serial::TCOOLTHRS) - tcoolthrs_writes > 4;
+	TMC2209.set_coalescing(TMC_Serial::TCOOLTHRS, false);
+
+	// A jerk limited ramp to 20000 and back to a stop, nothing but the target comes from here
+	std::printf("Velocity ramp:\n");
+	TMC2209.set_ramp(0, 200000, 2000000, 2);
+	for (int32_t target : { 20000, 0 })
+	{
+		uint32_t writes = driver.write_count(TMC_Serial::VACTUAL);
+		uint64_t start = sim.now();
+		TMC_Serial::ramp_state ramp;
+		int32_t worst_error = 0;
+		TMC2209.ramp_to(0, target);
+		for (uint32_t ms = 0; ms < 1000 && TMC2209.read_ramp(0, ramp) && ramp.running; ++ms)
+		{
+			worst_error = std::max(worst_error, std::abs(ramp.tracking_error));
+			sim.run_for(SAM3X_Sim::clock_hz / 1000);
+
+			// Setting up the ramp again while an update waits for dispatch() is refused, the ramp carries on
+			if (target != 0 && ms == 20)
+			{
+				TMC2209.set_completion_mode(TMC_Serial::polled);
+				sim.run_for(SAM3X_Sim::clock_hz / 200);
+				bool refused = !TMC2209.set_ramp(0, 200000, 2000000, 2);
+				TMC2209.set_completion_mode(TMC_Serial::immediate);
+				TMC_Serial::dispatch();
+				std::printf("  set_ramp with an update in flight %s\n", refused ? "refused" : "accepted");
+				failures += !refused;
+			}
+		}
+		std::printf("  to %6d in %.1f ms: VACTUAL %d after %u writes, %u updates/s, largest tracking error %d, %u put off\n", target,
+			(sim.now() - start) * 1e3 / SAM3X_Sim::clock_hz, (int32_t)driver.get_register(TMC_Serial::VACTUAL),
+			driver.write_count(TMC_Serial::VACTUAL) - writes, (unsigned)ramp.update_rate, worst_error, (unsigned)ramp.skipped);
+		failures += ramp.running || (int32_t)driver.get_register(TMC_Serial::VACTUAL) != target;
+	}
+	TMC2209.end_ramp(0);
+
+	// Timed accesses in between a stream of other writes, the last one far enough out to be picked up from the SysTick
+	std::printf("Timed accesses:\n");
+	struct { const char* name; uint32_t offset_us; volatile TMC_Serial::access_ticket* ticket; } timed[] = {
+		{ "IHOLD_IRUN write", 3000, nullptr }, { "IFCNT read", 3400, nullptr }, { "TPWMTHRS write", 7000, nullptr } };
+	auto keep = [](volatile TMC_Serial::access_ticket*, void*) {};
+	uint32_t now = micros();
+	timed[0].ticket = TMC2209.write_at(0, TMC_Serial::IHOLD_IRUN, ihold_irun.data(), now + timed[0].offset_us, keep);
+	timed[1].ticket = TMC2209.read_at(0, TMC_Serial::IFCNT, now + timed[1].offset_us, keep);
+	timed[2].ticket = TMC2209.write_at(0, TMC_Serial::TPWMTHRS, 1234, now + timed[2].offset_us, keep);
+	for (uint32_t i = 0; i < 48; ++i)
+	{
+		TMC2209.write(0, TMC_Serial::TCOOLTHRS, i + 1);
+		sim.run_for(SAM3X_Sim::clock_hz / 10000);
+	}
+	sim.run_for(SAM3X_Sim::clock_hz / 100);
+	for (auto& t : timed)
+	{
+		if (t.ticket == nullptr)
+		{
+			++failures;
+			continue;
+		}
+		int32_t late = (int32_t)(t.ticket->sent_at - t.ticket->deadline);
+		std::printf("  %-16s requested at +%u us, sent at +%u us (%d us late), status %u\n", t.name, (unsigned)t.offset_us,
+			(unsigned)(t.ticket->sent_at - now), (int)late, t.ticket->status);
+		failures += t.ticket->status != TMC_Serial::access_ticket::state::completed_successfully || late < 0 || late > 10;
+		delete t.ticket;
+	}
+	failures += driver.get_register(TMC_Serial::TPWMTHRS) != 1234 || driver.get_register(TMC_Serial::TCOOLTHRS) != 48;
+
+	// This driver copes with up to 750000 baud, the search has to stop right below. IFCNT reads are
+	//    moved to a class that retries, the probes still mustn't be
+	std::printf("Baudrate negotiation:\n");
+	driver.set_baud_limits(9600, 750000);
+	TMC2209.set_priority(TMC_Serial::IFCNT, TMC_Serial::configuration);
+	TMC2209.set_retry_policy(TMC_Serial::configuration, 3, true);
+	TMC_Serial::baud_negotiation negotiation;
+	uint64_t probe_bytes = sim.usart(0).stats().bytes_sent;
+	bool negotiated = TMC2209.negotiate_baud(negotiation, 1000000, 0x01);
+	probe_bytes = sim.usart(0).stats().bytes_sent - probe_bytes;
+	TMC2209.set_retry_policy(TMC_Serial::configuration, 1);
+	TMC2209.set_priority(TMC_Serial::IFCNT);
+	for (uint8_t i = 0; i < negotiation.steps; ++i)
+		std::printf("  %7u baud: %u reads, %u CRC errors, %u timeouts\n", (unsigned)negotiation.tried[i].baud,
+			negotiation.tried[i].reads, negotiation.tried[i].crc_errors, negotiation.tried[i].timeouts);
+	std::printf("  settled on %u baud, %llu bytes sent\n", (unsigned)TMC2209.get_baud(), (unsigned long long)probe_bytes);
+	failures += probe_bytes != negotiation.steps * 32u * TMC_Serial::read_access_datagram::datagram_length;	// Not a single retry
+	failures += !negotiated || TMC2209.get_baud() != negotiation.baud || negotiation.baud > 750000 || negotiation.baud < 750000 * 8 / 9;
+
+	const USART_Model::statistics& line = sim.usart(0).stats();
+	std::printf("USART0: %llu bytes sent, %llu received, wire busy %.1f %% of %.2f ms, %llu timeouts\n",
+		(unsigned long long)line.bytes_sent, (unsigned long long)line.bytes_received,
+		100.0 * line.busy_cycles / sim.now(), sim.now() * 1e3 / SAM3X_Sim::clock_hz, (unsigned long long)line.timeouts);
+
+	std::printf(failures == 0 ? "OK\n" : "%u FAILURES\n", failures);
+	return failures == 0 ? 0 : 1;
+}